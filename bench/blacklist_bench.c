@@ -0,0 +1,265 @@
+//
+// Auto blacklist table benchmark: the sharded Robin Hood table of src/auto_blacklist.c against
+// the chained table it replaced (ip % hash-size, malloc'd entries, one mutex per chain), kept
+// here in its hot path only. Both see the same addresses: sixteen sequential /16 scans, the
+// worst case for ip % hash-size.
+//
+//   ./blacklist_bench [-n addresses] [-b old-buckets] [-s old-sample] [-t threads] [-x]
+//
+// The old table is filled completely, its lookups are timed on a sample. -x skips it.
+//
+
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "logger.h"
+#include "auto_blacklist.h"
+
+#define LOOKUP_STRIDE 7919u
+
+struct legacy_entry_t {
+    uint32_t ipaddr;
+    struct {
+        int counter;
+        int slot_index;
+    } access_count[RESERVED_ENTRY];
+    time_t recent;
+    int counter;
+    int success_counter;
+    struct timeval log_time;
+    struct legacy_entry_t *next;
+};
+
+struct legacy_header_t {
+    struct legacy_entry_t *entries;
+    pthread_mutex_t mutex;
+};
+
+static struct legacy_header_t *legacy_buffer;
+static int legacy_size = 513;
+static pthread_mutex_t legacy_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct auto_blacklist_service_t *service;
+static struct in6_addr *addresses;
+static int number_of_addresses = 1000000;
+static int number_of_threads = 1;
+
+static double now () {
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int current_time_index (int *slot_index) {
+    const int simplified = time (NULL) / 10;
+
+    *slot_index = simplified;
+    return simplified % RESERVED_ENTRY;
+}
+
+static struct legacy_entry_t *legacy_find_and_increase (const struct in6_addr *address) {
+    uint32_t ip;
+
+    memcpy (&ip, &address->s6_addr[12], sizeof ip);
+    ip = ntohl (ip);
+
+    struct legacy_header_t *header = &legacy_buffer[ip % legacy_size];
+    struct legacy_entry_t *entry;
+    int slot_index;
+    const int index = current_time_index (&slot_index);
+
+    pthread_mutex_lock (&header->mutex);
+
+    for (entry = header->entries; entry != NULL && entry->ipaddr != ip; entry = entry->next);
+
+    if (entry == NULL) {
+        // the old allocator took a global pool mutex on every new entry
+        pthread_mutex_lock (&legacy_pool_mutex);
+        entry = calloc (1, sizeof (struct legacy_entry_t));
+        pthread_mutex_unlock (&legacy_pool_mutex);
+
+        entry->ipaddr = ip;
+        entry->next = header->entries;
+        header->entries = entry;
+        gettimeofday (&entry->log_time, NULL);
+    }
+
+    if (entry->access_count[index].slot_index != slot_index) {
+        entry->counter -= entry->access_count[index].counter;
+        entry->access_count[index].counter = 0;
+        entry->access_count[index].slot_index = slot_index;
+    }
+    pthread_mutex_unlock (&header->mutex);
+
+    entry->access_count[index].counter++;
+    entry->counter++;
+
+    return entry;
+}
+
+static void legacy_release () {
+    int k;
+
+    for (k = 0; k < legacy_size; k++) {
+        while (legacy_buffer[k].entries != NULL) {
+            struct legacy_entry_t *entry = legacy_buffer[k].entries;
+
+            legacy_buffer[k].entries = entry->next;
+            free (entry);
+        }
+        pthread_mutex_destroy (&legacy_buffer[k].mutex);
+    }
+    free (legacy_buffer);
+}
+
+static void bench_legacy (const int sample) {
+    double started, filled, finished;
+    int i, k;
+
+    legacy_buffer = calloc (legacy_size, sizeof (struct legacy_header_t));
+
+    for (k = 0; k < legacy_size; k++) {
+        pthread_mutex_init (&legacy_buffer[k].mutex, NULL);
+    }
+
+    started = now ();
+
+    for (i = 0; i < number_of_addresses; i++) {
+        legacy_find_and_increase (&addresses[i]);
+    }
+    filled = now ();
+
+    for (i = 0; i < sample; i++) {
+        legacy_find_and_increase (&addresses[(i * LOOKUP_STRIDE) % number_of_addresses]);
+    }
+    finished = now ();
+
+    printf ("old chained table, %d buckets: %8.3f us per insert, %8.3f us per lookup (%d sampled)\n",
+            legacy_size,
+            (filled - started) / number_of_addresses * 1e6,
+            (finished - filled) / sample * 1e6, sample);
+
+    legacy_release ();
+}
+
+static void *lookup_main (void *args) {
+    const long id = (long) args;
+    struct ip_access_entry_t copy;
+    int i;
+
+    for (i = id; i < number_of_addresses; i += number_of_threads) {
+        service->find_and_increase (&addresses[(i * LOOKUP_STRIDE) % number_of_addresses], &copy);
+    }
+    return NULL;
+}
+
+static void bench_sharded (const int capacity, const int shards) {
+    struct ip_access_entry_t copy;
+    struct auto_blacklist_stats_t stats;
+    pthread_t *threads = calloc (number_of_threads, sizeof (pthread_t));
+    double started, filled, looked_up, finished;
+    long t;
+    int i;
+
+    service = new_auto_blacklist_service (capacity, shards, 86400, 32, 64);
+
+    started = now ();
+
+    for (i = 0; i < number_of_addresses; i++) {
+        service->find_and_increase (&addresses[i], &copy);
+    }
+    filled = now ();
+
+    for (i = 0; i < number_of_addresses; i++) {
+        service->find_and_increase (&addresses[(i * LOOKUP_STRIDE) % number_of_addresses], &copy);
+    }
+    looked_up = now ();
+
+    for (t = 0; t < number_of_threads; t++) {
+        pthread_create (&threads[t], NULL, lookup_main, (void *) t);
+    }
+
+    for (t = 0; t < number_of_threads; t++) {
+        pthread_join (threads[t], NULL);
+    }
+    finished = now ();
+
+    service->get_stats (&stats);
+
+    printf ("sharded table, %d x %d:   %8.3f us per insert, %8.3f us per lookup, %8.3f us per lookup on %d thread(s)\n",
+            stats.shards, stats.capacity / stats.shards,
+            (filled - started) / number_of_addresses * 1e6,
+            (looked_up - filled) / number_of_addresses * 1e6,
+            (finished - looked_up) / number_of_addresses * 1e6, number_of_threads);
+    printf ("entries: %d / %d, longest probe: %d\n", stats.entries, stats.capacity, stats.longest_probe);
+
+    free (threads);
+}
+
+int main (int argc, char *argv[]) {
+    int sample = 10000;
+    int shards = 16;
+    bool with_legacy = true;
+    int c, i;
+
+    while ((c = getopt (argc, argv, "n:b:s:t:x")) != EOF) {
+        switch (c) {
+        case 'n':
+            number_of_addresses = atoi (optarg);
+            break;
+        case 'b':
+            legacy_size = atoi (optarg);
+            break;
+        case 's':
+            sample = atoi (optarg);
+            break;
+        case 't':
+            number_of_threads = atoi (optarg);
+            break;
+        case 'x':
+            with_legacy = false;
+            break;
+        default:
+            fprintf (stderr, "usage: %s [-n addresses] [-b old-buckets] [-s old-sample] [-t threads] [-x]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (number_of_addresses <= 0 || legacy_size <= 0 || sample <= 0 || number_of_threads <= 0) {
+        fprintf (stderr, "%s: counts must be positive\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    excalibur_common_logger.setPriority (log_warning);
+
+    addresses = calloc (number_of_addresses, sizeof (struct in6_addr));
+
+    for (i = 0; i < number_of_addresses; i++) {
+        const uint32_t ip = htonl (((10u + i / 65536) << 24) | (i % 65536));
+
+        addresses[i].s6_addr[10] = 0xff;
+        addresses[i].s6_addr[11] = 0xff;
+        memcpy (&addresses[i].s6_addr[12], &ip, sizeof ip);
+    }
+
+    printf ("%d distinct IPv4 addresses from sequential /16 scans\n", number_of_addresses);
+
+    if (with_legacy) {
+        bench_legacy (sample);
+    }
+    // the same headroom as the sample configuration: one eighth over the addresses
+    bench_sharded (number_of_addresses + number_of_addresses / 8, shards);
+
+    service->terminate ();
+    free (addresses);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,42 @@
+//
+// TTL cache in front of the per-client admission queries.
+//
+
+#ifndef TCP_PROXY_ADMISSION_CACHE_H
+#define TCP_PROXY_ADMISSION_CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <netinet/in.h>
+#include "context.h"
+#include "db_service.h"
+
+#define ADMISSION_CACHE_DEFAULT_CONTEXT_NAME "admission-cache"
+
+struct admission_cache_stats_t {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t refreshes;
+    uint64_t evictions;
+    // cache full: entries freed for a new address, new addresses left out
+    uint64_t displaced;
+    uint64_t not_cached;
+    int entries;
+    int max_entries;
+    int ttl;
+    int negative_ttl;
+};
+
+struct admission_cache_t {
+    context_aware_data_t context;
+    struct db_proxy_request_t * (*check_available) (const struct in6_addr *address, const char *remote_ip);
+    int (*connection_blacklisted) (const struct in6_addr *address, const char *remote_ip);
+    int (*check_vip) (const struct in6_addr *address, const char *remote_ip);
+    int (*invalidate) (const struct in6_addr *address);
+    void (*get_stats) (struct admission_cache_stats_t *stats);
+};
+
+extern struct admission_cache_t *new_admission_cache (const int ttl, const int negative_ttl, const int max_entries,
+        const int hash_size);
+
+#endif //TCP_PROXY_ADMISSION_CACHE_H
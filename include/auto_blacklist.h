@@ -18,25 +18,67 @@ struct access_entry_t {
     int slot_index;
 };
 
+/**
+ * address is the client address cut down to its tracked prefix; IPv4 clients are kept
+ * IPv4-mapped, so prefix_length counts from the start of the IPv6 form (128: one host).
+ */
 struct ip_access_entry_t {
-    uint32_t ipaddr;
+    struct in6_addr address;
+    int prefix_length;
     struct access_entry_t access_count[RESERVED_ENTRY];
     time_t recent;
     int counter;
     int success_counter;
     struct timeval log_time;
+    int expiry_slot;
     struct ip_access_entry_t *next;
 };
 
+struct auto_blacklist_stats_t {
+    int entries;
+    int capacity;
+    int shards;
+    int longest_probe;
+    uint64_t sweeps;
+    uint64_t examined;
+    uint64_t expired;
+    uint64_t evicted;
+    int last_examined;
+    int last_expired;
+    double last_duration;
+    double max_duration;
+};
+
 struct auto_blacklist_service_t {
     context_aware_data_t context;
-    struct ip_access_entry_t * (*find_and_increase) (struct in_addr *address);
+    /**
+     * count one more connection from address
+     *
+     * @param address
+     * @param copy receives the entry as it is after counting, taken under the shard lock
+     * @return false only if the table has no room at all; when full the lowest count nearby is evicted
+     */
+    bool (*find_and_increase) (const struct in6_addr *address, struct ip_access_entry_t *copy);
+    /**
+     * one more connection from address got through
+     */
+    void (*increase_success) (const struct in6_addr *address);
+    /**
+     * rate limit for per-client log lines
+     *
+     * @return true (and start over) if interval seconds passed since the entry's last log line
+     */
+    bool (*log_due) (const struct in6_addr *address, const double interval);
     void (*terminate) (void);
     void (*expiring) (void);
     void (*for_each) (void (*callback) (struct ip_access_entry_t *));
+    void (*get_stats) (struct auto_blacklist_stats_t *stats);
+    int (*restore) (const char *file, const int interval);
+    bool (*snapshot) (void);
 };
 
-extern struct auto_blacklist_service_t *new_auto_blacklist_service (const int hash_size, const int monitor_period);
+extern struct auto_blacklist_service_t *new_auto_blacklist_service (const int capacity, const int shards, const int monitor_period,
+                                                                   const int ipv4_prefix, const int ipv6_prefix);
 extern struct auto_blacklist_service_t *get_auto_blacklist_service();
 
 #endif //TCP_PROXY_AUTO_BLACKLIST_H
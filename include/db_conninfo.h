@@ -5,4 +5,5 @@ struct db_connection_info_t {
     const char	*  dbname;
     const char	*  dbuser;
     const char	*  dbpasswd;
+    int            connect_timeout;
 };
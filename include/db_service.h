@@ -6,6 +6,7 @@
 #define TCP_PROXY_DB_SERVICE_H
 
 #include <sys/types.h>
+#include <stdint.h>
 #include <stdbool.h>
 #include <time.h>
 #include "logger.h"
@@ -22,6 +23,40 @@ struct db_proxy_request_t {
     int channel;
 };
 
+struct db_write_behind_stats_t {
+    int capacity;
+    int pending;
+    int batch_size;
+    int flush_interval;
+    uint64_t queued;
+    uint64_t written;
+    uint64_t dropped;
+    uint64_t failed;
+    uint64_t batches;
+};
+
+enum db_breaker_state_enum {
+    DB_BREAKER_CLOSED,
+    DB_BREAKER_OPEN,
+    DB_BREAKER_HALF_OPEN,
+};
+
+struct db_pool_stats_t {
+    enum db_breaker_state_enum breaker_state;
+    int size;
+    int connected;
+    int in_use;
+    uint64_t checkouts;
+    uint64_t waits;
+    uint64_t wait_usec;
+    uint64_t max_wait_usec;
+    uint64_t reconnects;
+    uint64_t health_check_failures;
+    uint64_t retired;
+    uint64_t breaker_trips;
+    uint64_t fast_failures;
+};
+
 struct database_service_t {
     context_aware_data_t context;
     struct db_proxy_request_t * (*check_available) (const char *remote_ip);
@@ -32,7 +67,6 @@ struct database_service_t {
     int (*check_vip) (const char *ipaddr);
     int (*add_ip_to_auto_blacklist) (const char *ipaddr);
     void (*close_idle) (const struct timeval *, const struct tm *tm);
-    void (*done) (void);
     void (*set_logger) (struct logger_t *new_logger);
     bool (*fail_guessing) (const char * const ip_address);
     int (*add_kms_details) (const struct connection_info *info,
@@ -46,6 +80,9 @@ struct database_service_t {
     int (*update_machine_owner) (const struct connection_info *info, const char * const client_machine_id);
     void (*reload_product_names) (void);
     const char * const (*get_product_name) (const char *const app_id, const char * const kms_id);
+    void (*get_write_behind_stats) (struct db_write_behind_stats_t *stats);
+    void (*get_pool_stats) (struct db_pool_stats_t *stats);
+    bool (*is_available) (void);
 };
 
 struct database_service_t *new_database_service (struct system_config_t *sysconf);
@@ -44,6 +44,8 @@ struct db_xsql_stmt_t {
     void	*data;
     struct db_xsql_result_t * (*executeQuery) (struct db_xsql_stmt_t *self, int *errcode);
     int (*executeUpdate) (struct db_xsql_stmt_t *self, int *errcode);
+    // AUTO_INCREMENT value generated by the last executeUpdate (0: none)
+    uint64_t (*getInsertId) (struct db_xsql_stmt_t *self);
     bool (*executeMultipleQuery) (struct db_xsql_stmt_t *self, int *errcode, void *padLoad, void (*result_handler) (struct db_xsql_result_t *, void *padLoad));
 
     void (*clearParameters) (struct db_xsql_stmt_t *self);
@@ -68,8 +70,13 @@ struct db_xsql_t {
 
     bool			(*connect) (struct db_xsql_data_t *self);
     void			(*disconnect) (struct db_xsql_data_t *self);
+    bool			(*ping) (struct db_xsql_data_t *self);
     struct db_xsql_stmt_t *	(*createStatement) (struct db_xsql_data_t *self, const char *statement);
 
+    bool			(*beginTransaction) (struct db_xsql_data_t *self);
+    bool			(*commit) (struct db_xsql_data_t *self);
+    bool			(*rollback) (struct db_xsql_data_t *self);
+
     void			(*setLogger) (struct logger_t *logger);
 
     const char *    (*error) (struct db_xsql_data_t *self);
@@ -0,0 +1,44 @@
+//
+// Mirror blacklisted clients into an nftables drop set, so their SYNs never reach accept().
+//
+
+#ifndef TCP_PROXY_DROP_SET_EXPORTER_H
+#define TCP_PROXY_DROP_SET_EXPORTER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <netinet/in.h>
+#include "context.h"
+
+#define DROP_SET_EXPORTER_DEFAULT_CONTEXT_NAME "drop-set-exporter"
+
+struct drop_set_stats_t {
+    bool enabled;
+    const char *table;
+    int timeout;
+    int pending;
+    int capacity;
+    uint64_t queued;
+    uint64_t duplicates;
+    uint64_t dropped;
+    uint64_t exported;
+    uint64_t failed;
+    uint64_t batches;
+};
+
+struct drop_set_exporter_t {
+    context_aware_data_t context;
+    /**
+     * queue a blacklisted client for the kernel drop set, never blocks
+     *
+     * @param address IPv6, or IPv4-mapped
+     * @param prefix_length over 128 bits; 128 for a single host, or the auto blacklist prefix
+     *        (drop-set-prefixes); dropped by the kernel until the element times out
+     */
+    void (*block) (const struct in6_addr *address, const int prefix_length);
+    void (*get_stats) (struct drop_set_stats_t *stats);
+};
+
+extern struct drop_set_exporter_t *new_drop_set_exporter (const char *table, const int timeout, const bool setup, const char *command);
+
+#endif //TCP_PROXY_DROP_SET_EXPORTER_H
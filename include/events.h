@@ -5,17 +5,38 @@
 #ifndef TCP_PROXY_EVENTS_H
 #define TCP_PROXY_EVENTS_H
 
+#include <sys/epoll.h>
 #include <stdbool.h>
+#include <stdint.h>
+
+#define EVENT_READ EPOLLIN
+#define EVENT_WRITE EPOLLOUT
+#define EVENT_FAILURE (EPOLLERR | EPOLLHUP)
 
 struct logger_t;
 
+struct event_loop_stats_t {
+    uint64_t wakeups;
+    uint64_t events;
+    int recent_events;
+    int max_events_per_wakeup;
+    int registered;
+    int capacity;
+    int max_registrations;
+};
+
 struct event_loop_t {
-    bool (*remove_event) (int index);
-    int (*add_event) (int fd, void (*handler) (const int, void *), void *data);
-    int (*looping)();
-    int (*count)();
+    void *data;
+    bool (*remove_event) (struct event_loop_t *self, int index);
+    int (*add_event) (struct event_loop_t *self, int fd, const uint32_t events,
+                      void (*handler) (const int fd, const uint32_t events, void *data), void *data);
+    bool (*modify_event) (struct event_loop_t *self, int index, const uint32_t events);
+    int (*looping) (struct event_loop_t *self);
+    int (*count) (struct event_loop_t *self);
+    void (*get_stats) (struct event_loop_t *self, struct event_loop_stats_t *stats);
+    void (*dispose) (struct event_loop_t *self);
 };
 
-struct event_loop_t *new_event_loop (struct logger_t *newLogger);
+struct event_loop_t *new_event_loop (struct logger_t *newLogger, const int max_registrations);
 
 #endif
@@ -8,6 +8,12 @@
 #include <stdbool.h>
 #include <stdarg.h>
 
+/**
+ * Call f with the remaining arguments; a SIGSEGV, SIGBUS, SIGFPE or SIGILL raised inside
+ * f returns to here instead of killing the process. Safe to use from any thread.
+ *
+ * @return true when f faulted
+ */
 extern bool try_catch (void f (va_list ap), ...);
 
 #endif //TCP_PROXY_EXCEPTION_H
@@ -0,0 +1,47 @@
+//
+// Longest-prefix (CIDR) matching over IPv4 and IPv6 addresses.
+//
+
+#ifndef TCP_PROXY_IP_PREFIX_TRIE_H
+#define TCP_PROXY_IP_PREFIX_TRIE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+struct ip_prefix_trie_t {
+    void *data;
+    /**
+     * "10.0.0.0/8", "2001:db8::/32", a plain address (host prefix), or the older
+     * textual form "::ffff:10.0.0." / "fe80::" (whole octets / groups given)
+     *
+     * @param self
+     * @param prefix
+     * @return false if prefix cannot be parsed
+     */
+    bool (*add) (struct ip_prefix_trie_t *self, const char *const prefix);
+    /**
+     * "fe80::" is an address as well; add takes it as the groups written down, fe80::/16
+     *
+     * @param self
+     * @param prefix
+     * @param cidr receives the CIDR add makes of prefix, e.g. "fe80::/16"
+     * @param size
+     * @return true if prefix is an IPv6 address read as the older textual form
+     */
+    bool (*legacy_cidr) (struct ip_prefix_trie_t *self, const char *const prefix, char *cidr, const size_t size);
+    /**
+     * lock free, safe to call from any thread once the trie is no longer being added to
+     *
+     * @param self
+     * @param address IPv6, or IPv4-mapped
+     * @return true if any prefix covers address
+     */
+    bool (*contains) (struct ip_prefix_trie_t *self, const struct in6_addr *address);
+    int (*size) (struct ip_prefix_trie_t *self);
+    void (*dispose) (struct ip_prefix_trie_t *self);
+};
+
+extern struct ip_prefix_trie_t *new_ip_prefix_trie (void);
+
+#endif //TCP_PROXY_IP_PREFIX_TRIE_H
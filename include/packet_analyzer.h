@@ -6,6 +6,7 @@
 #define PACKET_ANALYZER_H
 
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
@@ -14,11 +15,23 @@
 #include "proxying.h"
 
 #define PACKET_ANALYZER_MODULE_NAME "pluggablePacketAnalyzer"
+#define PACKET_ANALYZER_V2_MODULE_NAME "pluggablePacketAnalyzerV2"
 #define PACKET_ANALYZER_DEFAULT_CONTEXT_NAME "packet-analyzer"
 
 #define SYSTEM_CONF_VARIABLE_PACKET_ANALYZER_PLUGIN "packet-analyzer-plugin"
 #define DEFAULT_PACKET_ANALYZER_PLUGIN_LOCATION  "/usr/local/lib/tcp-proxy/libpkanalyzer.so"
 
+#define PACKET_ANALYZER_MAGIC_NUMBER 1886085486
+#define PACKET_ANALYZER_MAJOR_VERSION 2
+#define PACKET_ANALYZER_MINOR_VERSION 0
+
+#define PACKET_ANALYZER_CLIENT_TO_SERVER 1
+#define PACKET_ANALYZER_SERVER_TO_CLIENT 2
+#define PACKET_ANALYZER_BOTH_DIRECTIONS (PACKET_ANALYZER_CLIENT_TO_SERVER | PACKET_ANALYZER_SERVER_TO_CLIENT)
+
+/**
+ * Version 1 plugins export this as PACKET_ANALYZER_MODULE_NAME.
+ */
 struct pluggable_packet_analyzer_t {
     void (*init) (struct application_context_t *context);
     void* (*allocate) (void);
@@ -26,16 +39,65 @@ struct pluggable_packet_analyzer_t {
     uint64_t (*analyze) (struct connection_info *info, bool fromClient, char *buffer, const ssize_t len);
 };
 
+/**
+ * Version 2 plugins export this as PACKET_ANALYZER_V2_MODULE_NAME, the header carries
+ * PACKET_ANALYZER_MAGIC_NUMBER and the version they were built against.
+ *
+ * One of analyze / analyze_batch is required, analyze_batch wins when both are set.
+ * on_open / on_close may be NULL. info->packet_analyzer_data is the plugin's own data.
+ *
+ * directions and max_bytes tell the proxy what the plugin wants to see: once a direction
+ * has delivered max_bytes (0: no limit), or for a direction it did not ask for, the plugin
+ * is not called and the relay may take the zero-copy path.
+ */
+struct pluggable_packet_analyzer_v2_t {
+    context_data_header_t header;
+    void (*init) (struct application_context_t *context);
+    void* (*allocate) (void);
+    void (*release) (void *data);
+    uint64_t (*analyze) (struct connection_info *info, bool fromClient, char *buffer, const ssize_t len);
+    uint64_t (*analyze_batch) (struct connection_info *info, bool fromClient, const struct iovec *iov, const int iovcnt);
+    void (*on_open) (struct connection_info *info);
+    void (*on_close) (struct connection_info *info);
+    uint32_t directions;
+    uint64_t max_bytes;
+};
+
+struct packet_analyzer_stats_t {
+    bool async;
+    int rings;
+    int ring_size;
+    int batch_size;
+    int pending;
+    int sessions;
+    int abi_version;
+    int generation;
+    int retired;
+    int retired_sessions;
+    uint64_t swaps;
+    uint64_t closed;
+    uint64_t enqueued;
+    uint64_t analyzed;
+    uint64_t batches;
+    uint64_t dropped;
+    uint64_t dropped_bytes;
+};
+
 struct packet_analyzer_t {
     context_aware_data_t context;
     int (*load_packet_analyzer) (bool boot, const char *module_name);
     bool (*load) (const char *file, const char *symbol);
     bool (*unload) (void);
+    bool (*swap) (const char *file);
     bool (*set_enable) (const bool on_off);
     void (*set_safe_mode) (const bool on_off);
     bool (*get_safe_mode) (void);
-    void* (*allocate) (void);
-    void (*release) (void *data);
+    bool (*set_async_mode) (const bool on_off);
+    bool (*get_async_mode) (void);
+    void (*get_stats) (struct packet_analyzer_stats_t *stats);
+    void* (*allocate) (struct connection_info *info);
+    void (*release) (struct connection_info *info);
+    bool (*wants) (const struct connection_info *info, const bool fromClient);
     uint64_t (*analyze_packet) (struct connection_info *info, bool fromClient, char *buffer, const ssize_t len);
 };
 
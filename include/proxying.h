@@ -12,6 +12,17 @@
 
 #define PROXYING_SERVICE_DEFAULT_CONTEXT_NAME "proxying-service"
 
+struct proxy_worker_t;
+struct event_loop_stats_t;
+
+struct relay_buffer_t {
+    char *data;
+    size_t offset;
+    size_t length;
+    int pipe_fds[2];
+    bool in_pipe;
+};
+
 struct connection_info {
     int64_t connection_id;
     int client_fd;
@@ -34,6 +45,40 @@ struct connection_info {
     struct connection_info *next;
     int attempts;
     void *packet_analyzer_data;
+    struct proxy_worker_t *worker;
+    struct relay_buffer_t upstream;
+    struct relay_buffer_t downstream;
+    bool connecting;
+    int channel;
+    int client_port;
+    struct timeval connect_deadline;
+    struct connection_info *connect_prev;
+    struct connection_info *connect_next;
+};
+
+struct listen_stats_t {
+    int backlog;
+    int somaxconn;
+    int defer_accept;
+    int fastopen;
+    int accept_batch;
+    uint64_t accepted;
+    uint64_t wakeups;
+    uint64_t budget_exhausted;
+    uint64_t errors;
+    // out of descriptors: connections accepted and closed right away, listener pauses
+    uint64_t shed;
+    uint64_t pauses;
+    int max_per_wakeup;
+    // host wide, from /proc/net/netstat
+    bool netstat_available;
+    uint64_t listen_overflows;
+    uint64_t listen_drops;
+    uint64_t request_queue_full_drops;
+    uint64_t syncookies_sent;
+    uint64_t defer_accept_drops;
+    uint64_t fastopen_passive;
+    uint64_t fastopen_overflows;
 };
 
 struct proxying_service_t {
@@ -44,6 +89,9 @@ struct proxying_service_t {
     int (*get_fallback_channel) (void);
     int (*set_default_channel) (const int channel);
     int (*set_fallback_channel) (const int channel);
+    int (*get_number_of_workers) (void);
+    bool (*get_event_stats) (const int worker, struct event_loop_stats_t *stats);
+    void (*get_listen_stats) (struct listen_stats_t *stats);
 };
 
 struct proxying_service_t * init_proxying_service ();
@@ -0,0 +1,504 @@
+//
+// TTL cache in front of the per-client admission queries.
+//
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "global_vars.h"
+#include "logger.h"
+#include "sysconf.h"
+#include "db_service.h"
+#include "admission_cache.h"
+#include "context.h"
+
+#define REFRESH_PERIOD 5
+
+enum admission_query_enum {
+    QUERY_CHECK_AVAILABLE,
+    QUERY_BLACKLIST,
+    QUERY_CHECK_VIP,
+    NUMBER_OF_QUERIES,
+};
+
+struct admission_cache_entry_t {
+    struct in6_addr address;
+    char remote_ip[INET6_ADDRSTRLEN];
+    time_t expires[NUMBER_OF_QUERIES];
+    bool used[NUMBER_OF_QUERIES];
+    bool available;
+    struct db_proxy_request_t request;
+    int blacklisted;
+    int vip;
+    struct admission_cache_entry_t *next;
+};
+
+struct admission_cache_bucket_t {
+    struct admission_cache_entry_t *entries;
+    pthread_mutex_t mutex;
+};
+
+static struct logger_t *logger = &excalibur_common_logger;
+static struct database_service_t *db_svc = NULL;
+static struct admission_cache_bucket_t *buckets = NULL;
+static int number_of_buckets = 0;
+static int positive_ttl = 60;
+static int negative_ttl = 5;
+static int number_of_entries = 0;
+static int max_entries = 65536;
+static uint64_t hits = 0L;
+static uint64_t misses = 0L;
+static uint64_t refreshes = 0L;
+static uint64_t evictions = 0L;
+static uint64_t displaced = 0L;
+static uint64_t not_cached = 0L;
+static pthread_t refresh_thread;
+
+static struct admission_cache_bucket_t *bucket_of (const struct in6_addr *address) {
+    const uint32_t *words = (const uint32_t *) address;
+    uint32_t hash = words[0] ^ words[1] ^ words[2] ^ words[3];
+
+    hash ^= hash >> 16;
+    hash *= 0x45d9f3b;
+    hash ^= hash >> 16;
+
+    return &buckets[hash % number_of_buckets];
+}
+
+static struct admission_cache_entry_t *find_entry (struct admission_cache_bucket_t *bucket, const struct in6_addr *address) {
+    struct admission_cache_entry_t *entry;
+
+    for (entry = bucket->entries; entry != NULL; entry = entry->next) {
+        if (memcmp (&entry->address, address, sizeof (struct in6_addr)) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void free_entry (struct admission_cache_entry_t *entry) {
+    if (entry->request.account != NULL) {
+        free (entry->request.account);
+    }
+    free (entry);
+    __sync_sub_and_fetch (&number_of_entries, 1);
+}
+
+static time_t stale_at (const struct admission_cache_entry_t *entry) {
+    time_t last = 0;
+    int query;
+
+    for (query = 0; query < NUMBER_OF_QUERIES; query++) {
+        last = entry->expires[query] > last ? entry->expires[query] : last;
+    }
+    return last;
+}
+
+/**
+ * The cache is full: free the entry of this bucket whose results all go stale first. The bucket
+ * is the only one locked, so an address hashed to an empty bucket is not cached at all.
+ *
+ * @return false if there was nothing to take the place of
+ */
+static bool make_room (struct admission_cache_bucket_t *bucket) {
+    struct admission_cache_entry_t **ptr, **victim = NULL;
+
+    for (ptr = &bucket->entries; *ptr != NULL; ptr = &(*ptr)->next) {
+        if (victim == NULL || stale_at (*ptr) < stale_at (*victim)) {
+            victim = ptr;
+        }
+    }
+
+    if (victim == NULL) {
+        __sync_add_and_fetch (&not_cached, 1);
+        return false;
+    }
+
+    struct admission_cache_entry_t *entry = *victim;
+
+    *victim = entry->next;
+    free_entry (entry);
+    __sync_add_and_fetch (&displaced, 1);
+    return true;
+}
+
+static struct admission_cache_entry_t *find_or_create_entry (struct admission_cache_bucket_t *bucket,
+        const struct in6_addr *address, const char *remote_ip) {
+    struct admission_cache_entry_t *entry = find_entry (bucket, address);
+
+    if (entry == NULL && number_of_entries >= max_entries && !make_room (bucket)) {
+        return NULL;
+    }
+
+    if (entry == NULL && (entry = calloc (1, sizeof (struct admission_cache_entry_t))) != NULL) {
+        entry->address = *address;
+        snprintf (entry->remote_ip, sizeof entry->remote_ip, "%s", remote_ip);
+        entry->next = bucket->entries;
+        bucket->entries = entry;
+        __sync_add_and_fetch (&number_of_entries, 1);
+    }
+    return entry;
+}
+
+static struct db_proxy_request_t *copy_request (const struct db_proxy_request_t *request) {
+    struct db_proxy_request_t *copy = malloc (sizeof (struct db_proxy_request_t));
+
+    if (copy != NULL) {
+        copy->sn = request->sn;
+        copy->channel = request->channel;
+        copy->account = request->account != NULL ? strdup (request->account) : NULL;
+    }
+    return copy;
+}
+
+static void store_available (struct admission_cache_entry_t *entry, const struct db_proxy_request_t *request, const time_t now) {
+    if (entry->request.account != NULL) {
+        free (entry->request.account);
+        entry->request.account = NULL;
+    }
+
+    entry->available = request != NULL;
+
+    if (request != NULL) {
+        entry->request.sn = request->sn;
+        entry->request.channel = request->channel;
+        entry->request.account = request->account != NULL ? strdup (request->account) : NULL;
+    }
+    entry->expires[QUERY_CHECK_AVAILABLE] = now + (request != NULL ? positive_ttl : negative_ttl);
+}
+
+static int query_counter (const enum admission_query_enum query, const char *remote_ip) {
+    return query == QUERY_BLACKLIST ? db_svc->connection_blacklisted (remote_ip) : db_svc->check_vip (remote_ip);
+}
+
+static void store_counter (struct admission_cache_entry_t *entry, const enum admission_query_enum query, const int value, const time_t now) {
+    if (query == QUERY_BLACKLIST) {
+        entry->blacklisted = value;
+    } else {
+        entry->vip = value;
+    }
+    entry->expires[query] = now + (value > 0 ? positive_ttl : negative_ttl);
+}
+
+static struct db_proxy_request_t *cached_check_available (const struct in6_addr *address, const char *remote_ip) {
+    if (positive_ttl <= 0) {
+        return db_svc->check_available (remote_ip);
+    }
+
+    struct admission_cache_bucket_t *bucket = bucket_of (address);
+    struct admission_cache_entry_t *entry;
+    struct db_proxy_request_t *request = NULL;
+    time_t now = time (NULL);
+
+    pthread_mutex_lock (&bucket->mutex);
+
+    if ((entry = find_entry (bucket, address)) != NULL && entry->expires[QUERY_CHECK_AVAILABLE] > now) {
+        entry->used[QUERY_CHECK_AVAILABLE] = true;
+
+        if (entry->available) {
+            request = copy_request (&entry->request);
+        }
+        pthread_mutex_unlock (&bucket->mutex);
+
+        __sync_add_and_fetch (&hits, 1);
+        return request;
+    }
+    pthread_mutex_unlock (&bucket->mutex);
+
+    __sync_add_and_fetch (&misses, 1);
+    request = db_svc->check_available (remote_ip);
+    now = time (NULL);
+
+    // an answer given while the database is down is not worth remembering
+    if (db_svc->is_available ()) {
+        pthread_mutex_lock (&bucket->mutex);
+
+        if ((entry = find_or_create_entry (bucket, address, remote_ip)) != NULL) {
+            store_available (entry, request, now);
+        }
+        pthread_mutex_unlock (&bucket->mutex);
+    }
+
+    return request;
+}
+
+static int cached_counter (const enum admission_query_enum query, const struct in6_addr *address, const char *remote_ip) {
+    if (positive_ttl <= 0) {
+        return query_counter (query, remote_ip);
+    }
+
+    struct admission_cache_bucket_t *bucket = bucket_of (address);
+    struct admission_cache_entry_t *entry;
+    time_t now = time (NULL);
+    int value;
+
+    pthread_mutex_lock (&bucket->mutex);
+
+    if ((entry = find_entry (bucket, address)) != NULL && entry->expires[query] > now) {
+        entry->used[query] = true;
+        value = query == QUERY_BLACKLIST ? entry->blacklisted : entry->vip;
+        pthread_mutex_unlock (&bucket->mutex);
+
+        __sync_add_and_fetch (&hits, 1);
+        return value;
+    }
+    pthread_mutex_unlock (&bucket->mutex);
+
+    __sync_add_and_fetch (&misses, 1);
+    value = query_counter (query, remote_ip);
+    now = time (NULL);
+
+    if (db_svc->is_available ()) {
+        pthread_mutex_lock (&bucket->mutex);
+
+        if ((entry = find_or_create_entry (bucket, address, remote_ip)) != NULL) {
+            store_counter (entry, query, value, now);
+        }
+        pthread_mutex_unlock (&bucket->mutex);
+    }
+
+    return value;
+}
+
+static int cached_connection_blacklisted (const struct in6_addr *address, const char *remote_ip) {
+    return cached_counter (QUERY_BLACKLIST, address, remote_ip);
+}
+
+static int cached_check_vip (const struct in6_addr *address, const char *remote_ip) {
+    return cached_counter (QUERY_CHECK_VIP, address, remote_ip);
+}
+
+/**
+ * Drop one address (or everything when address is NULL) so the next connection asks the database again.
+ *
+ * @return number of entries removed
+ */
+static int invalidate (const struct in6_addr *address) {
+    int i, removed = 0;
+
+    for (i = 0; i < number_of_buckets; i++) {
+        struct admission_cache_bucket_t *bucket = &buckets[i];
+        struct admission_cache_entry_t **ptr;
+
+        if (address != NULL && bucket != bucket_of (address)) {
+            continue;
+        }
+
+        pthread_mutex_lock (&bucket->mutex);
+
+        for (ptr = &bucket->entries; *ptr != NULL;) {
+            struct admission_cache_entry_t *entry = *ptr;
+
+            if (address == NULL || memcmp (&entry->address, address, sizeof (struct in6_addr)) == 0) {
+                *ptr = entry->next;
+                free_entry (entry);
+                removed++;
+            } else {
+                ptr = &entry->next;
+            }
+        }
+        pthread_mutex_unlock (&bucket->mutex);
+    }
+
+    logger->notice (__FILE__, __LINE__, "admission cache: %d entr%s invalidated", removed, removed == 1 ? "y" : "ies");
+    return removed;
+}
+
+struct refresh_work_t {
+    struct in6_addr address;
+    char remote_ip[INET6_ADDRSTRLEN];
+    enum admission_query_enum query;
+};
+
+/**
+ * Results that were used since they were loaded are re-queried shortly before they expire,
+ * so busy clients keep hitting the cache. Entries nobody asked for are evicted once expired.
+ */
+static void refresh_bucket (struct admission_cache_bucket_t *bucket, struct refresh_work_t **work, int *capacity) {
+    struct admission_cache_entry_t **ptr;
+    const time_t now = time (NULL);
+    const time_t horizon = now + REFRESH_PERIOD;
+    int i, n = 0;
+
+    pthread_mutex_lock (&bucket->mutex);
+
+    for (ptr = &bucket->entries; *ptr != NULL;) {
+        struct admission_cache_entry_t *entry = *ptr;
+        bool alive = false;
+        int query;
+
+        for (query = 0; query < NUMBER_OF_QUERIES; query++) {
+            if (entry->used[query] && entry->expires[query] != 0 && entry->expires[query] <= horizon) {
+                if (n == *capacity) {
+                    int new_capacity = *capacity > 0 ? *capacity * 2 : 64;
+                    struct refresh_work_t *enlarged = realloc (*work, new_capacity * sizeof (struct refresh_work_t));
+
+                    if (enlarged == NULL) {
+                        continue;
+                    }
+                    *work = enlarged;
+                    *capacity = new_capacity;
+                }
+                (*work)[n].address = entry->address;
+                memcpy ((*work)[n].remote_ip, entry->remote_ip, sizeof entry->remote_ip);
+                (*work)[n].query = query;
+                n++;
+
+                entry->used[query] = false;
+                alive = true;
+            } else if (entry->expires[query] > now) {
+                alive = true;
+            }
+        }
+
+        if (alive) {
+            ptr = &entry->next;
+        } else {
+            *ptr = entry->next;
+            free_entry (entry);
+            __sync_add_and_fetch (&evictions, 1);
+        }
+    }
+    pthread_mutex_unlock (&bucket->mutex);
+
+    // never hold the bucket while talking to the database
+    for (i = 0; i < n; i++) {
+        struct refresh_work_t *item = &(*work)[i];
+        struct admission_cache_entry_t *entry;
+
+        if (item->query == QUERY_CHECK_AVAILABLE) {
+            struct db_proxy_request_t *request = db_svc->check_available (item->remote_ip);
+
+            pthread_mutex_lock (&bucket->mutex);
+            if ((entry = find_entry (bucket, &item->address)) != NULL) {
+                store_available (entry, request, time (NULL));
+            }
+            pthread_mutex_unlock (&bucket->mutex);
+
+            if (request != NULL) {
+                free (request->account);
+                free (request);
+            }
+        } else {
+            const int value = query_counter (item->query, item->remote_ip);
+
+            pthread_mutex_lock (&bucket->mutex);
+            if ((entry = find_entry (bucket, &item->address)) != NULL) {
+                store_counter (entry, item->query, value, time (NULL));
+            }
+            pthread_mutex_unlock (&bucket->mutex);
+        }
+        __sync_add_and_fetch (&refreshes, 1);
+    }
+}
+
+static void *refresh_main (void *args) {
+    struct system_config_t *system_conf = (struct system_config_t *) get_application_context()->get_bean (SYSTEM_CONFIG_DEFAULT_CONTEXT_NAME);
+
+    struct refresh_work_t *work = NULL;
+    int capacity = 0;
+
+    while (!system_conf->terminated()) {
+        int i;
+
+        sleep (REFRESH_PERIOD);
+
+        // keep what is cached until the database answers again
+        if (!db_svc->is_available ()) continue;
+
+        for (i = 0; i < number_of_buckets && !system_conf->terminated(); i++) {
+            refresh_bucket (&buckets[i], &work, &capacity);
+        }
+    }
+    free (work);
+    return NULL;
+}
+
+static void get_stats (struct admission_cache_stats_t *stats) {
+    stats->hits = hits;
+    stats->misses = misses;
+    stats->refreshes = refreshes;
+    stats->evictions = evictions;
+    stats->displaced = displaced;
+    stats->not_cached = not_cached;
+    stats->entries = number_of_entries;
+    stats->max_entries = max_entries;
+    stats->ttl = positive_ttl;
+    stats->negative_ttl = negative_ttl;
+}
+
+static const char *const context_name (void) {
+    const static char *const name = ADMISSION_CACHE_DEFAULT_CONTEXT_NAME;
+    return name;
+}
+
+static const char **depends_on (int *number) {
+    static const char *dependencies[] = {
+        DATABASE_SERVICE_DEFAULT_CONTEXT_NAME,
+        SYSTEM_CONFIG_DEFAULT_CONTEXT_NAME,
+    };
+
+    *number = sizeof dependencies / sizeof dependencies[0];
+    return dependencies;
+}
+
+static void post_construct (void) {
+    db_svc = (struct database_service_t *) get_application_context()->get_bean (DATABASE_SERVICE_DEFAULT_CONTEXT_NAME);
+
+    if (positive_ttl > 0) {
+        pthread_create (&refresh_thread, NULL, refresh_main, NULL);
+        pthread_detach (refresh_thread);
+    }
+}
+
+static struct admission_cache_t instance = {
+    .context = {
+        .header = {
+            .magic = CONTEXT_MAGIC_NUMBER,
+            .version_major = CONTEXT_MAJOR_VERSION,
+            .version_minor = CONTEXT_MINOR_VERSION,
+        },
+        .name = context_name,
+        .post_construct = post_construct,
+        .depends_on = depends_on,
+    },
+    .check_available = cached_check_available,
+    .connection_blacklisted = cached_connection_blacklisted,
+    .check_vip = cached_check_vip,
+    .invalidate = invalidate,
+    .get_stats = get_stats,
+};
+
+static bool initialized = false;
+
+/**
+ * @param hash_size buckets, 0: a quarter of entries_limit
+ */
+struct admission_cache_t *new_admission_cache (const int ttl, const int ttl_of_negative, const int entries_limit,
+        const int hash_size) {
+    logger = get_application_context()->get_logger();
+
+    if (!initialized) {
+        int i;
+
+        positive_ttl = ttl;
+        negative_ttl = ttl_of_negative;
+        max_entries = entries_limit > 0 ? entries_limit : 1;
+        number_of_buckets = hash_size > 0 ? hash_size : (max_entries / 4) | 1;
+        buckets = malloc (number_of_buckets * sizeof (struct admission_cache_bucket_t));
+
+        for (i = 0; i < number_of_buckets; i++) {
+            buckets[i].entries = NULL;
+            pthread_mutex_init (&buckets[i].mutex, NULL);
+        }
+
+        initialized = true;
+    }
+    return &instance;
+}
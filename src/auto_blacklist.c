@@ -3,57 +3,244 @@
 //
 
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <stdbool.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <errno.h>
 #include <time.h>
 #include <pthread.h>
 #include "global_vars.h"
+#include "utils.h"
 #include "logger.h"
 #include "auto_blacklist.h"
 #include "context.h"
 
 
-static int hash_buffer_size = 0;
+#define EXPIRY_WHEEL_SIZE (RESERVED_ENTRY + 1)
+#define EXPIRY_BATCH 256
+#define EVICTION_WINDOW 16
+
+#define SNAPSHOT_MAGIC_NUMBER 0x4c425054
+#define SNAPSHOT_MAJOR_VERSION 1
+#define SNAPSHOT_MINOR_VERSION 0
+
+/**
+ * Snapshot file: this header, then count records. Host byte order, read back on the same
+ * machine; the checksums are FNV-1a over 64-bit words.
+ */
+struct blacklist_snapshot_header_t {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    uint32_t record_size;
+    uint32_t reserved_entry;
+    int64_t frequency_in_seconds;
+    int64_t created;
+    uint64_t count;
+    uint64_t checksum;
+    uint64_t header_checksum;
+};
+
+struct blacklist_snapshot_record_t {
+    struct in6_addr address;
+    int32_t prefix_length;
+    int32_t counter;
+    int32_t success_counter;
+    int32_t expiry_slot;
+    int64_t log_time_sec;
+    int64_t log_time_usec;
+    int64_t recent;
+    struct {
+        int32_t counter;
+        int32_t slot_index;
+    } access_count[RESERVED_ENTRY];
+};
+
 static int frequency_in_seconds = 10;
+static int ipv4_prefix_length = 32;
+static int ipv6_prefix_length = 64;
+
+/**
+ * Open addressing with Robin Hood probing. A slot is 8 bytes (eight per cache line): the full
+ * hash, so probing rarely has to look at an entry, and the entry's index in the shard's
+ * preallocated entry array, 0 for an empty slot. Entries never move while the slots are
+ * shuffled around; they are only read or written with their shard locked, callers get copies.
+ */
+struct ip_slot_t {
+    uint32_t hash;
+    uint32_t index;
+};
 
-struct ip_access_entry_header_t {
-    struct ip_access_entry_t *entries;
+struct ip_access_shard_t {
     pthread_mutex_t mutex;
-};
+    struct ip_slot_t *slots;
+    uint32_t mask;
+    int count;
+    int capacity;
+    int used;
+    int longest_probe;
+    uint64_t evicted;
+    struct ip_access_entry_t *entries;
+    struct ip_access_entry_t *free_list;
+    // live entries, chained through next by the slot they are due to expire in
+    struct ip_access_entry_t *wheel[EXPIRY_WHEEL_SIZE];
+    int wheel_slot;
+} __attribute__ ((aligned (64)));
 
 static struct logger_t *logger = &excalibur_common_logger;
-static struct ip_access_entry_header_t *ip_access_buffer;
-static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
-static struct ip_access_entry_t *release_pool = NULL;
+static struct ip_access_shard_t *shards;
+static int number_of_shards = 1;
 static pthread_mutex_t expiring_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t expiring_cond = PTHREAD_COND_INITIALIZER;
 static volatile bool terminate = false;
 static pthread_t expiring_thread;
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct auto_blacklist_stats_t sweep_stats;
+static pthread_mutex_t snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char *snapshot_file = NULL;
+static int snapshot_interval = 0;
+static time_t last_snapshot = 0;
+static bool initialized = false;
+
+static inline uint64_t mix64 (uint64_t h) {
+    // murmur3 finalizer: addresses of a /16 scan differ only in a few low bits
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline uint32_t hash_address (const struct in6_addr *address) {
+    uint64_t high, low;
+
+    memcpy (&high, &address->s6_addr[0], sizeof high);
+    memcpy (&low, &address->s6_addr[8], sizeof low);
+
+    return (uint32_t) mix64 (high ^ mix64 (low));
+}
 
-static struct ip_access_entry_t *allocate_new_entry() {
+/**
+ * Clear the host bits: an IPv6 client rotating through its /64 still counts as one.
+ *
+ * @return the prefix length kept, in bits of the IPv6 form
+ */
+static int mask_address (const struct in6_addr *address, struct in6_addr *masked) {
+    const int prefix = IN6_IS_ADDR_V4MAPPED (address) ? 96 + ipv4_prefix_length : ipv6_prefix_length;
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        const int bits = prefix - i * 8;
+
+        if (bits >= 8) {
+            masked->s6_addr[i] = address->s6_addr[i];
+        } else if (bits > 0) {
+            masked->s6_addr[i] = address->s6_addr[i] & (uint8_t) (0xff << (8 - bits));
+        } else {
+            masked->s6_addr[i] = 0;
+        }
+    }
+    return prefix;
+}
+
+static inline struct ip_access_shard_t *shard_of (const uint32_t hash) {
+    // the top bits pick the shard, the low bits the home slot inside it
+    return &shards[(hash >> 24) & (number_of_shards - 1)];
+}
+
+static inline uint32_t probe_distance (const struct ip_access_shard_t *shard, const uint32_t hash, const uint32_t slot) {
+    return (slot - (hash & shard->mask)) & shard->mask;
+}
+
+static struct ip_access_entry_t *allocate_new_entry (struct ip_access_shard_t *shard, uint32_t *index) {
     struct ip_access_entry_t *entry = NULL;
 
-    pthread_mutex_lock (&pool_mutex);
-    if (release_pool != NULL) {
-        entry = release_pool;
-        release_pool = release_pool->next;
-    } else {
-        entry = malloc (sizeof (struct ip_access_entry_t));
+    if (shard->free_list != NULL) {
+        entry = shard->free_list;
+        shard->free_list = entry->next;
+    } else if (shard->used < shard->capacity) {
+        entry = &shard->entries[++shard->used];
     }
-    pthread_mutex_unlock (&pool_mutex);
 
+    if (entry != NULL) {
+        *index = entry - shard->entries;
+    }
     return entry;
 }
 
-static void free_entry (struct ip_access_entry_t *entry) {
-    pthread_mutex_lock (&pool_mutex);
-    entry->next = release_pool;
-    release_pool = entry;
-    pthread_mutex_unlock (&pool_mutex);
+static void free_entry (struct ip_access_shard_t *shard, struct ip_access_entry_t *entry) {
+    entry->next = shard->free_list;
+    shard->free_list = entry;
+}
+
+/**
+ * @return the slot holding ip, or -1
+ */
+static int lookup_slot (const struct ip_access_shard_t *shard, const uint32_t hash, const struct in6_addr *address) {
+    uint32_t i = hash & shard->mask;
+    uint32_t distance = 0;
+
+    while (shard->slots[i].index != 0 && probe_distance (shard, shard->slots[i].hash, i) >= distance) {
+        if (shard->slots[i].hash == hash && IN6_ARE_ADDR_EQUAL (&shard->entries[shard->slots[i].index].address, address)) {
+            return i;
+        }
+        i = (i + 1) & shard->mask;
+        distance++;
+    }
+    return -1;
+}
+
+static void insert_slot (struct ip_access_shard_t *shard, struct ip_slot_t slot) {
+    uint32_t i = slot.hash & shard->mask;
+    uint32_t distance = 0;
+
+    while (shard->slots[i].index != 0) {
+        const uint32_t existing = probe_distance (shard, shard->slots[i].hash, i);
+
+        // take the slot from a richer entry, carry that one further
+        if (existing < distance) {
+            struct ip_slot_t swap = shard->slots[i];
+
+            shard->slots[i] = slot;
+            slot = swap;
+            distance = existing;
+        }
+        i = (i + 1) & shard->mask;
+        distance++;
+    }
+
+    shard->slots[i] = slot;
+    shard->count++;
+
+    if (distance > shard->longest_probe) {
+        shard->longest_probe = distance;
+    }
+}
+
+/**
+ * Backward shift deletion: no tombstones, the entries behind move one slot closer to home.
+ */
+static void delete_slot (struct ip_access_shard_t *shard, uint32_t i) {
+    uint32_t j = (i + 1) & shard->mask;
+
+    while (shard->slots[j].index != 0 && probe_distance (shard, shard->slots[j].hash, j) > 0) {
+        shard->slots[i] = shard->slots[j];
+        i = j;
+        j = (j + 1) & shard->mask;
+    }
+
+    shard->slots[i].hash = 0;
+    shard->slots[i].index = 0;
+    shard->count--;
 }
 
 static int current_time_index (int *slot_index) {
@@ -68,8 +255,58 @@ static int current_time_index (int *slot_index) {
 }
 
 static char *ip_address_of (struct ip_access_entry_t *entry) {
-    struct in_addr address = {.s_addr = htonl (entry->ipaddr)};
-    return inet_ntoa (address);
+    static __thread char buffer[INET6_ADDRSTRLEN + 8];
+
+    if (IN6_IS_ADDR_V4MAPPED (&entry->address)) {
+        inet_ntop (AF_INET, &entry->address.s6_addr[12], buffer, sizeof buffer);
+
+        if (entry->prefix_length < 128) {
+            sprintf (buffer + strlen (buffer), "/%d", entry->prefix_length - 96);
+        }
+    } else {
+        inet_ntop (AF_INET6, &entry->address, buffer, sizeof buffer);
+
+        if (entry->prefix_length < 128) {
+            sprintf (buffer + strlen (buffer), "/%d", entry->prefix_length);
+        }
+    }
+    return buffer;
+}
+
+/**
+ * A full shard: take the entry with the lowest count (the oldest one among equals) from the
+ * slots around hash's home and hand it over, still on the wheel, to the new address. The
+ * wheel finds it in its old bucket and moves it on, as the new expiry slot is never earlier.
+ */
+static struct ip_access_entry_t *evict_entry (struct ip_access_shard_t *shard, const uint32_t hash, uint32_t *index) {
+    uint32_t i = hash & shard->mask;
+    uint32_t n;
+    int victim = -1;
+
+    for (n = 0; n <= shard->mask && (n < EVICTION_WINDOW || victim < 0); n++, i = (i + 1) & shard->mask) {
+        if (shard->slots[i].index != 0) {
+            const struct ip_access_entry_t *entry = &shard->entries[shard->slots[i].index];
+            const struct ip_access_entry_t *chosen = victim >= 0 ? &shard->entries[shard->slots[victim].index] : NULL;
+
+            if (chosen == NULL || entry->counter < chosen->counter ||
+                    (entry->counter == chosen->counter && entry->expiry_slot < chosen->expiry_slot)) {
+                victim = i;
+            }
+        }
+    }
+
+    if (victim < 0) {
+        return NULL;
+    }
+
+    *index = shard->slots[victim].index;
+    delete_slot (shard, victim);
+    shard->evicted++;
+
+    if (logger->isEnable (log_info)) {
+        logger->info (__FILE__, __LINE__, "[Auto Blacklist] table full, evict entry: %s", ip_address_of (&shard->entries[*index]));
+    }
+    return &shard->entries[*index];
 }
 
 static void clear_outdated_data (struct ip_access_entry_t *entry, int index, int slot_index) {
@@ -81,8 +318,7 @@ static void clear_outdated_data (struct ip_access_entry_t *entry, int index, int
             entry->access_count[i].slot_index = s;
 
             if (entry->access_count[i].counter > 0) {
-                entry->counter -= entry->access_count[i].counter;
-                entry->access_count[i].counter = 0;
+                __sync_sub_and_fetch (&entry->counter, __sync_lock_test_and_set (&entry->access_count[i].counter, 0));
 
                 if (logger->isEnable (log_trace)) {
                     logger->trace (__FILE__, __LINE__,
@@ -98,30 +334,56 @@ static void clear_outdated_data (struct ip_access_entry_t *entry, int index, int
     }
 }
 
-static struct ip_access_entry_t * find_and_increase (struct in_addr *address) {
-    uint32_t ip = htonl (address->s_addr);
+/**
+ * The slot an entry expires in: every access counter it has then is outdated.
+ */
+static int expiry_slot_of (const struct ip_access_entry_t *entry, const int slot_index) {
+    int i, last = -1;
 
-    int hash_index = ip % hash_buffer_size;
+    for (i = 0; i < RESERVED_ENTRY; i++) {
+        if (entry->access_count[i].counter > 0 && entry->access_count[i].slot_index > last) {
+            last = entry->access_count[i].slot_index;
+        }
+    }
+    return (last >= 0 ? last : slot_index) + RESERVED_ENTRY;
+}
 
-    struct ip_access_entry_header_t *header = ip_access_buffer + hash_index;
-    struct ip_access_entry_t *entry = header->entries;
+static void schedule_expiry (struct ip_access_shard_t *shard, struct ip_access_entry_t *entry, const int expiry_slot) {
+    struct ip_access_entry_t **bucket = &shard->wheel[expiry_slot % EXPIRY_WHEEL_SIZE];
+
+    entry->expiry_slot = expiry_slot;
+    entry->next = *bucket;
+    *bucket = entry;
+}
+
+static bool find_and_increase (const struct in6_addr *address, struct ip_access_entry_t *copy) {
+    struct in6_addr key;
+    const int prefix_length = mask_address (address, &key);
+    const uint32_t hash = hash_address (&key);
+
+    struct ip_access_shard_t *shard = shard_of (hash);
+    struct ip_access_entry_t *entry = NULL;
 
     int slot_index = 0;
     int index = current_time_index (&slot_index);
     int i;
 
-    pthread_mutex_lock (&header->mutex);
-    while (entry != NULL) {
-        if (entry->ipaddr == ip) {
-            break;
-        } else {
-            entry = entry->next;
+    pthread_mutex_lock (&shard->mutex);
+
+    if ((i = lookup_slot (shard, hash, &key)) >= 0) {
+        entry = &shard->entries[shard->slots[i].index];
+    } else {
+        struct ip_slot_t slot = { .hash = hash };
+
+        const bool reused = (entry = allocate_new_entry (shard, &slot.index)) == NULL;
+
+        if (reused && (entry = evict_entry (shard, hash, &slot.index)) == NULL) {
+            pthread_mutex_unlock (&shard->mutex);
+            return false;
         }
-    }
 
-    if (entry == NULL) {
-        entry = allocate_new_entry();
-        entry->ipaddr = ip;
+        entry->address = key;
+        entry->prefix_length = prefix_length;
         entry->counter = 0;
         entry->success_counter = 0;
 
@@ -130,31 +392,145 @@ static struct ip_access_entry_t * find_and_increase (struct in_addr *address) {
             entry->access_count[i].slot_index = 0;
         }
 
-        entry->next = header->entries;
-        header->entries = entry;
+        insert_slot (shard, slot);
+
+        if (reused) {
+            entry->expiry_slot = slot_index + RESERVED_ENTRY;
+        } else {
+            schedule_expiry (shard, entry, slot_index + RESERVED_ENTRY);
+        }
         gettimeofday (&entry->log_time, NULL);
     }
 
     if (entry->access_count[index].slot_index != slot_index) {
         clear_outdated_data (entry, index, slot_index);
     }
-    pthread_mutex_unlock (&header->mutex);
 
     entry->access_count[index].counter++;
     entry->counter++;
 
+    *copy = *entry;
+    copy->next = NULL;
+
+    pthread_mutex_unlock (&shard->mutex);
+
     if (logger->isEnable (log_trace)) {
         logger->trace (__FILE__, __LINE__,
-                       "[Auto Blacklist] increase access count (ip: %s, hash_index: %d, slot_index: %d, index: %d, count: %d, entry total: %d)",
-                       inet_ntoa (*address),
-                       hash_index,
+                       "[Auto Blacklist] increase access count (ip: %s, shard: %d, slot_index: %d, index: %d, count: %d, entry total: %d)",
+                       ip_address_of (copy),
+                       (int) (shard - shards),
                        slot_index,
                        index,
-                       entry->access_count[index].counter,
-                       entry->counter);
+                       copy->access_count[index].counter,
+                       copy->counter);
     }
 
-    return entry;
+    return true;
+}
+
+/**
+ * @return the entry tracking address with its shard locked, or NULL with nothing locked
+ */
+static struct ip_access_entry_t *lock_entry (const struct in6_addr *address, struct ip_access_shard_t **locked) {
+    struct in6_addr key;
+    int i;
+
+    mask_address (address, &key);
+
+    const uint32_t hash = hash_address (&key);
+    struct ip_access_shard_t *shard = shard_of (hash);
+
+    pthread_mutex_lock (&shard->mutex);
+
+    if ((i = lookup_slot (shard, hash, &key)) < 0) {
+        pthread_mutex_unlock (&shard->mutex);
+        return NULL;
+    }
+
+    *locked = shard;
+    return &shard->entries[shard->slots[i].index];
+}
+
+static void increase_success (const struct in6_addr *address) {
+    struct ip_access_shard_t *shard;
+    struct ip_access_entry_t *entry = lock_entry (address, &shard);
+
+    if (entry != NULL) {
+        entry->success_counter++;
+        pthread_mutex_unlock (&shard->mutex);
+    }
+}
+
+static bool log_due (const struct in6_addr *address, const double interval) {
+    struct ip_access_shard_t *shard;
+    struct ip_access_entry_t *entry = lock_entry (address, &shard);
+    bool due = false;
+
+    if (entry != NULL) {
+        struct timeval now;
+
+        gettimeofday (&now, NULL);
+
+        if (elapsed_time (&now, &entry->log_time) > interval) {
+            entry->log_time = now;
+            due = true;
+        }
+        pthread_mutex_unlock (&shard->mutex);
+    }
+    return due;
+}
+
+/**
+ * Look at the entries of one wheel bucket, EXPIRY_BATCH at a time so that find_and_increase
+ * never waits for more than one batch. An entry still in use is put back where it will
+ * expire now. One scheduled a whole turn ahead (the wheel was behind when it was added)
+ * just goes back into the same bucket.
+ */
+static void expire_bucket (struct ip_access_shard_t *shard, const int bucket, const int tick,
+                           const int index, const int slot_index, int *examined, int *released) {
+    struct ip_access_entry_t *pending;
+
+    pthread_mutex_lock (&shard->mutex);
+    pending = shard->wheel[bucket];
+    shard->wheel[bucket] = NULL;
+    pthread_mutex_unlock (&shard->mutex);
+
+    while (pending != NULL) {
+        int n;
+
+        pthread_mutex_lock (&shard->mutex);
+
+        for (n = 0; pending != NULL && n < EXPIRY_BATCH; n++) {
+            struct ip_access_entry_t *entry = pending;
+
+            pending = entry->next;
+
+            if (entry->expiry_slot > tick) {
+                schedule_expiry (shard, entry, entry->expiry_slot);
+                continue;
+            }
+
+            (*examined)++;
+            clear_outdated_data (entry, index, slot_index);
+
+            if (entry->counter == 0) {
+                const int slot = lookup_slot (shard, hash_address (&entry->address), &entry->address);
+
+                if (logger->isEnable (log_info)) {
+                    logger->info (__FILE__, __LINE__, "[Expiring Thread] Free entry: %s", ip_address_of (entry));
+                }
+
+                if (slot >= 0) {
+                    delete_slot (shard, slot);
+                }
+                free_entry (shard, entry);
+                (*released)++;
+            } else {
+                schedule_expiry (shard, entry, expiry_slot_of (entry, slot_index));
+            }
+        }
+        pthread_mutex_unlock (&shard->mutex);
+    }
 }
 
 static int expiring() {
@@ -166,75 +542,355 @@ static int expiring() {
     int index = current_time_index (&slot_index);
 
     if (index != recent_index) {
-        struct ip_access_entry_t *free_list = NULL;
+        struct timeval started, finished;
         int total_entries = 0;
-        int longest_chain = 0;
-        int number_of_empty_chain = 0;
+        int longest_probe = 0;
+        int capacity = 0;
+        int examined = 0;
+        uint64_t evicted = 0;
 
-        for (k = 0; k < hash_buffer_size; k++) {
-            struct ip_access_entry_header_t *header = &ip_access_buffer[k];
+        gettimeofday (&started, NULL);
 
-            pthread_mutex_lock (&header->mutex);
+        for (k = 0; k < number_of_shards; k++) {
+            struct ip_access_shard_t *shard = &shards[k];
+            int tick = shard->wheel_slot + 1;
 
-            struct ip_access_entry_t *entry = header->entries;
-            struct ip_access_entry_t **prev = &header->entries;
-            int size_of_chain = 0;
+            // asleep for a whole turn of the wheel: every bucket is due once
+            if (tick < slot_index - EXPIRY_WHEEL_SIZE + 1) {
+                tick = slot_index - EXPIRY_WHEEL_SIZE + 1;
+            }
 
-            while (entry != NULL) {
-                clear_outdated_data (entry, index, slot_index);
+            for (; tick <= slot_index; tick++) {
+                expire_bucket (shard, tick % EXPIRY_WHEEL_SIZE, tick, index, slot_index, &examined, &release_counter);
+            }
+            shard->wheel_slot = slot_index;
+
+            pthread_mutex_lock (&shard->mutex);
+            total_entries += shard->count;
+            capacity += shard->capacity;
+            evicted += shard->evicted;
+            shard->evicted = 0;
+            longest_probe = longest_probe >= shard->longest_probe ? longest_probe : shard->longest_probe;
+            pthread_mutex_unlock (&shard->mutex);
+        }
 
-                if (entry->counter == 0) {
-                    if (logger->isEnable (log_info)) {
-                        logger->info (__FILE__, __LINE__, "[Expiring Thread] Free entry: %s", ip_address_of (entry));
-                    }
+        gettimeofday (&finished, NULL);
 
-                    *prev = entry->next;
-                    entry->next = free_list;
-                    free_list = entry;
-                    entry = *prev;
-                    release_counter++;
-                } else {
-                    prev = &entry->next;
-                    entry = entry->next;
-                    total_entries++;
-                    size_of_chain++;
+        recent_index = index;
+
+        pthread_mutex_lock (&stats_mutex);
+        sweep_stats.sweeps++;
+        sweep_stats.examined += examined;
+        sweep_stats.expired += release_counter;
+        sweep_stats.evicted += evicted;
+        sweep_stats.last_examined = examined;
+        sweep_stats.last_expired = release_counter;
+        sweep_stats.last_duration = elapsed_time (&finished, &started);
+
+        if (sweep_stats.last_duration > sweep_stats.max_duration) {
+            sweep_stats.max_duration = sweep_stats.last_duration;
+        }
+        pthread_mutex_unlock (&stats_mutex);
+
+        logger->notice (__FILE__, __LINE__,
+                        "[Expiring Thread] expire %d of %d entries examined in %.3f ms, %d entries left (capacity: %d), longest probe: %d",
+                        release_counter, examined, sweep_stats.last_duration * 1000., total_entries, capacity, longest_probe);
+
+        if (evicted > 0) {
+            logger->warning (__FILE__, __LINE__, "[Expiring Thread] table full, %lu entries evicted for new addresses", evicted);
+        }
+    }
+
+    return release_counter;
+}
+
+static void get_stats (struct auto_blacklist_stats_t *stats) {
+    int k;
+
+    pthread_mutex_lock (&stats_mutex);
+    *stats = sweep_stats;
+    pthread_mutex_unlock (&stats_mutex);
+
+    stats->entries = 0;
+    stats->capacity = 0;
+    stats->longest_probe = 0;
+    stats->shards = number_of_shards;
+
+    for (k = 0; k < number_of_shards; k++) {
+        pthread_mutex_lock (&shards[k].mutex);
+        stats->entries += shards[k].count;
+        stats->capacity += shards[k].capacity;
+        stats->longest_probe = stats->longest_probe >= shards[k].longest_probe ? stats->longest_probe : shards[k].longest_probe;
+        pthread_mutex_unlock (&shards[k].mutex);
+    }
+}
+
+static uint64_t checksum_of (const void *data, const size_t length) {
+    const uint64_t *word = data;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0; i < length / sizeof (uint64_t); i++) {
+        hash = (hash ^ word[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static bool valid_snapshot (const struct blacklist_snapshot_header_t *header, const size_t size, const char *file) {
+    const char *problem = NULL;
+
+    if (size < sizeof (struct blacklist_snapshot_header_t) || header->magic != SNAPSHOT_MAGIC_NUMBER) {
+        problem = "not a blacklist snapshot";
+    } else if (header->header_checksum != checksum_of (header, offsetof (struct blacklist_snapshot_header_t, header_checksum))) {
+        problem = "header checksum mismatch";
+    } else if (header->version_major != SNAPSHOT_MAJOR_VERSION ||
+               header->record_size != sizeof (struct blacklist_snapshot_record_t) ||
+               header->reserved_entry != RESERVED_ENTRY) {
+        problem = "incompatible version";
+    } else if (header->frequency_in_seconds != frequency_in_seconds) {
+        // the time slots would mean something else
+        problem = "taken with another monitor-period";
+    } else if (size != sizeof (struct blacklist_snapshot_header_t) + header->count * sizeof (struct blacklist_snapshot_record_t)) {
+        problem = "truncated";
+    } else if (header->checksum != checksum_of (header + 1, header->count * sizeof (struct blacklist_snapshot_record_t))) {
+        problem = "checksum mismatch";
+    }
+
+    if (problem != NULL) {
+        logger->warning (__FILE__, __LINE__, "[Auto Blacklist] snapshot %s ignored: %s", file, problem);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Write every tracked address to snapshot_file: into a sparse file sized for a full table,
+ * one shard (and one shard lock) at a time, then trimmed and renamed over the previous one.
+ */
+static bool save_snapshot (void) {
+    struct blacklist_snapshot_header_t *header;
+    struct blacklist_snapshot_record_t *record;
+    struct timeval started, finished;
+    char *temporary;
+    size_t size;
+    uint64_t count = 0;
+    int fd, k;
+    bool saved = false;
+
+    if (snapshot_file == NULL || !initialized) {
+        return false;
+    }
+
+    pthread_mutex_lock (&snapshot_mutex);
+    gettimeofday (&started, NULL);
+
+    for (size = sizeof (struct blacklist_snapshot_header_t), k = 0; k < number_of_shards; k++) {
+        size += (size_t) shards[k].capacity * sizeof (struct blacklist_snapshot_record_t);
+    }
+
+    if ((temporary = malloc (strlen (snapshot_file) + 5)) == NULL) {
+        pthread_mutex_unlock (&snapshot_mutex);
+        return false;
+    }
+    sprintf (temporary, "%s.tmp", snapshot_file);
+
+    if ((fd = open (temporary, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0 || ftruncate (fd, size) != 0) {
+        logger->error (__FILE__, __LINE__, "[Auto Blacklist] snapshot %s: %s", temporary, strerror (errno));
+    } else if ((header = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        logger->error (__FILE__, __LINE__, "[Auto Blacklist] snapshot %s: %s", temporary, strerror (errno));
+    } else {
+        record = (struct blacklist_snapshot_record_t *) (header + 1);
+
+        for (k = 0; k < number_of_shards; k++) {
+            struct ip_access_shard_t *shard = &shards[k];
+            uint32_t i;
+            int j;
+
+            pthread_mutex_lock (&shard->mutex);
+
+            for (i = 0; i <= shard->mask; i++) {
+                if (shard->slots[i].index != 0) {
+                    const struct ip_access_entry_t *entry = &shard->entries[shard->slots[i].index];
+
+                    record->address = entry->address;
+                    record->prefix_length = entry->prefix_length;
+                    record->counter = entry->counter;
+                    record->success_counter = entry->success_counter;
+                    record->expiry_slot = entry->expiry_slot;
+                    record->log_time_sec = entry->log_time.tv_sec;
+                    record->log_time_usec = entry->log_time.tv_usec;
+                    record->recent = entry->recent;
+
+                    for (j = 0; j < RESERVED_ENTRY; j++) {
+                        record->access_count[j].counter = entry->access_count[j].counter;
+                        record->access_count[j].slot_index = entry->access_count[j].slot_index;
+                    }
+                    record++;
+                    count++;
                 }
             }
 
-            pthread_mutex_unlock (&header->mutex);
+            pthread_mutex_unlock (&shard->mutex);
+        }
+
+        header->magic = SNAPSHOT_MAGIC_NUMBER;
+        header->version_major = SNAPSHOT_MAJOR_VERSION;
+        header->version_minor = SNAPSHOT_MINOR_VERSION;
+        header->record_size = sizeof (struct blacklist_snapshot_record_t);
+        header->reserved_entry = RESERVED_ENTRY;
+        header->frequency_in_seconds = frequency_in_seconds;
+        header->created = time (NULL);
+        header->count = count;
+        header->checksum = checksum_of (header + 1, count * sizeof (struct blacklist_snapshot_record_t));
+        header->header_checksum = checksum_of (header, offsetof (struct blacklist_snapshot_header_t, header_checksum));
+
+        size = sizeof (struct blacklist_snapshot_header_t) + count * sizeof (struct blacklist_snapshot_record_t);
+
+        if (msync (header, size, MS_SYNC) == 0 && munmap (header, size) == 0 &&
+                ftruncate (fd, size) == 0 && fsync (fd) == 0 && rename (temporary, snapshot_file) == 0) {
+            saved = true;
+        } else {
+            logger->error (__FILE__, __LINE__, "[Auto Blacklist] snapshot %s: %s", snapshot_file, strerror (errno));
+        }
+    }
+
+    if (fd >= 0) {
+        close (fd);
+    }
+    if (!saved) {
+        unlink (temporary);
+    }
+    free (temporary);
+
+    gettimeofday (&finished, NULL);
+    last_snapshot = finished.tv_sec;
+
+    pthread_mutex_unlock (&snapshot_mutex);
+
+    if (saved) {
+        logger->notice (__FILE__, __LINE__, "[Auto Blacklist] snapshot: %lu entries written to %s in %.3f ms",
+                        count, snapshot_file, elapsed_time (&finished, &started) * 1000.);
+    }
+    return saved;
+}
+
+/**
+ * Load the snapshot left by the previous run (if any), then keep it up to date every
+ * interval seconds (0: only on shutdown).
+ *
+ * @return number of entries restored
+ */
+static int restore_snapshot (const char *file, const int interval) {
+    struct blacklist_snapshot_header_t *header;
+    struct timeval started, finished;
+    struct stat st;
+    int slot_index = 0;
+    int restored = 0, skipped = 0;
+    uint64_t n;
+    int fd;
+
+    if (!initialized || file == NULL) {
+        return 0;
+    }
+
+    free (snapshot_file);
+    snapshot_file = strdup (file);
+    snapshot_interval = interval;
+    last_snapshot = time (NULL);
+
+    if ((fd = open (file, O_RDONLY)) < 0) {
+        logger->notice (__FILE__, __LINE__, "[Auto Blacklist] no snapshot at %s: %s", file, strerror (errno));
+        return 0;
+    }
+
+    gettimeofday (&started, NULL);
+
+    if (fstat (fd, &st) != 0 || st.st_size == 0 ||
+            (header = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        logger->warning (__FILE__, __LINE__, "[Auto Blacklist] snapshot %s unreadable", file);
+        close (fd);
+        return 0;
+    }
+    close (fd);
 
-            while ((entry = free_list) != NULL) {
-                free_list = free_list->next;
-                free_entry (entry);
+    if (valid_snapshot (header, st.st_size, file)) {
+        const struct blacklist_snapshot_record_t *record = (const struct blacklist_snapshot_record_t *) (header + 1);
+
+        current_time_index (&slot_index);
+
+        for (n = 0; n < header->count; n++, record++) {
+            const uint32_t hash = hash_address (&record->address);
+            struct ip_access_shard_t *shard = shard_of (hash);
+            struct ip_slot_t slot = { .hash = hash };
+            struct ip_access_entry_t *entry;
+            int j;
+
+            pthread_mutex_lock (&shard->mutex);
+
+            if (lookup_slot (shard, hash, &record->address) >= 0 || (entry = allocate_new_entry (shard, &slot.index)) == NULL) {
+                pthread_mutex_unlock (&shard->mutex);
+                skipped++;
+                continue;
             }
-            longest_chain = longest_chain >= size_of_chain ? longest_chain : size_of_chain;
 
-            if (size_of_chain == 0) {
-                number_of_empty_chain++;
+            entry->address = record->address;
+            entry->prefix_length = record->prefix_length;
+            entry->counter = record->counter;
+            entry->success_counter = record->success_counter;
+            entry->log_time.tv_sec = record->log_time_sec;
+            entry->log_time.tv_usec = record->log_time_usec;
+            entry->recent = record->recent;
+
+            for (j = 0; j < RESERVED_ENTRY; j++) {
+                entry->access_count[j].counter = record->access_count[j].counter;
+                entry->access_count[j].slot_index = record->access_count[j].slot_index;
             }
+
+            insert_slot (shard, slot);
+            // already past due after a long downtime: looked at once the wheel comes round to its bucket
+            schedule_expiry (shard, entry, expiry_slot_of (entry, slot_index));
+            restored++;
+
+            pthread_mutex_unlock (&shard->mutex);
         }
 
-        recent_index = index;
+        gettimeofday (&finished, NULL);
 
-        logger->notice (__FILE__, __LINE__, "[Expiring Thread] expire %d entries, %d entries left, longest chain: %d entries, empty chain: %d",
-                        release_counter, total_entries, longest_chain, number_of_empty_chain);
+        logger->notice (__FILE__, __LINE__, "[Auto Blacklist] snapshot: %d entries restored from %s (%d skipped) in %.3f ms",
+                        restored, file, skipped, elapsed_time (&finished, &started) * 1000.);
     }
 
-    return release_counter;
+    munmap (header, st.st_size);
+
+    return restored;
 }
 
 static void *expiring_main() {
     logger->notice (__FILE__, __LINE__, "[Expiring Thread] Started");
+
+    pthread_mutex_lock (&expiring_mutex);
+
     while (!terminate) {
-        pthread_mutex_lock (&expiring_mutex);
         pthread_cond_wait (&expiring_cond, &expiring_mutex);
 
+        if (terminate) {
+            break;
+        }
+
         logger->debug (__FILE__, __LINE__, "[Expiring Thread] begin");
         expiring();
         logger->debug (__FILE__, __LINE__, "[Expiring Thread] done");
 
-        pthread_mutex_unlock (&expiring_mutex);
+        if (snapshot_interval > 0 && time (NULL) - last_snapshot >= snapshot_interval) {
+            save_snapshot ();
+        }
     }
+
+    pthread_mutex_unlock (&expiring_mutex);
+
+    // the table as it is at shutdown
+    save_snapshot ();
+
     logger->notice (__FILE__, __LINE__, "[Expiring Thread] Ended");
     pthread_exit (NULL);
 }
@@ -247,30 +903,44 @@ static void wakeup() {
     pthread_mutex_unlock (&expiring_mutex);
 }
 
+/**
+ * Stop the expiring thread and wait for its last snapshot; not for signal handlers.
+ */
 static void terminate_thread() {
+    pthread_mutex_lock (&expiring_mutex);
+
+    if (terminate) {
+        pthread_mutex_unlock (&expiring_mutex);
+        return;
+    }
+
     terminate = true;
+    pthread_cond_signal (&expiring_cond);
+    pthread_mutex_unlock (&expiring_mutex);
 
-    wakeup();
+    pthread_join (expiring_thread, NULL);
 }
 
 static void for_each (void (*callback) (struct ip_access_entry_t *)) {
-    int i;
+    int k;
 
-    for (i = 0; i < hash_buffer_size; i++) {
-        struct ip_access_entry_header_t *header = &ip_access_buffer[i];
+    for (k = 0; k < number_of_shards; k++) {
+        struct ip_access_shard_t *shard = &shards[k];
+        uint32_t i;
 
-        pthread_mutex_lock (&header->mutex);
+        pthread_mutex_lock (&shard->mutex);
 
-        struct ip_access_entry_t *entry = header->entries;
+        for (i = 0; i <= shard->mask; i++) {
+            if (shard->slots[i].index != 0) {
+                struct ip_access_entry_t *entry = &shard->entries[shard->slots[i].index];
 
-        while (entry != NULL) {
-            if (entry->counter > 0) {
-                callback (entry);
+                if (entry->counter > 0) {
+                    callback (entry);
+                }
             }
-            entry = entry->next;
         }
 
-        pthread_mutex_unlock (&header->mutex);
+        pthread_mutex_unlock (&shard->mutex);
     }
 }
 
@@ -295,29 +965,63 @@ static struct auto_blacklist_service_t instance = {
         .depends_on = NULL,
     },
     .find_and_increase = find_and_increase,
+    .increase_success = increase_success,
+    .log_due = log_due,
     .terminate = terminate_thread,
     .expiring = wakeup,
     .for_each = for_each,
+    .get_stats = get_stats,
+    .restore = restore_snapshot,
+    .snapshot = save_snapshot,
 };
 
-static bool initialized = false;
-
 struct auto_blacklist_service_t *get_auto_blacklist_service() {
     return initialized ? &instance : NULL;
 }
 
-struct auto_blacklist_service_t *new_auto_blacklist_service (const int hash_size, const int monitor_period) {
+/**
+ * capacity entries are reserved up front and spread over shards (rounded up to a power of two);
+ * once a shard is full, new addresses are not tracked until expiry makes room.
+ */
+struct auto_blacklist_service_t *new_auto_blacklist_service (const int capacity, const int shards_wanted, const int monitor_period,
+                                                             const int ipv4_prefix, const int ipv6_prefix) {
     logger = get_application_context()->get_logger();
 
     if (!initialized) {
-        hash_buffer_size = hash_size;
+        int k;
+
         frequency_in_seconds = monitor_period / RESERVED_ENTRY;
-        ip_access_buffer = malloc (hash_buffer_size * sizeof (struct ip_access_entry_header_t));
-        int i;
+        ipv4_prefix_length = ipv4_prefix >= 8 && ipv4_prefix <= 32 ? ipv4_prefix : 32;
+        ipv6_prefix_length = ipv6_prefix >= 16 && ipv6_prefix <= 128 ? ipv6_prefix : 64;
+
+        for (number_of_shards = 1; number_of_shards < shards_wanted && number_of_shards < 256; number_of_shards <<= 1);
+
+        if (posix_memalign ((void **) &shards, 64, number_of_shards * sizeof (struct ip_access_shard_t)) != 0) {
+            logger->error (__FILE__, __LINE__, "[Auto Blacklist] out of memory");
+            return NULL;
+        }
+
+        for (k = 0; k < number_of_shards; k++) {
+            struct ip_access_shard_t *shard = &shards[k];
+            uint32_t slots;
+
+            memset (shard, 0, sizeof (struct ip_access_shard_t));
+            shard->capacity = (capacity + number_of_shards - 1) / number_of_shards;
+
+            // at most 3/4 full
+            for (slots = 16; slots < shard->capacity + shard->capacity / 3 + 1; slots <<= 1);
 
-        for (i = 0; i < hash_buffer_size; i++) {
-            ip_access_buffer[i].entries = NULL;
-            pthread_mutex_init (&ip_access_buffer[i].mutex, NULL);
+            shard->mask = slots - 1;
+            shard->slots = calloc (slots, sizeof (struct ip_slot_t));
+            // entries[0] is never used, index 0 marks an empty slot
+            shard->entries = calloc (shard->capacity + 1, sizeof (struct ip_access_entry_t));
+
+            if (shard->slots == NULL || shard->entries == NULL) {
+                logger->error (__FILE__, __LINE__, "[Auto Blacklist] out of memory");
+                return NULL;
+            }
+            current_time_index (&shard->wheel_slot);
+            pthread_mutex_init (&shard->mutex, NULL);
         }
 
         pthread_create (&expiring_thread, NULL, expiring_main, NULL);
@@ -325,4 +1029,4 @@ struct auto_blacklist_service_t *new_auto_blacklist_service (const int hash_size
         initialized = true;
     }
     return &instance;
-}
\ No newline at end of file
+}
@@ -4,18 +4,26 @@
 
 #include <pthread.h>
 #include <signal.h>
+#include <string.h>
+#include <arpa/inet.h>
 #include "logger.h"
 #include "global_vars.h"
 #include "sysconf.h"
 #include "cmdlintf.h"
 #include "commands.h"
 #include "packet_analyzer.h"
+#include "events.h"
+#include "admission_cache.h"
+#include "drop_set_exporter.h"
 #include "context.h"
 
 static struct logger_t *logger = &excalibur_common_logger;
 static struct packet_analyzer_t *packetAnalyzer = NULL;
 static struct auto_blacklist_service_t *blacklistService = NULL;
 static struct proxying_service_t *proxyingService = NULL;
+static struct admission_cache_t *admissionCache = NULL;
+static struct database_service_t *db_svc = NULL;
+static struct drop_set_exporter_t *dropSet = NULL;
 static struct system_config_t *conf;
 
 static int cmd_echo (struct cmdlintf_t *cmd, const char *args) {
@@ -155,9 +163,20 @@ static int cmd_load_module (struct cmdlintf_t *cmd, const char *args) {
 
 static int cmd_unload_module (struct cmdlintf_t *cmd, const char *args) {
     if (packetAnalyzer->unload ()) {
-        cmd->print ("module unload successfully\n");
+        cmd->print ("module unloaded (closed after its last connection)\n");
     } else {
-        cmd->print ("failed to unload module unload module\n");
+        cmd->print ("no module loaded\n");
+    }
+    return 1;
+}
+
+static int cmd_swap_module (struct cmdlintf_t *cmd, const char *args) {
+    if (args == NULL || *args == '\0') {
+        cmd->print ("module file name required\n");
+    } else if (packetAnalyzer->swap (args)) {
+        cmd->print ("module swapped, new connections use %s\n", args);
+    } else {
+        cmd->print ("failed to load %s, previous module kept\n", args);
     }
     return 1;
 }
@@ -175,8 +194,56 @@ static int cmd_packet_analyzer_mode_fast (struct cmdlintf_t *cmd, const char *ar
 }
 
 static int cmd_packet_analyzer_mode (struct cmdlintf_t *cmd, const char *args) {
-    cmd->print ("packet analyzer mode: %s\n",
-                packetAnalyzer->get_safe_mode () ? "safe" : "fast");
+    cmd->print ("packet analyzer mode: %s, %s\n",
+                packetAnalyzer->get_safe_mode () ? "safe" : "fast",
+                packetAnalyzer->get_async_mode () ? "async" : "inline");
+    return 1;
+}
+
+static int cmd_packet_analyzer_mode_async (struct cmdlintf_t *cmd, const char *args) {
+    if (packetAnalyzer->set_async_mode (true)) {
+        cmd->print ("packet analyzer mode: async (new connections)\n");
+    } else {
+        cmd->print ("packet analyzer: failed to start analyzer thread\n");
+    }
+    return 1;
+}
+
+static int cmd_packet_analyzer_mode_inline (struct cmdlintf_t *cmd, const char *args) {
+    packetAnalyzer->set_async_mode (false);
+    cmd->print ("packet analyzer mode: inline (new connections)\n");
+    return 1;
+}
+
+static int cmd_show_packet_analyzer_stats (struct cmdlintf_t *cmd, const char *args) {
+    struct packet_analyzer_stats_t stats;
+
+    packetAnalyzer->get_stats (&stats);
+
+    cmd->print ("mode: %s, plugin ABI: %d, generation: %d, sessions: %d\n",
+                stats.async ? "async" : "inline", stats.abi_version, stats.generation, stats.sessions);
+    cmd->print ("swaps: %lu, retired: %d (%d session(s) left), libraries closed: %lu\n",
+                stats.swaps, stats.retired, stats.retired_sessions, stats.closed);
+    cmd->print ("rings: %d x %d, batch size: %d, pending: %d\n",
+                stats.rings, stats.ring_size, stats.batch_size, stats.pending);
+    cmd->print ("enqueued: %lu, analyzed: %lu in %lu batch(es)\n",
+                stats.enqueued, stats.analyzed, stats.batches);
+    cmd->print ("dropped (ring full): %lu chunk(s), %lu byte(s)\n",
+                stats.dropped, stats.dropped_bytes);
+    return 1;
+}
+
+static int cmd_show_blacklist_stats (struct cmdlintf_t *cmd, const char *args) {
+    struct auto_blacklist_stats_t stats;
+
+    blacklistService->get_stats (&stats);
+
+    cmd->print ("entries: %d / %d (%d shards), longest probe: %d\n",
+                stats.entries, stats.capacity, stats.shards, stats.longest_probe);
+    cmd->print ("sweeps: %lu, examined: %lu, expired: %lu, evicted (full): %lu\n",
+                stats.sweeps, stats.examined, stats.expired, stats.evicted);
+    cmd->print ("last sweep: %d examined, %d expired in %.3f ms (max: %.3f ms)\n",
+                stats.last_examined, stats.last_expired, stats.last_duration * 1000., stats.max_duration * 1000.);
     return 1;
 }
 
@@ -200,6 +267,126 @@ static int cmd_disable_packet_analyzer (struct cmdlintf_t *cmd, const char *args
     return 1;
 }
 
+static int cmd_show_event_stats (struct cmdlintf_t *cmd, const char *args) {
+    int i, n = proxyingService->get_number_of_workers ();
+
+    for (i = 0; i < n; i++) {
+        struct event_loop_stats_t stats;
+
+        if (proxyingService->get_event_stats (i, &stats)) {
+            cmd->print ("worker %d: registered: %d / %d (max: %d), wakeups: %lu, events: %lu, events/wakeup: %.2f (recent: %d, max: %d)\n",
+                        i, stats.registered, stats.capacity, stats.max_registrations,
+                        stats.wakeups, stats.events,
+                        stats.wakeups > 0 ? (double) stats.events / stats.wakeups : 0.,
+                        stats.recent_events, stats.max_events_per_wakeup);
+        }
+    }
+    return 1;
+}
+
+static int cmd_show_listen_stats (struct cmdlintf_t *cmd, const char *args) {
+    struct listen_stats_t stats;
+
+    proxyingService->get_listen_stats (&stats);
+
+    cmd->print ("backlog: %d (somaxconn: %d), defer accept: %d s, fastopen: %d, accept batch: %d\n",
+                stats.backlog, stats.somaxconn, stats.defer_accept, stats.fastopen, stats.accept_batch);
+    cmd->print ("accepted: %lu, wakeups: %lu, accepted/wakeup: %.2f (max: %d), batch exhausted: %lu, errors: %lu\n",
+                stats.accepted, stats.wakeups, stats.wakeups > 0 ? (double) stats.accepted / stats.wakeups : 0.,
+                stats.max_per_wakeup, stats.budget_exhausted, stats.errors);
+    cmd->print ("out of descriptors: %lu connections shed, %lu listener pauses\n", stats.shed, stats.pauses);
+
+    if (stats.netstat_available) {
+        cmd->print ("host: listen overflows: %lu, listen drops: %lu, request queue full: %lu, syncookies sent: %lu\n",
+                    stats.listen_overflows, stats.listen_drops, stats.request_queue_full_drops, stats.syncookies_sent);
+        cmd->print ("host: defer accept drops: %lu, fastopen: %lu (overflows: %lu)\n",
+                    stats.defer_accept_drops, stats.fastopen_passive, stats.fastopen_overflows);
+    }
+    return 1;
+}
+
+static int cmd_show_admission_cache (struct cmdlintf_t *cmd, const char *args) {
+    struct admission_cache_stats_t stats;
+
+    admissionCache->get_stats (&stats);
+
+    const uint64_t lookups = stats.hits + stats.misses;
+
+    cmd->print ("entries: %d / %d, ttl: %d / %d (negative), hits: %lu, misses: %lu, hit rate: %.2f%%, refreshes: %lu, evictions: %lu\n",
+                stats.entries, stats.max_entries, stats.ttl, stats.negative_ttl, stats.hits, stats.misses,
+                lookups > 0 ? 100. * stats.hits / lookups : 0., stats.refreshes, stats.evictions);
+    cmd->print ("full: %lu evicted for a new address, %lu address(es) not cached\n", stats.displaced, stats.not_cached);
+    return 1;
+}
+
+static int cmd_show_drop_set (struct cmdlintf_t *cmd, const char *args) {
+    struct drop_set_stats_t stats;
+
+    dropSet->get_stats (&stats);
+
+    if (!stats.enabled) {
+        cmd->print ("drop set: off\n");
+    } else {
+        cmd->print ("table: inet %s, timeout: %d s, pending: %d / %d, queued: %lu, duplicates: %lu, dropped: %lu\n",
+                    stats.table, stats.timeout, stats.pending, stats.capacity, stats.queued, stats.duplicates, stats.dropped);
+        cmd->print ("exported: %lu, failed: %lu, batches: %lu\n", stats.exported, stats.failed, stats.batches);
+    }
+    return 1;
+}
+
+static int cmd_show_database_queue (struct cmdlintf_t *cmd, const char *args) {
+    struct db_write_behind_stats_t stats;
+
+    db_svc->get_write_behind_stats (&stats);
+
+    if (stats.capacity == 0) {
+        cmd->print ("write-behind queue: off\n");
+    } else {
+        cmd->print ("pending: %d / %d, batch: %d, flush interval: %d ms, queued: %lu, written: %lu, dropped: %lu, failed: %lu, batches: %lu\n",
+                    stats.pending, stats.capacity, stats.batch_size, stats.flush_interval,
+                    stats.queued, stats.written, stats.dropped, stats.failed, stats.batches);
+    }
+    return 1;
+}
+
+static int cmd_show_database_pool (struct cmdlintf_t *cmd, const char *args) {
+    struct db_pool_stats_t stats;
+    static const char *const breaker_states[] = { "closed", "open", "half-open" };
+
+    db_svc->get_pool_stats (&stats);
+
+    cmd->print ("connections: %d (connected: %d, in use: %d), checkouts: %lu, waited: %lu, avg wait: %.3f ms, max wait: %.3f ms, reconnects: %lu, failed health checks: %lu, retired: %lu\n",
+                stats.size, stats.connected, stats.in_use, stats.checkouts, stats.waits,
+                stats.checkouts > 0 ? stats.wait_usec / 1000. / stats.checkouts : 0.,
+                stats.max_wait_usec / 1000., stats.reconnects, stats.health_check_failures, stats.retired);
+    cmd->print ("circuit breaker: %s, trips: %lu, fast failures: %lu\n",
+                breaker_states[stats.breaker_state], stats.breaker_trips, stats.fast_failures);
+    return 1;
+}
+
+static int cmd_invalidate_admission_cache (struct cmdlintf_t *cmd, const char *args) {
+    if (args == NULL) {
+        cmd->print ("%d entries invalidated\n", admissionCache->invalidate (NULL));
+    } else {
+        struct in6_addr address;
+        struct in_addr v4;
+
+        if (inet_pton (AF_INET6, args, &address) == 1) {
+            cmd->print ("%d entries invalidated\n", admissionCache->invalidate (&address));
+        } else if (inet_pton (AF_INET, args, &v4) == 1) {
+            // clients are accepted on a v6 socket, v4 peers appear as ::ffff:a.b.c.d
+            memset (&address, 0, sizeof address);
+            address.s6_addr[10] = 0xff;
+            address.s6_addr[11] = 0xff;
+            memcpy (&address.s6_addr[12], &v4, sizeof v4);
+            cmd->print ("%d entries invalidated\n", admissionCache->invalidate (&address));
+        } else {
+            cmd->print ("usage: invalidate admission cache [ip address]\n");
+        }
+    }
+    return 1;
+}
+
 void register_commands (struct cmdlintf_t *cmd) {
     struct application_context_t *application_context = get_application_context();
 
@@ -209,6 +396,9 @@ void register_commands (struct cmdlintf_t *cmd) {
     packetAnalyzer = (struct packet_analyzer_t *) application_context->get_bean (PACKET_ANALYZER_DEFAULT_CONTEXT_NAME);
     blacklistService = (struct auto_blacklist_service_t *) application_context->get_bean (AUTO_BLACKLIST_DEFAULT_CONTEXT_NAME);
     proxyingService = (struct proxying_service_t *) application_context->get_bean (PROXYING_SERVICE_DEFAULT_CONTEXT_NAME);
+    admissionCache = (struct admission_cache_t *) application_context->get_bean (ADMISSION_CACHE_DEFAULT_CONTEXT_NAME);
+    db_svc = (struct database_service_t *) application_context->get_bean (DATABASE_SERVICE_DEFAULT_CONTEXT_NAME);
+    dropSet = (struct drop_set_exporter_t *) application_context->get_bean (DROP_SET_EXPORTER_DEFAULT_CONTEXT_NAME);
 
     cmd->regcmd();
 
@@ -227,9 +417,21 @@ void register_commands (struct cmdlintf_t *cmd) {
     cmd->add ("set default channel", true, cmd_default_channel, "setting default channel", 1, 1);
     cmd->add ("load module", true, cmd_load_module, "load module", 1, 1);
     cmd->add ("unload module", true, cmd_unload_module, "unload module", 0, 1);
+    cmd->add ("swap module", true, cmd_swap_module, "load a new module version for new connections", 1, 1);
     cmd->add ("analyzer enable", true, cmd_enable_packet_analyzer, "enable packet analyzer", 0, 1);
     cmd->add ("analyzer disable", true, cmd_disable_packet_analyzer, "enable packet analyzer", 0, 1);
     cmd->add ("analyzer mode safe", true, cmd_packet_analyzer_mode_safe, "enable packet analyzer safe mode", 0, 1);
     cmd->add ("analyzer mode fast", true, cmd_packet_analyzer_mode_fast, "enable packet analyzer fast mode", 0, 1);
+    cmd->add ("analyzer mode async", true, cmd_packet_analyzer_mode_async, "analyze packets off the relay path", 0, 1);
+    cmd->add ("analyzer mode inline", true, cmd_packet_analyzer_mode_inline, "analyze packets before relaying them", 0, 1);
     cmd->add ("show analyzer mode", true, cmd_packet_analyzer_mode, "packet analyzer mode", 0, 1);
+    cmd->add ("show analyzer stats", true, cmd_show_packet_analyzer_stats, "packet analyzer statistics", 0, 1);
+    cmd->add ("show event stats", true, cmd_show_event_stats, "event loop statistics", 0, 1);
+    cmd->add ("show listen stats", true, cmd_show_listen_stats, "accept path and listen queue statistics", 0, 1);
+    cmd->add ("show blacklist stats", true, cmd_show_blacklist_stats, "auto blacklist table and expiry statistics", 0, 1);
+    cmd->add ("show admission cache", true, cmd_show_admission_cache, "admission cache statistics", 0, 1);
+    cmd->add ("invalidate admission cache", true, cmd_invalidate_admission_cache, "drop cached admission results", 0, 1);
+    cmd->add ("show drop set", true, cmd_show_drop_set, "kernel drop set exporter statistics", 0, 1);
+    cmd->add ("show database queue", true, cmd_show_database_queue, "write-behind queue statistics", 0, 1);
+    cmd->add ("show database pool", true, cmd_show_database_pool, "database connection pool statistics", 0, 1);
 }
\ No newline at end of file
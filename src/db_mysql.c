@@ -64,6 +64,7 @@ struct db_mysql_stmt_t {
     int param_count;
     unsigned int number_fields;
     unsigned long affected_rows;
+    uint64_t insert_id;
 };
 
 struct db_mysql_result_t {
@@ -121,6 +122,12 @@ static bool dbmysql_connect (struct db_xsql_data_t *data) {
 
     mysql_init (&self->mysql);
 
+    if (self->info->connect_timeout > 0) {
+        unsigned int timeout = self->info->connect_timeout;
+
+        mysql_options (&self->mysql, MYSQL_OPT_CONNECT_TIMEOUT, &timeout);
+    }
+
     if (!mysql_real_connect (&self->mysql,
                              self->info->dbhost,
                              self->info->dbuser,
@@ -164,6 +171,12 @@ static void dbmysql_disconnect (struct db_xsql_data_t *data) {
     }
 }
 
+static bool dbmysql_ping (struct db_xsql_data_t *data) {
+    struct db_mysql_data_t *self = (struct db_mysql_data_t *) data->data;
+
+    return self->connected && mysql_ping (&self->mysql) == 0;
+}
+
 static void dbmysql_setInfo (struct db_xsql_data_t *data,
                              struct db_connection_info_t *info) {
     struct db_mysql_data_t *self = (struct db_mysql_data_t *) data->data;
@@ -506,9 +519,13 @@ static void dbmysql_clearParameters (struct db_xsql_stmt_t *self) {
 static int dbmysql_executeUpdate (struct db_xsql_stmt_t *self, int *errcode) {
     struct db_mysql_stmt_t *stmt = self->data;
 
+    stmt->insert_id = 0;
+
     if (!dbmysql_local_execute (self, errcode)) return -1;
 
     stmt->affected_rows = mysql_stmt_affected_rows (stmt->statement);
+    // same value as LAST_INSERT_ID(), without asking the server for it
+    stmt->insert_id = mysql_stmt_insert_id (stmt->statement);
     mysql_stmt_free_result (stmt->statement);
 
     // fprintf (stderr, "%s(%d): total affected rows: %lu\n", __FILE__, __LINE__, stmt->affected_rows);
@@ -516,12 +533,53 @@ static int dbmysql_executeUpdate (struct db_xsql_stmt_t *self, int *errcode) {
     return stmt->affected_rows;
 }
 
+static uint64_t dbmysql_getInsertId (struct db_xsql_stmt_t *self) {
+    struct db_mysql_stmt_t *stmt = self->data;
+
+    return stmt->insert_id;
+}
+
 static int error_number (struct db_xsql_data_t *data) {
     struct db_mysql_data_t *self = (struct db_mysql_data_t *) data->data;
 
     return self->connected ? mysql_errno (&self->mysql) : 0;
 }
 
+static bool dbmysql_beginTransaction (struct db_xsql_data_t *data) {
+    struct db_mysql_data_t *self = (struct db_mysql_data_t *) data->data;
+
+    if (!self->connected) return false;
+
+    if (mysql_autocommit (&self->mysql, 0) != 0) {
+        logger->error (__FILE__, __LINE__, "begin transaction [%d]: %s", self->instance_id, mysql_error (&self->mysql));
+        return false;
+    }
+    return true;
+}
+
+static bool dbmysql_endTransaction (struct db_xsql_data_t *data, const bool commit) {
+    struct db_mysql_data_t *self = (struct db_mysql_data_t *) data->data;
+    if (!self->connected) return false;
+
+    const bool rc = (commit ? mysql_commit (&self->mysql) : mysql_rollback (&self->mysql)) == 0;
+
+    if (!rc) {
+        logger->error (__FILE__, __LINE__, "%s [%d]: %s",
+                       commit ? "commit" : "rollback", self->instance_id, mysql_error (&self->mysql));
+    }
+    mysql_autocommit (&self->mysql, 1);
+
+    return rc;
+}
+
+static bool dbmysql_commit (struct db_xsql_data_t *data) {
+    return dbmysql_endTransaction (data, true);
+}
+
+static bool dbmysql_rollback (struct db_xsql_data_t *data) {
+    return dbmysql_endTransaction (data, false);
+}
+
 static const char *error_string (struct db_xsql_data_t *data) {
     struct db_mysql_data_t *self = (struct db_mysql_data_t *) data->data;
 
@@ -1036,6 +1094,8 @@ static struct db_xsql_stmt_t *dbmysql_createStatement (
     stmt->data = self;
     stmt->result_bind = NULL;
     stmt->result_bind_data = NULL;
+    stmt->affected_rows = 0;
+    stmt->insert_id = 0;
 
     if ((stmt->statement = mysql_stmt_init (&self->mysql)) != NULL) {
         if (mysql_stmt_prepare (stmt->statement, statement, strlen (statement)) == 0) {
@@ -1061,6 +1121,7 @@ static struct db_xsql_stmt_t *dbmysql_createStatement (
             st->close = dbmysql_stmt_close;
             st->executeQuery = dbmysql_executeQuery;
             st->executeUpdate = dbmysql_executeUpdate;
+            st->getInsertId = dbmysql_getInsertId;
             st->executeMultipleQuery = dbmysql_executeMultipleQuery;
             st->clearParameters = dbmysql_clearParameters;
             // st->freeResult = dbmysql_stmt_free_result;
@@ -1092,10 +1153,14 @@ static struct db_xsql_t db_mysql = {
     .dispose = dispose,
     .connect = dbmysql_connect,
     .disconnect = dbmysql_disconnect,
+    .ping = dbmysql_ping,
     .errno = error_number,
     .error = error_string,
     .setInfo = dbmysql_setInfo,
     .createStatement = dbmysql_createStatement,
+    .beginTransaction = dbmysql_beginTransaction,
+    .commit = dbmysql_commit,
+    .rollback = dbmysql_rollback,
     .setLogger = dbmysql_setLogger
 };
 
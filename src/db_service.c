@@ -9,6 +9,9 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <arpa/inet.h>
 #include "sysconf.h"
 #include "db_service.h"
 #include "db_mysql.h"
@@ -23,27 +26,55 @@
 static const double database_timeout = 300.;
 
 static struct db_xsql_t *db;
-static struct db_xsql_data_t *db_data;
 static struct db_connection_info_t db_connection_info;
 static struct system_config_t *system_conf = NULL;
-static pthread_mutex_t connection_mutex = PTHREAD_MUTEX_INITIALIZER;
-// static pthread_mutex_t reconnect_mutex = PTHREAD_MUTEX_INITIALIZER;
-static struct timeval recent_use_time;
-static struct timeval connection_time;
-static bool connected;
 static bool enabled;
 static time_t start_time;
 static struct logger_t *logger;
 
+enum write_behind_type_enum {
+    WRITE_BEHIND_CONNECTION_CLOSE,
+    WRITE_BEHIND_NOT_ALLOWED,
+};
+
+struct write_behind_entry_t {
+    enum write_behind_type_enum type;
+    int sn;
+    ssize_t bytes;
+    int count;
+    bool idle;
+    char ipaddr[INET6_ADDRSTRLEN];
+};
+
+// connection accounting is queued here and written by write_behind_main in batches
+static pthread_mutex_t write_behind_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t write_behind_cond = PTHREAD_COND_INITIALIZER;
+static struct write_behind_entry_t *write_behind_queue = NULL;
+static int write_behind_capacity = 0;
+static int write_behind_head = 0;
+static int write_behind_length = 0;
+static int write_behind_batch_size = 256;
+static int write_behind_flush_interval = 1000;
+static uint64_t write_behind_queued = 0;
+static uint64_t write_behind_written = 0;
+static uint64_t write_behind_dropped = 0;
+static uint64_t write_behind_failed = 0;
+static uint64_t write_behind_batches = 0;
+
+// sql-connection-not-allowed split around its VALUES tuple, repeated for multi-row INSERTs
+static char *not_allowed_prefix = NULL;
+static char *not_allowed_tuple = NULL;
+#define NOT_ALLOWED_BATCH_STATEMENTS 10
+
 enum query_name_enum {
     SQL_NAME_NOT_FOUND,
     SQL_CHECK_AVAILABLE,
     SQL_CONNECTION_CLOSE,
-    SQL_LAST_INSERT_ID,
     SQL_CONNECTION_NOT_ALLOWED,
     SQL_CHECK_VIP,
     SQL_CONNECTION_ESTABLISHED,
     SQL_CONNECTION_BEGIN,
+    SQL_CONNECTION_ESTABLISHED_BEGIN,
     SQL_BLACKLIST,
     SQL_ADD_TO_BLACKLIST,
     SQL_ADD_DETAILS,
@@ -79,12 +110,6 @@ static struct queries_and_statements stmt_holder[] = {
         .query = NULL,
         .stmt = NULL,
     },
-    {
-        .index = SQL_LAST_INSERT_ID,
-        .query_name = NULL,
-        .query = "SELECT LAST_INSERT_ID()",
-        .stmt = NULL,
-    },
     {
         .index = SQL_CONNECTION_NOT_ALLOWED,
         .query_name = "sql-connection-not-allowed",
@@ -109,6 +134,12 @@ static struct queries_and_statements stmt_holder[] = {
         .query = NULL,
         .stmt = NULL,
     },
+    {
+        .index = SQL_CONNECTION_ESTABLISHED_BEGIN,
+        .query_name = "sql-connection-established-begin",
+        .query = NULL,
+        .stmt = NULL,
+    },
     {
         .index = SQL_BLACKLIST,
         .query_name = "sql-blacklist",
@@ -153,14 +184,70 @@ static struct queries_and_statements stmt_holder[] = {
     },
 };
 
-static bool connect_to_database (bool re_connect) {
-    pthread_mutex_lock (&connection_mutex);
+#define NUMBER_OF_STATEMENTS (sizeof (stmt_holder) / sizeof (struct queries_and_statements))
+
+// a connection is used by one thread at a time, between checkout_connection and checkin_connection
+struct pooled_db_connection_t {
+    int id;
+    struct db_xsql_data_t *db_data;
+    struct queries_and_statements statements[NUMBER_OF_STATEMENTS];
+    struct db_xsql_stmt_t *not_allowed_batch_stmts[NOT_ALLOWED_BATCH_STATEMENTS];
+    bool connected;
+    bool in_use;
+    bool broken;
+    struct timeval connection_time;
+    struct timeval recent_use_time;
+};
 
-    if (enabled && !connected) {
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static struct pooled_db_connection_t *pool = NULL;
+static int pool_size = 0;
+static double pool_max_age = 3600.;
+static double pool_validate_idle = 30.;
+static struct db_pool_stats_t pool_stats;
+
+// closed: normal; open: every call fails fast while db_reconnect_main probes with backoff;
+// half-open: the probe is in progress
+static pthread_mutex_t breaker_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t breaker_cond = PTHREAD_COND_INITIALIZER;
+static volatile enum db_breaker_state_enum breaker_state = DB_BREAKER_CLOSED;
+static int consecutive_failures = 0;
+static int breaker_failure_threshold = 3;
+static int reconnect_backoff_min = 1;
+static int reconnect_backoff_max = 60;
+
+// 2xxx errors come from the client library (server gone, lost connection, ...): the session is unusable
+#define SESSION_LOST(errcode) ((errcode) >= 2000 && (errcode) < 3000)
+
+static void record_failure (const int id) {
+    pthread_mutex_lock (&breaker_mutex);
+    if (breaker_state == DB_BREAKER_CLOSED && ++consecutive_failures >= breaker_failure_threshold) {
+        breaker_state = DB_BREAKER_OPEN;
+        pool_stats.breaker_trips++;
+        logger->error (__FILE__, __LINE__, "database unavailable [%d]: %d consecutive failure(s), circuit breaker open",
+                       id, consecutive_failures);
+        pthread_cond_signal (&breaker_cond);
+    }
+    pthread_mutex_unlock (&breaker_mutex);
+}
+
+static void record_success (void) {
+    if (consecutive_failures != 0) {
+        pthread_mutex_lock (&breaker_mutex);
+        if (breaker_state == DB_BREAKER_CLOSED) {
+            consecutive_failures = 0;
+        }
+        pthread_mutex_unlock (&breaker_mutex);
+    }
+}
+
+static bool connect_to_database (struct pooled_db_connection_t *conn, bool re_connect) {
+    if (enabled && !conn->connected) {
         if (re_connect) {
-            logger->error (__FILE__, __LINE__, "Try to connect to database (re-connect)");
+            logger->error (__FILE__, __LINE__, "Try to connect to database [%d] (re-connect)", conn->id);
         }
-        if (db->connect (db_data)) {
+        if (db->connect (conn->db_data)) {
             double duration = difftime (time (NULL), start_time);
 
             int day = duration / 86400;
@@ -169,8 +256,9 @@ static bool connect_to_database (bool re_connect) {
             int min = (seconds % 3600) / 60;
             int sec = seconds % 60;
 
-            connected = true;
-            gettimeofday (&connection_time, NULL);
+            conn->connected = true;
+            conn->broken = false;
+            gettimeofday (&conn->connection_time, NULL);
 
             if (day > 0) {
                 logger->notice (__FILE__, __LINE__, "Uptime: %d day(s), %02d:%02d:%02d", day, hour, min, sec);
@@ -178,100 +266,287 @@ static bool connect_to_database (bool re_connect) {
                 logger->notice (__FILE__, __LINE__, "Uptime: %02d:%02d:%02d", hour, min, sec);
             }
         } else {
-            logger->error (__FILE__, __LINE__, "Failed to connect to database");
+            logger->error (__FILE__, __LINE__, "Failed to connect to database [%d]", conn->id);
         }
     }
-    gettimeofday (&recent_use_time, NULL);
+    gettimeofday (&conn->recent_use_time, NULL);
 
-    pthread_mutex_unlock (&connection_mutex);
-    return connected;
+    return conn->connected;
 }
 
-static bool reconnect_to_database() {
-    logger->warning (__FILE__, __LINE__, "Reconnect to database (disconnect and connect again)");
-
-    pthread_mutex_lock (&connection_mutex);
-    db->disconnect (db_data);
-    connected = false;
-    pthread_mutex_unlock (&connection_mutex);
-    return connect_to_database (true);
-}
+static void close_all_statements (struct pooled_db_connection_t *conn) {
+    int i;
 
-static void safe_reconnect_to_database (va_list ap) {
-    int counter = 0;
+    for (i = 0; i < NUMBER_OF_STATEMENTS; i++) {
+        if (conn->statements[i].stmt != NULL) {
+            logger->notice (__FILE__, __LINE__, "close statement [ %s ]", conn->statements[i].query);
+            conn->statements[i].stmt->close (conn->statements[i].stmt);
+            conn->statements[i].stmt = NULL;
+        }
+    }
 
-    while (!reconnect_to_database()) {
-        sleep (10);
-        if (++counter > 20) return;
+    for (i = 0; i < NOT_ALLOWED_BATCH_STATEMENTS; i++) {
+        if (conn->not_allowed_batch_stmts[i] != NULL) {
+            conn->not_allowed_batch_stmts[i]->close (conn->not_allowed_batch_stmts[i]);
+            conn->not_allowed_batch_stmts[i] = NULL;
+        }
     }
 }
 
-static void try_reconnect (const char * file, const int line) {
-    if (try_catch (safe_reconnect_to_database)) {
-        logger->error (__FILE__, __LINE__, "Got exception (%s:%d)", file, line);
-        exit (139);
+static void disconnect_from_database (struct pooled_db_connection_t *conn) {
+    if (conn->connected) {
+        close_all_statements (conn);
+        db->disconnect (conn->db_data);
+        conn->connected = false;
     }
 }
 
-static struct db_xsql_stmt_t *create_statement (const char *file, const int line, const char *query) {
-    int tried = 0;
-    bool have_error = false;
+static void probe_database (va_list ap) {
+    struct pooled_db_connection_t *conn = va_arg (ap, struct pooled_db_connection_t *);
+    bool *recovered = va_arg (ap, bool *);
 
-    do {
-        if (have_error) {
-            logger->error (__FILE__, __LINE__, "create statement: %s", query);
-        }
-        struct db_xsql_stmt_t *stmt = db->createStatement (db_data, query);
+    // statements prepared on the old session are gone with it
+    disconnect_from_database (conn);
+    __sync_add_and_fetch (&pool_stats.reconnects, 1);
 
-        if (stmt != NULL) {
-            return stmt;
-        } else {
-            have_error = true;
+    *recovered = connect_to_database (conn, true) && db->ping (conn->db_data);
+}
 
-            logger->error (__FILE__, __LINE__, "%s: %d, Query: %s, error (%d): %s",
-                           file, line, query,
-                           db->errno (db_data),
-                           db->error (db_data));
+/**
+ * prepare a statement on this connection; no retries here, a lost session is handed to the circuit breaker
+ */
+static struct db_xsql_stmt_t *create_statement (struct pooled_db_connection_t *conn, const char *file, const int line, const char *query) {
+    struct db_xsql_stmt_t *stmt = db->createStatement (conn->db_data, query);
 
-            if (tried++ > 0) {
-                sleep (10);
-            }
+    if (stmt == NULL) {
+        const int errcode = db->errno (conn->db_data);
 
-            try_reconnect (file, line);
+        logger->error (__FILE__, __LINE__, "%s: %d, Query: %s, error (%d): %s",
+                       file, line, query, errcode, db->error (conn->db_data));
+
+        if (errcode == 0 || SESSION_LOST (errcode)) {
+            conn->broken = true;
         }
-    } while (tried < 60);
+    }
 
-    logger->error (__FILE__, __LINE__, "Failed to reconnect to database (give up)");
+    return stmt;
+}
 
-    return NULL;
+static int execute_update (struct pooled_db_connection_t *conn, struct db_xsql_stmt_t *stmt) {
+    int errcode = 0;
+    const int affected_rows = stmt->executeUpdate (stmt, &errcode);
+
+    if (affected_rows < 0 && SESSION_LOST (errcode)) {
+        conn->broken = true;
+    }
+    return affected_rows;
 }
 
-static struct queries_and_statements *retrieve_statement (const char *file, const int line, enum query_name_enum queryNameEnum) {
+static struct queries_and_statements *retrieve_statement (struct pooled_db_connection_t *conn, const char *file, const int line, enum query_name_enum queryNameEnum) {
     int i;
 
-    for (i = 0; i < sizeof (stmt_holder) / sizeof (struct queries_and_statements); i++) {
-        if (stmt_holder[i].index == queryNameEnum) {
-            if (stmt_holder[i].stmt == NULL && stmt_holder[i].query != NULL) {
-                logger->notice (__FILE__, __LINE__, "create statement: [ %s ]", stmt_holder[i].query);
-                stmt_holder[i].stmt = create_statement (file, line, stmt_holder[i].query);
+    for (i = 0; i < NUMBER_OF_STATEMENTS; i++) {
+        struct queries_and_statements *holder = &conn->statements[i];
+
+        if (holder->index == queryNameEnum) {
+            if (holder->stmt == NULL && holder->query != NULL) {
+                logger->notice (__FILE__, __LINE__, "create statement: [ %s ] [%d]", holder->query, conn->id);
+                holder->stmt = create_statement (conn, file, line, holder->query);
             }
 
-            if (stmt_holder[i].stmt != NULL) {
-//                stmt_holder[i].stmt->reset (stmt_holder[i].stmt);
-                stmt_holder[i].stmt->clearParameters (stmt_holder[i].stmt);
+            if (holder->stmt != NULL) {
+//                holder->stmt->reset (holder->stmt);
+                holder->stmt->clearParameters (holder->stmt);
             }
-            return &stmt_holder[i];
+            return holder;
         }
     }
 
     return &stmt_not_found;
 }
 
+/**
+ * wait for an unused pool slot and mark it in use, connected or not
+ */
+static struct pooled_db_connection_t *reserve_connection (void) {
+    struct pooled_db_connection_t *conn = NULL;
+    struct timeval started, now;
+    int i;
+
+    gettimeofday (&started, NULL);
+
+    pthread_mutex_lock (&pool_mutex);
+
+    for (;;) {
+        // prefer a live session, the most recently used one, so that spare connections can go idle
+        for (i = 0; i < pool_size; i++) {
+            if (!pool[i].in_use) {
+                if (conn == NULL || (pool[i].connected && !conn->connected) ||
+                    (pool[i].connected == conn->connected &&
+                     timercmp (&pool[i].recent_use_time, &conn->recent_use_time, >))) {
+                    conn = &pool[i];
+                }
+            }
+        }
+        if (conn != NULL) break;
+
+        pthread_cond_wait (&pool_cond, &pool_mutex);
+    }
+    conn->in_use = true;
+
+    gettimeofday (&now, NULL);
+    const uint64_t waited = (now.tv_sec - started.tv_sec) * 1000000L + (now.tv_usec - started.tv_usec);
+
+    pool_stats.checkouts++;
+    pool_stats.wait_usec += waited;
+    if (waited > pool_stats.max_wait_usec) {
+        pool_stats.max_wait_usec = waited;
+    }
+    if (waited >= 1000) {
+        pool_stats.waits++;
+    }
+
+    pthread_mutex_unlock (&pool_mutex);
+    return conn;
+}
+
+static void release_connection (struct pooled_db_connection_t *conn) {
+    pthread_mutex_lock (&pool_mutex);
+    conn->in_use = false;
+    pthread_cond_signal (&pool_cond);
+    pthread_mutex_unlock (&pool_mutex);
+}
+
+/**
+ * take a connection out of the pool, waiting for one when all of them are in use
+ * @return a connected database connection, or NULL (database disabled, unreachable or circuit breaker open)
+ */
+static struct pooled_db_connection_t *checkout_connection (void) {
+    struct pooled_db_connection_t *conn;
+    struct timeval now;
+
+    if (!enabled || pool == NULL) return NULL;
+
+    if (breaker_state != DB_BREAKER_CLOSED) {
+        __sync_add_and_fetch (&pool_stats.fast_failures, 1);
+        return NULL;
+    }
+
+    conn = reserve_connection ();
+
+    // the breaker may have opened while this caller was waiting for a slot
+    if (breaker_state != DB_BREAKER_CLOSED) {
+        release_connection (conn);
+        __sync_add_and_fetch (&pool_stats.fast_failures, 1);
+        return NULL;
+    }
+
+    gettimeofday (&now, NULL);
+
+    if (conn->connected && elapsed_time (&now, &conn->recent_use_time) > pool_validate_idle) {
+        if (!db->ping (conn->db_data)) {
+            logger->warning (__FILE__, __LINE__, "database connection [%d] failed the health check", conn->id);
+            __sync_add_and_fetch (&pool_stats.health_check_failures, 1);
+            disconnect_from_database (conn);
+        }
+    }
+
+    if (!connect_to_database (conn, false)) {
+        record_failure (conn->id);
+        release_connection (conn);
+        return NULL;
+    }
+
+    return conn;
+}
+
+static void checkin_connection (struct pooled_db_connection_t *conn) {
+    struct timeval now;
+
+    gettimeofday (&now, NULL);
+    conn->recent_use_time = now;
+
+    if (conn->broken) {
+        logger->warning (__FILE__, __LINE__, "database connection [%d] lost", conn->id);
+        disconnect_from_database (conn);
+        conn->broken = false;
+        record_failure (conn->id);
+    } else if (conn->connected) {
+        record_success ();
+
+        const double age = elapsed_time (&now, &conn->connection_time);
+
+        if (age > pool_max_age) {
+            logger->notice (__FILE__, __LINE__, "Database connection [%d] time reaching maximum: %.2f seconds, [ close ]",
+                            conn->id, age);
+            disconnect_from_database (conn);
+            __sync_add_and_fetch (&pool_stats.retired, 1);
+        }
+    }
+
+    release_connection (conn);
+}
+
+/**
+ * Waits for the circuit breaker to open, then probes the database with exponential backoff
+ * until a connection succeeds; callers fail fast in the meantime instead of sleeping.
+ */
+static void *db_reconnect_main (void *args) {
+    int backoff = reconnect_backoff_min;
+
+    for (;;) {
+        struct pooled_db_connection_t *conn;
+        bool recovered = false;
+
+        pthread_mutex_lock (&breaker_mutex);
+        while (breaker_state == DB_BREAKER_CLOSED) {
+            pthread_cond_wait (&breaker_cond, &breaker_mutex);
+        }
+        pthread_mutex_unlock (&breaker_mutex);
+
+        sleep (backoff);
+
+        pthread_mutex_lock (&breaker_mutex);
+        breaker_state = DB_BREAKER_HALF_OPEN;
+        pthread_mutex_unlock (&breaker_mutex);
+
+        conn = reserve_connection ();
+
+        if (try_catch (probe_database, conn, &recovered)) {
+            logger->error (__FILE__, __LINE__, "Got exception (%s:%d)", __FILE__, __LINE__);
+            exit (139);
+        }
+
+        release_connection (conn);
+
+        pthread_mutex_lock (&breaker_mutex);
+        if (recovered) {
+            breaker_state = DB_BREAKER_CLOSED;
+            consecutive_failures = 0;
+            backoff = reconnect_backoff_min;
+            logger->notice (__FILE__, __LINE__, "database is back, circuit breaker closed");
+        } else {
+            breaker_state = DB_BREAKER_OPEN;
+            backoff = backoff * 2 < reconnect_backoff_max ? backoff * 2 : reconnect_backoff_max;
+            logger->error (__FILE__, __LINE__, "database still unavailable, next attempt in %d second(s)", backoff);
+        }
+        pthread_mutex_unlock (&breaker_mutex);
+    }
+
+    return NULL;
+}
+
+static bool is_available (void) {
+    return !enabled || breaker_state == DB_BREAKER_CLOSED;
+}
+
 static struct db_proxy_request_t *check_available (const char *remote_ip) {
     struct db_proxy_request_t *request = NULL;
 
-    if (connect_to_database (false)) {
-        struct queries_and_statements *ptr = retrieve_statement (__FILE__, __LINE__, SQL_CHECK_AVAILABLE);
+    struct pooled_db_connection_t *conn = checkout_connection ();
+
+    if (conn != NULL) {
+        struct queries_and_statements *ptr = retrieve_statement (conn, __FILE__, __LINE__, SQL_CHECK_AVAILABLE);
 
         if (ptr->stmt != NULL) {
             struct db_xsql_stmt_t *stmt = ptr->stmt;
@@ -284,7 +559,7 @@ static struct db_proxy_request_t *check_available (const char *remote_ip) {
                 unsigned int errno = 0;
 
                 if (result->next (result, &errno)) {
-                    request = malloc (sizeof (struct db_proxy_request_t *));
+                    request = malloc (sizeof (struct db_proxy_request_t));
 
                     request->sn = result->getInt (result, 1);
                     request->account = result->getString (result, 2);
@@ -295,103 +570,440 @@ static struct db_proxy_request_t *check_available (const char *remote_ip) {
                 }
                 result->close (result);
 
-                if (errno != 0) {
-                    try_reconnect (__FILE__, __LINE__);
+                if (SESSION_LOST (errno)) {
+                    conn->broken = true;
                 }
             } else {
 //                result->close (result);
                 logger->error (__FILE__, __LINE__, "failed to executeQuery (%d): %s [%s]", errcode, ptr->query, remote_ip);
-                try_reconnect (__FILE__, __LINE__);
+                if (SESSION_LOST (errcode)) {
+                    conn->broken = true;
+                }
             }
         }
+        checkin_connection (conn);
     }
     return request;
 }
 
-static void connection_close (const int sn, const ssize_t bytes, const int count, const bool idle) {
-    if (connect_to_database (false)) {
-        struct queries_and_statements *ptr = retrieve_statement (__FILE__, __LINE__, SQL_CONNECTION_CLOSE);
+/**
+ * @return false if the row could not be written
+ */
+static bool execute_connection_close (struct pooled_db_connection_t *conn, const int sn, const ssize_t bytes, const int count, const bool idle) {
+    struct queries_and_statements *ptr = retrieve_statement (conn, __FILE__, __LINE__, SQL_CONNECTION_CLOSE);
 
-        if (ptr->stmt != NULL) {
-            struct db_xsql_stmt_t *stmt = ptr->stmt;
+    if (ptr->stmt != NULL) {
+        struct db_xsql_stmt_t *stmt = ptr->stmt;
 
-            stmt->setInt (stmt, 1, bytes);
-            stmt->setInt (stmt, 2, count);
-            stmt->setString (stmt, 3, idle ? "timeout" : "normal");
-            stmt->setInt (stmt, 4, sn);
-            stmt->executeUpdate (stmt, NULL);
-        } else if (ptr->query != NULL) {
-            logger->error (__FILE__, __LINE__, "failed to create statement (update-connection): %s", ptr->query);
+        stmt->setInt (stmt, 1, bytes);
+        stmt->setInt (stmt, 2, count);
+        stmt->setString (stmt, 3, idle ? "timeout" : "normal");
+        stmt->setInt (stmt, 4, sn);
+        return execute_update (conn, stmt) >= 0;
+    } else if (ptr->query != NULL) {
+        logger->error (__FILE__, __LINE__, "failed to create statement (update-connection): %s", ptr->query);
+    }
+    return false;
+}
+
+/**
+ * @return false if the row could not be written
+ */
+static bool execute_connection_not_allowed (struct pooled_db_connection_t *conn, const char *ipaddr) {
+    struct queries_and_statements *ptr = retrieve_statement (conn, __FILE__, __LINE__, SQL_CONNECTION_NOT_ALLOWED);
+
+    if (ptr->stmt != NULL) {
+        struct db_xsql_stmt_t *stmt = ptr->stmt;
+
+        stmt->setString (stmt, 1, ipaddr);
+        return execute_update (conn, stmt) >= 0;
+    } else if (ptr->query != NULL) {
+        logger->error (__FILE__, __LINE__, "failed to create statement (not-allowed): %s", ptr->query);
+    }
+    return false;
+}
+
+/**
+ * queue an entry for write_behind_main
+ * @return false when the database is off or the entry has to be written right away
+ */
+static bool write_behind (const struct write_behind_entry_t *entry) {
+    if (!enabled || write_behind_queue == NULL) {
+        return false;
+    }
+
+    pthread_mutex_lock (&write_behind_mutex);
+
+    if (write_behind_length < write_behind_capacity) {
+        write_behind_queue[(write_behind_head + write_behind_length) % write_behind_capacity] = *entry;
+        write_behind_queued++;
+
+        if (++write_behind_length == write_behind_batch_size || write_behind_length == write_behind_capacity) {
+            pthread_cond_signal (&write_behind_cond);
         }
+    } else {
+        write_behind_dropped++;
+    }
+
+    pthread_mutex_unlock (&write_behind_mutex);
+    return true;
+}
+
+static void connection_close (const int sn, const ssize_t bytes, const int count, const bool idle) {
+    const struct write_behind_entry_t entry = {
+        .type = WRITE_BEHIND_CONNECTION_CLOSE,
+        .sn = sn,
+        .bytes = bytes,
+        .count = count,
+        .idle = idle,
+    };
+
+    if (write_behind (&entry)) return;
+
+    struct pooled_db_connection_t *conn = checkout_connection ();
+
+    if (conn != NULL) {
+        execute_connection_close (conn, sn, bytes, count, idle);
+        checkin_connection (conn);
+    }
+}
+
+static void established_begin_handler (struct db_xsql_result_t *result, void *data) {
+    int *insert_id = (int *) data;
+
+    if (*insert_id == 0 && result->next (result, NULL)) {
+        *insert_id = result->getInt (result, 1);
     }
 }
 
 static int connection_established (const int sn, const char *account, const char *ipaddr) {
     int last_insert_id = 0;
 
-    if (connect_to_database (false)) {
-        struct queries_and_statements *ptr = retrieve_statement (__FILE__, __LINE__, SQL_CONNECTION_ESTABLISHED);
+    struct pooled_db_connection_t *conn = checkout_connection ();
 
-        if (ptr->stmt != NULL) {
-            struct db_xsql_stmt_t *stmt = ptr->stmt;
+    if (conn != NULL) {
+        struct queries_and_statements *ptr0 = retrieve_statement (conn, __FILE__, __LINE__, SQL_CONNECTION_ESTABLISHED_BEGIN);
 
-            stmt->setInt (stmt, 1, sn);
-            stmt->executeUpdate (stmt, NULL);
+        if (ptr0->stmt != NULL) {
+            // one round-trip: a stored procedure doing both, its first result set holds the new id
+            struct db_xsql_stmt_t *stmt0 = ptr0->stmt;
 
-            struct queries_and_statements *ptr2 = retrieve_statement (__FILE__, __LINE__, SQL_CONNECTION_BEGIN);
+            stmt0->setInt (stmt0, 1, sn);
+            stmt0->setString (stmt0, 2, ipaddr != NULL ? ipaddr : "");
+            stmt0->setString (stmt0, 3, account != NULL ? account : "");
+            int errcode = 0;
 
-            if (ptr2->stmt != NULL) {
-                struct db_xsql_stmt_t *stmt2 = ptr2->stmt;
+            if (!stmt0->executeMultipleQuery (stmt0, &errcode, &last_insert_id, established_begin_handler) && SESSION_LOST (errcode)) {
+                conn->broken = true;
+            }
+        } else {
+            struct queries_and_statements *ptr = retrieve_statement (conn, __FILE__, __LINE__, SQL_CONNECTION_ESTABLISHED);
 
-                stmt2->setString (stmt2, 1, ipaddr != NULL ? ipaddr : "");
-                stmt2->setString (stmt2, 2, account != NULL ? account : "");
-                stmt2->executeUpdate (stmt2, NULL);
+            if (ptr->stmt != NULL) {
+                struct db_xsql_stmt_t *stmt = ptr->stmt;
 
-                struct queries_and_statements *ptr3 = retrieve_statement (__FILE__, __LINE__, SQL_LAST_INSERT_ID);
+                stmt->setInt (stmt, 1, sn);
+                execute_update (conn, stmt);
 
-                if (ptr3->stmt != NULL) {
-                    struct db_xsql_stmt_t *stmt3 = ptr3->stmt;
+                struct queries_and_statements *ptr2 = retrieve_statement (conn, __FILE__, __LINE__, SQL_CONNECTION_BEGIN);
 
-                    struct db_xsql_result_t *result = stmt3->executeQuery (stmt3, NULL);
-                    if (result != NULL) {
-                        if (result->next (result, NULL)) {
-                            last_insert_id = result->getInt (result, 1);
-                        }
-                        result->close (result);
+                if (ptr2->stmt != NULL) {
+                    struct db_xsql_stmt_t *stmt2 = ptr2->stmt;
+
+                    stmt2->setString (stmt2, 1, ipaddr != NULL ? ipaddr : "");
+                    stmt2->setString (stmt2, 2, account != NULL ? account : "");
+                    if (execute_update (conn, stmt2) > 0) {
+                        last_insert_id = stmt2->getInsertId (stmt2);
                     }
-                    // stmt3->reset (stmt3);
                 } else {
-                    logger->error (__FILE__, __LINE__, "failed to create statement (last-insert-id): %s", ptr3->query);
+                    logger->error (__FILE__, __LINE__, "failed to create statement (begin): %s", ptr2->query);
                 }
             } else {
-                logger->error (__FILE__, __LINE__, "failed to create statement (begin): %s", ptr2->query);
+                logger->error (__FILE__, __LINE__, "failed to create statement (established): %s", ptr->query);
             }
-        } else {
-            logger->error (__FILE__, __LINE__, "failed to create statement (established): %s", ptr->query);
         }
+        checkin_connection (conn);
     }
     return last_insert_id;
 }
 
 static void connection_not_allowed (const char *ipaddr) {
-    if (connect_to_database (false)) {
-        struct queries_and_statements *ptr = retrieve_statement (__FILE__, __LINE__, SQL_CONNECTION_NOT_ALLOWED);
+    struct write_behind_entry_t entry = {
+        .type = WRITE_BEHIND_NOT_ALLOWED,
+    };
 
-        if (ptr->stmt != NULL) {
-            struct db_xsql_stmt_t *stmt = ptr->stmt;
+    snprintf (entry.ipaddr, sizeof entry.ipaddr, "%s", ipaddr != NULL ? ipaddr : "");
 
-            stmt->setString (stmt, 1, ipaddr);
-            stmt->executeUpdate (stmt, NULL);
+    if (write_behind (&entry)) return;
 
-        } else if (ptr->query != NULL) {
-            logger->error (__FILE__, __LINE__, "failed to create statement (not-allowed): %s", ptr->query);
+    struct pooled_db_connection_t *conn = checkout_connection ();
+
+    if (conn != NULL) {
+        execute_connection_not_allowed (conn, ipaddr);
+        checkin_connection (conn);
+    }
+}
+
+static void split_not_allowed_query (const char *query) {
+    const char *values = NULL;
+    const char *p;
+
+    for (p = query; *p != '\0'; p++) {
+        if (strncasecmp (p, "VALUES", 6) == 0) {
+            values = p + 6;
+        }
+    }
+
+    if (values != NULL) {
+        const char *tuple = values;
+        const char *end = query + strlen (query);
+        int placeholders = 0;
+
+        while (*tuple == ' ' || *tuple == '\t') tuple++;
+        while (end > tuple && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == ';')) end--;
+
+        for (p = tuple; p < end; p++) {
+            if (*p == '?') placeholders++;
+        }
+
+        if (*tuple == '(' && end > tuple && end[-1] == ')' && placeholders == 1) {
+            not_allowed_prefix = strndup (query, values - query);
+            not_allowed_tuple = strndup (tuple, end - tuple);
+            return;
+        }
+    }
+
+    logger->notice (__FILE__, __LINE__, "sql-connection-not-allowed is not a single-row INSERT ... VALUES (...), batches are written row by row");
+}
+
+/**
+ * INSERT rows for a batch of refused clients: split into power-of-two chunks so that
+ * a handful of prepared multi-row statements covers every batch size
+ * @return number of rows not written
+ */
+static int insert_not_allowed_rows (struct pooled_db_connection_t *conn, const char **ipaddrs, const int rows) {
+    int i, bit, done = 0, failed = 0;
+
+    if (not_allowed_tuple != NULL) {
+        for (bit = NOT_ALLOWED_BATCH_STATEMENTS - 1; bit > 0; bit--) {
+            const int chunk = 1 << bit;
+
+            while (rows - done >= chunk) {
+                struct db_xsql_stmt_t *stmt = conn->not_allowed_batch_stmts[bit];
+
+                if (stmt == NULL) {
+                    const size_t tuple_length = strlen (not_allowed_tuple);
+                    char *query = malloc (strlen (not_allowed_prefix) + chunk * (tuple_length + 1) + 2);
+                    char *q = query + sprintf (query, "%s ", not_allowed_prefix);
+
+                    for (i = 0; i < chunk; i++) {
+                        if (i > 0) *q++ = ',';
+                        memcpy (q, not_allowed_tuple, tuple_length);
+                        q += tuple_length;
+                    }
+                    *q = '\0';
+
+                    stmt = conn->not_allowed_batch_stmts[bit] = db->createStatement (conn->db_data, query);
+                    free (query);
+
+                    if (stmt == NULL) break;
+                }
+
+                stmt->clearParameters (stmt);
+                for (i = 0; i < chunk; i++) {
+                    stmt->setString (stmt, i + 1, ipaddrs[done + i]);
+                }
+                if (execute_update (conn, stmt) < 0) {
+                    failed += chunk;
+                }
+                done += chunk;
+            }
+        }
+    }
+
+    for (; done < rows; done++) {
+        if (!execute_connection_not_allowed (conn, ipaddrs[done])) {
+            failed++;
+        }
+    }
+    return failed;
+}
+
+/**
+ * @param batched refused clients go in multi-row INSERTs
+ * @return number of rows not written
+ */
+static int write_entries (struct pooled_db_connection_t *conn, const struct write_behind_entry_t *entries, const int n, const bool batched) {
+    const char *ipaddrs[n];
+    int i, rows = 0, failed = 0;
+
+    for (i = 0; i < n && !conn->broken; i++) {
+        if (entries[i].type == WRITE_BEHIND_CONNECTION_CLOSE) {
+            if (!execute_connection_close (conn, entries[i].sn, entries[i].bytes, entries[i].count, entries[i].idle)) {
+                failed++;
+            }
+        } else if (batched) {
+            ipaddrs[rows++] = entries[i].ipaddr;
+        } else if (!execute_connection_not_allowed (conn, entries[i].ipaddr)) {
+            failed++;
+        }
+    }
+
+    if (conn->broken) {
+        // with the connection gone, neither the rest nor the collected rows were written
+        return failed + rows + n - i;
+    }
+    if (rows > 0) {
+        failed += insert_not_allowed_rows (conn, ipaddrs, rows);
+    }
+    return failed;
+}
+
+/**
+ * @return false if nothing of the batch reached the database, it has to be queued again
+ */
+static bool flush_write_behind (const struct write_behind_entry_t *entries, const int n) {
+    struct pooled_db_connection_t *conn = checkout_connection ();
+    int failed;
+
+    if (conn == NULL) {
+        return false;
+    }
+
+    // one commit for the whole batch instead of one per row
+    if (db->beginTransaction (conn->db_data)) {
+        failed = write_entries (conn, entries, n, true);
+
+        if (failed > 0) {
+            db->rollback (conn->db_data);
+        } else if (!db->commit (conn->db_data)) {
+            failed = n;
+        }
+
+        if (conn->broken) {
+            // rolled back along with the session
+            checkin_connection (conn);
+            return false;
+        } else if (failed > 0) {
+            // the whole batch went with the transaction: once more row by row, so one bad row does not take the rest along
+            failed = write_entries (conn, entries, n, false);
+        }
+    } else {
+        failed = write_entries (conn, entries, n, true);
+    }
+
+    checkin_connection (conn);
+
+    __sync_add_and_fetch (&write_behind_batches, 1);
+    __sync_add_and_fetch (&write_behind_written, n - failed);
+    __sync_add_and_fetch (&write_behind_failed, failed);
+    return true;
+}
+
+/**
+ * Put an unwritten batch back in front of the queue, in its original order; only the
+ * oldest rows that no longer fit are dropped.
+ */
+static void requeue_write_behind (const struct write_behind_entry_t *entries, const int n) {
+    int i;
+
+    pthread_mutex_lock (&write_behind_mutex);
+
+    for (i = n - 1; i >= 0; i--) {
+        if (write_behind_length < write_behind_capacity) {
+            write_behind_head = (write_behind_head + write_behind_capacity - 1) % write_behind_capacity;
+            write_behind_queue[write_behind_head] = entries[i];
+            write_behind_length++;
+        } else {
+            write_behind_dropped++;
+        }
+    }
+
+    pthread_mutex_unlock (&write_behind_mutex);
+}
+
+static void *write_behind_main (void *args) {
+    struct write_behind_entry_t *batch = calloc (write_behind_batch_size, sizeof (struct write_behind_entry_t));
+    uint64_t reported_drops = 0;
+
+    for (;;) {
+        int i, n;
+
+        pthread_mutex_lock (&write_behind_mutex);
+
+        if (write_behind_length < write_behind_batch_size && write_behind_length < write_behind_capacity) {
+            struct timespec deadline;
+
+            clock_gettime (CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += write_behind_flush_interval / 1000;
+            deadline.tv_nsec += (write_behind_flush_interval % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+
+            while (write_behind_length < write_behind_batch_size && write_behind_length < write_behind_capacity) {
+                if (pthread_cond_timedwait (&write_behind_cond, &write_behind_mutex, &deadline) != 0) {
+                    break;
+                }
+            }
+        }
+
+        if (breaker_state != DB_BREAKER_CLOSED) {
+            // the rows wait in the queue until the database is back; only a full queue drops any
+            n = 0;
+        } else {
+            n = write_behind_length < write_behind_batch_size ? write_behind_length : write_behind_batch_size;
+        }
+
+        for (i = 0; i < n; i++) {
+            batch[i] = write_behind_queue[write_behind_head];
+            write_behind_head = (write_behind_head + 1) % write_behind_capacity;
+        }
+        write_behind_length -= n;
+
+        const uint64_t dropped = write_behind_dropped;
+
+        pthread_mutex_unlock (&write_behind_mutex);
+
+        if (dropped != reported_drops) {
+            logger->warning (__FILE__, __LINE__, "write-behind queue full, %lu entries dropped (%lu in total)",
+                             dropped - reported_drops, dropped);
+            reported_drops = dropped;
+        }
+
+        if (n > 0 && !flush_write_behind (batch, n)) {
+            requeue_write_behind (batch, n);
+            n = 0;
+        }
+
+        if (n == 0 && breaker_state != DB_BREAKER_CLOSED) {
+            usleep (write_behind_flush_interval * 1000L);
         }
     }
+
+    return NULL;
+}
+
+static void get_write_behind_stats (struct db_write_behind_stats_t *stats) {
+    pthread_mutex_lock (&write_behind_mutex);
+    stats->capacity = write_behind_queue != NULL ? write_behind_capacity : 0;
+    stats->pending = write_behind_length;
+    stats->batch_size = write_behind_batch_size;
+    stats->flush_interval = write_behind_flush_interval;
+    stats->queued = write_behind_queued;
+    stats->dropped = write_behind_dropped;
+    stats->written = write_behind_written;
+    stats->failed = write_behind_failed;
+    stats->batches = write_behind_batches;
+    pthread_mutex_unlock (&write_behind_mutex);
 }
 
 static bool read_all_product_names (void (*callback) (char *, char *, char *)) {
-    if (connect_to_database (false)) {
-        struct queries_and_statements *ptr = retrieve_statement (__FILE__, __LINE__, SQL_ALL_PRODUCT_NAMES);
+    struct pooled_db_connection_t *conn = checkout_connection ();
+
+    if (conn != NULL) {
+        struct queries_and_statements *ptr = retrieve_statement (conn, __FILE__, __LINE__, SQL_ALL_PRODUCT_NAMES);
 
         if (ptr != NULL && ptr->stmt != NULL) {
             struct db_xsql_stmt_t *stmt = ptr->stmt;
@@ -408,62 +1020,72 @@ static bool read_all_product_names (void (*callback) (char *, char *, char *)) {
                 result->close (result);
             }
         }
+        checkin_connection (conn);
     }
     return true;
 }
 
 static int check_vip (const char *ipaddr) {
-    if (connect_to_database (false)) {
-        struct queries_and_statements *ptr = retrieve_statement (__FILE__, __LINE__, SQL_CHECK_VIP);
+    int affected_rows = 0;
+
+    struct pooled_db_connection_t *conn = checkout_connection ();
+
+    if (conn != NULL) {
+        struct queries_and_statements *ptr = retrieve_statement (conn, __FILE__, __LINE__, SQL_CHECK_VIP);
 
         if (ptr->stmt != NULL) {
             struct db_xsql_stmt_t *stmt = ptr->stmt;
 
             stmt->setString (stmt, 1, ipaddr);
-            int affected_rows = stmt->executeUpdate (stmt, NULL);
-
-            return affected_rows;
+            affected_rows = execute_update (conn, stmt);
         } else if (ptr->query != NULL) {
             logger->error (__FILE__, __LINE__, "failed to create statement (vip-checking): %s", ptr->query);
         }
+        checkin_connection (conn);
     }
-    return 0;
+    return affected_rows;
 }
 
 static int connection_blacklisted (const char *ipaddr) {
-    if (connect_to_database (false)) {
-        struct queries_and_statements *ptr = retrieve_statement (__FILE__, __LINE__, SQL_BLACKLIST);
+    int affected_rows = 0;
+
+    struct pooled_db_connection_t *conn = checkout_connection ();
+
+    if (conn != NULL) {
+        struct queries_and_statements *ptr = retrieve_statement (conn, __FILE__, __LINE__, SQL_BLACKLIST);
         struct db_xsql_stmt_t *stmt = ptr->stmt;
 
         if (stmt != NULL) {
             stmt->setString (stmt, 1, ipaddr);
-            int affected_rows = stmt->executeUpdate (stmt, NULL);
-
-            return affected_rows;
+            affected_rows = execute_update (conn, stmt);
         } else if (ptr->query != NULL) {
             logger->error (__FILE__, __LINE__, "failed to create statement (update-bl-count): %s", ptr->query);
         }
+        checkin_connection (conn);
     }
-    return 0;
+    return affected_rows;
 }
 
 static int add_ip_to_auto_blacklist (const char *ipaddr) {
-    if (connect_to_database (false)) {
+    int affected_rows = 0;
+
+    struct pooled_db_connection_t *conn = checkout_connection ();
 
-        struct queries_and_statements *ptr = retrieve_statement (__FILE__, __LINE__, SQL_ADD_TO_BLACKLIST);
+    if (conn != NULL) {
+
+        struct queries_and_statements *ptr = retrieve_statement (conn, __FILE__, __LINE__, SQL_ADD_TO_BLACKLIST);
         struct db_xsql_stmt_t *stmt = ptr->stmt;
 
         if (stmt != NULL) {
             stmt->setString (stmt, 1, ipaddr);
-            int affected_rows = stmt->executeUpdate (stmt, NULL);
+            affected_rows = execute_update (conn, stmt);
 //                stmt->close (stmt);
-
-            return affected_rows;
         } else if (ptr->query != NULL) {
             logger->error (__FILE__, __LINE__, "failed to create statement (add-to-blacklist): %s", ptr->query);
         }
+        checkin_connection (conn);
     }
-    return 0;
+    return affected_rows;
 }
 
 static int add_kms_details (const struct connection_info *info,
@@ -474,9 +1096,12 @@ static int add_kms_details (const struct connection_info *info,
                             const char * const kms_id,
                             const char * const client_machine_id,
                             const int remaining_min) {
+    int affected_rows = 0;
 
-    if (connect_to_database (false)) {
-        struct queries_and_statements *ptr = retrieve_statement (__FILE__, __LINE__, SQL_ADD_DETAILS);
+    struct pooled_db_connection_t *conn = checkout_connection ();
+
+    if (conn != NULL) {
+        struct queries_and_statements *ptr = retrieve_statement (conn, __FILE__, __LINE__, SQL_ADD_DETAILS);
         struct db_xsql_stmt_t *stmt = ptr->stmt;
 
         // (account,ipaddr,workstation,major_version,minor_version,app_id,kms_id,cmid,remaining_min,created_at) VALUES (?,?,?,?,?,?,?,?,?,NOW())";
@@ -492,19 +1117,24 @@ static int add_kms_details (const struct connection_info *info,
             stmt->setString (stmt, 7, kms_id);
             stmt->setString (stmt, 8, client_machine_id);
             stmt->setInt (stmt, 9, remaining_min);
-            return stmt->executeUpdate (stmt, NULL);
+            affected_rows = execute_update (conn, stmt);
         } else if (ptr->query != NULL) {
             logger->error (__FILE__, __LINE__, "failed to create statement (add-details): %s", ptr->query);
         }
+        checkin_connection (conn);
     }
-    return 0;
+    return affected_rows;
 }
 
 static int update_machine_owner (const struct connection_info *info, const char * const client_machine_id) {
-    if (connect_to_database (false)) {
+    int affected_rows = 0;
+
+    struct pooled_db_connection_t *conn = checkout_connection ();
+
+    if (conn != NULL) {
         const char *const account = info->request_in_db != NULL ? info->request_in_db->account : NULL;
 
-        struct queries_and_statements *ptr = retrieve_statement (__FILE__, __LINE__,
+        struct queries_and_statements *ptr = retrieve_statement (conn, __FILE__, __LINE__,
                                              account != NULL ? SQL_ADD_MACHINE_OWNER : SQL_UPDATE_MACHINE_ACCESS);
         struct db_xsql_stmt_t *stmt = ptr->stmt;
 
@@ -518,10 +1148,11 @@ static int update_machine_owner (const struct connection_info *info, const char
             if (account != NULL) {
                 stmt->setString (stmt, 5, account);
             }
-            return stmt->executeUpdate (stmt, NULL);
+            affected_rows = execute_update (conn, stmt);
         }
+        checkin_connection (conn);
     }
-    return 0;
+    return affected_rows;
 }
 
 struct fail_guessing_pad_load_t {
@@ -541,8 +1172,12 @@ static void fail_guessing_handler (struct db_xsql_result_t *result, void *data)
 }
 
 static bool fail_guessing (const char * const ip_address) {
-    if (connect_to_database (false)) {
-        struct queries_and_statements *ptr = retrieve_statement (__FILE__, __LINE__, SQL_CALL_FAILURE_GUESSING);
+    bool failed = false;
+
+    struct pooled_db_connection_t *conn = checkout_connection ();
+
+    if (conn != NULL) {
+        struct queries_and_statements *ptr = retrieve_statement (conn, __FILE__, __LINE__, SQL_CALL_FAILURE_GUESSING);
 
         if (ptr != NULL && ptr->stmt != NULL) {
             struct db_xsql_stmt_t *stmt = ptr->stmt;
@@ -555,73 +1190,62 @@ static bool fail_guessing (const char * const ip_address) {
                 .result = false,
             };
 
-            stmt->executeMultipleQuery (stmt, NULL, &padLoad, fail_guessing_handler);
-
-            return padLoad.result;
-        }
-    }
-    return false;
-}
-
+            int errcode = 0;
 
-static void close_all_statements() {
-    int i;
+            if (!stmt->executeMultipleQuery (stmt, &errcode, &padLoad, fail_guessing_handler) && SESSION_LOST (errcode)) {
+                conn->broken = true;
+            }
 
-    for (i = 0; i < sizeof (stmt_holder) / sizeof (struct queries_and_statements); i++) {
-        if (stmt_holder[i].stmt != NULL) {
-            logger->notice (__FILE__, __LINE__, "close statement [ %s ]", stmt_holder[i].query);
-            stmt_holder[i].stmt->close (stmt_holder[i].stmt);
-            stmt_holder[i].stmt = NULL;
+            failed = padLoad.result;
         }
+        checkin_connection (conn);
     }
+    return failed;
 }
 
-static void close_idle (const struct timeval *tv, const struct tm *tm) {
-    pthread_mutex_lock (&connection_mutex);
-
-    if (connected) {
-        double elapsed = elapsed_time (tv, &recent_use_time);
 
-        if (elapsed > database_timeout) {
-            logger->error (__FILE__, __LINE__, "IDLE ... close database connection");
+static void close_idle (const struct timeval *tv, const struct tm *tm) {
+    int i;
 
-            close_all_statements();
+    for (i = 0; i < pool_size; i++) {
+        struct pooled_db_connection_t *conn = &pool[i];
+        bool reserved = false;
 
-            db->disconnect (db_data);
-            connected = false;
+        pthread_mutex_lock (&pool_mutex);
+        if (!conn->in_use && conn->connected) {
+            conn->in_use = reserved = true;
         }
-    }
+        pthread_mutex_unlock (&pool_mutex);
 
-    pthread_mutex_unlock (&connection_mutex);
-}
+        if (!reserved) continue;
 
-static void db_service_done() {
-    static bool inited = false;
-    static double max_connection_time = 1200.;
+        if (elapsed_time (tv, &conn->recent_use_time) > database_timeout) {
+            logger->error (__FILE__, __LINE__, "IDLE ... close database connection [%d]", conn->id);
+            disconnect_from_database (conn);
+        } else if (elapsed_time (tv, &conn->connection_time) > pool_max_age) {
+            logger->notice (__FILE__, __LINE__, "Database connection [%d] time reaching maximum, [ close ]", conn->id);
+            disconnect_from_database (conn);
+            __sync_add_and_fetch (&pool_stats.retired, 1);
+        }
 
-    if (!inited) {
-        max_connection_time = (double) system_conf->int_or_default ("max-db-connection-time", 3600);
-        inited = true;
+        release_connection (conn);
     }
+}
 
-    pthread_mutex_lock (&connection_mutex);
-
-    if (connected) {
-        struct timeval tv;
+static void get_pool_stats (struct db_pool_stats_t *stats) {
+    int i;
 
-        gettimeofday (&tv, NULL);
-        double elapsed = elapsed_time (&tv, &connection_time);
+    pthread_mutex_lock (&pool_mutex);
+    *stats = pool_stats;
+    stats->size = pool_size;
+    stats->breaker_state = breaker_state;
+    stats->connected = stats->in_use = 0;
 
-        if (elapsed > max_connection_time) {
-            logger->notice (__FILE__, __LINE__, "Database connection time reaching maximum: %.2f seconds, [ close ]",
-                            elapsed);
-            close_all_statements();
-            db->disconnect (db_data);
-            connected = false;
-        }
+    for (i = 0; i < pool_size; i++) {
+        if (pool[i].connected) stats->connected++;
+        if (pool[i].in_use) stats->in_use++;
     }
-
-    pthread_mutex_unlock (&connection_mutex);
+    pthread_mutex_unlock (&pool_mutex);
 }
 
 static void set_logger (struct logger_t *new_logger) {
@@ -670,6 +1294,20 @@ static const char * const get_product_name (const char *const app_id, const char
 
 static void post_construct (void) {
     logger->trace (__FILE__, __LINE__, "%s:%d %s", __FILE__, __LINE__, __FUNCTION__ );
+
+    if (write_behind_queue != NULL) {
+        pthread_t thread;
+
+        pthread_create (&thread, NULL, write_behind_main, NULL);
+        pthread_detach (thread);
+    }
+
+    if (pool != NULL) {
+        pthread_t thread;
+
+        pthread_create (&thread, NULL, db_reconnect_main, NULL);
+        pthread_detach (thread);
+    }
 }
 
 static struct database_service_t instance = {
@@ -696,8 +1334,10 @@ static struct database_service_t instance = {
     .fail_guessing = fail_guessing,
     .check_vip = check_vip,
     .close_idle = close_idle,
-    .done = db_service_done,
+    .get_pool_stats = get_pool_stats,
+    .is_available = is_available,
     .set_logger = set_logger,
+    .get_write_behind_stats = get_write_behind_stats,
 };
 
 struct database_service_t *new_database_service (struct system_config_t *sysconf) {
@@ -716,15 +1356,13 @@ struct database_service_t *new_database_service (struct system_config_t *sysconf
             int i;
 
             db = init_db_mysql();
-            db_data = db->newInstance();
 
             db_connection_info.dbhost = sysconf->str ("mysql-server");
             db_connection_info.dbuser = sysconf->str ("mysql-account");
             db_connection_info.dbpasswd = sysconf->str ("mysql-passwd");
             db_connection_info.dbname = sysconf->str ("mysql-database");
-            db->setInfo (db_data, &db_connection_info);
 
-            for (i = 0; i < sizeof (stmt_holder) / sizeof (struct queries_and_statements); i++) {
+            for (i = 0; i < NUMBER_OF_STATEMENTS; i++) {
                 if (stmt_holder[i].query_name != NULL) {
                     if (stmt_holder[i].query == NULL) {
                         stmt_holder[i].query = sysconf->str (stmt_holder[i].query_name);
@@ -733,11 +1371,56 @@ struct database_service_t *new_database_service (struct system_config_t *sysconf
                     if (stmt_holder[i].query != NULL) {
                         logger->debug (__FILE__, __LINE__, "%d: (%d) %s [%s]", i, stmt_holder[i].index, stmt_holder[i].query_name, stmt_holder[i].query);
                     }
+
+                    if (stmt_holder[i].index == SQL_CONNECTION_NOT_ALLOWED && stmt_holder[i].query != NULL) {
+                        split_not_allowed_query (stmt_holder[i].query);
+                    }
                 }
             }
-        }
 
-        connected = false;
+            // 0: write connection accounting synchronously, as the calls come in
+            write_behind_capacity = sysconf->int_or_default ("db-write-behind-queue-size", 8192);
+            write_behind_batch_size = sysconf->int_or_default ("db-batch-size", 256);
+            write_behind_flush_interval = sysconf->int_or_default ("db-flush-interval", 1000);
+
+            if (write_behind_batch_size < 1) write_behind_batch_size = 1;
+            if (write_behind_flush_interval < 1) write_behind_flush_interval = 1;
+
+            if (write_behind_capacity > 0) {
+                write_behind_queue = calloc (write_behind_capacity, sizeof (struct write_behind_entry_t));
+                logger->info (__FILE__, __LINE__, "write-behind queue: %d entries, batch: %d, flush interval: %d ms",
+                              write_behind_capacity, write_behind_batch_size, write_behind_flush_interval);
+            }
+
+            // connections are opened on first use; max-db-connection-time is the older name of db-pool-max-age
+            pool_size = sysconf->int_or_default ("db-pool-size", 4);
+            pool_max_age = (double) sysconf->int_or_default ("db-pool-max-age",
+                                                              sysconf->int_or_default ("max-db-connection-time", 3600));
+            pool_validate_idle = (double) sysconf->int_or_default ("db-pool-validate-idle", 30);
+
+            if (pool_size < 1) pool_size = 1;
+
+            breaker_failure_threshold = sysconf->int_or_default ("db-breaker-failures", 3);
+            reconnect_backoff_min = sysconf->int_or_default ("db-reconnect-backoff-min", 1);
+            reconnect_backoff_max = sysconf->int_or_default ("db-reconnect-backoff-max", 60);
+            db_connection_info.connect_timeout = sysconf->int_or_default ("db-connect-timeout", 5);
+
+            if (breaker_failure_threshold < 1) breaker_failure_threshold = 1;
+            if (reconnect_backoff_min < 1) reconnect_backoff_min = 1;
+            if (reconnect_backoff_max < reconnect_backoff_min) reconnect_backoff_max = reconnect_backoff_min;
+
+            pool = calloc (pool_size, sizeof (struct pooled_db_connection_t));
+
+            for (i = 0; i < pool_size; i++) {
+                pool[i].id = i + 1;
+                pool[i].db_data = db->newInstance();
+                db->setInfo (pool[i].db_data, &db_connection_info);
+                memcpy (pool[i].statements, stmt_holder, sizeof stmt_holder);
+            }
+
+            logger->info (__FILE__, __LINE__, "database pool: %d connection(s), max age: %.0f seconds, validate after %.0f seconds idle",
+                          pool_size, pool_max_age, pool_validate_idle);
+        }
     }
 
     return &instance;
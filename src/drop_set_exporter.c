@@ -0,0 +1,344 @@
+//
+// Blacklisted clients go into a bounded queue; one thread hands them to nft(8) in batches
+// ("nft -f -", one transaction per batch). Single hosts land in the plain sets hosts4 /
+// hosts6, auto blacklist prefixes (drop-set-prefixes only) in the interval sets prefixes4 /
+// prefixes6; a prefix set only ever holds prefixes of the configured length, so its elements
+// never partially overlap. Elements carry a timeout: until it expires the kernel drops the
+// client whatever the database says by then; the next connection after that comes back to
+// userspace, is checked again and, if still blacklisted, exported again.
+//
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include "logger.h"
+#include "sysconf.h"
+#include "drop_set_exporter.h"
+#include "context.h"
+
+#define DROP_SET_QUEUE_SIZE 4096
+#define DROP_SET_BATCH 256
+#define DROP_SET_RECENT_SIZE 4096
+
+struct drop_set_item_t {
+    struct in6_addr address;
+    int prefix_length;
+};
+
+struct drop_set_batch_t {
+    struct drop_set_item_t items[DROP_SET_BATCH];
+    int count;
+};
+
+struct drop_set_recent_t {
+    struct in6_addr address;
+    int prefix_length;
+    time_t exported;
+};
+
+static struct logger_t *logger = &excalibur_common_logger;
+static struct system_config_t *system_conf = NULL;
+static char *table_name = NULL;
+static char *nft_command = NULL;
+static int element_timeout = 600;
+static bool setup_table = true;
+static struct drop_set_item_t queue[DROP_SET_QUEUE_SIZE];
+static int queue_head = 0;
+static int queue_length = 0;
+static struct drop_set_recent_t recent[DROP_SET_RECENT_SIZE];
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t exporter_thread;
+static struct drop_set_stats_t counters;
+
+static int recent_slot_of (const struct in6_addr *address, const int prefix_length) {
+    const uint32_t *words = (const uint32_t *) address;
+    uint32_t hash = words[0] ^ words[1] ^ words[2] ^ words[3] ^ prefix_length;
+
+    hash ^= hash >> 16;
+    hash *= 0x45d9f3b;
+    hash ^= hash >> 16;
+
+    return hash % DROP_SET_RECENT_SIZE;
+}
+
+/**
+ * Skip what was handed to the kernel lately: a flood keeps hitting accept() until the first
+ * batch is in, and the connections already queued in the backlog still have to be refused.
+ */
+static bool exported_lately (const struct in6_addr *address, const int prefix_length, const time_t now) {
+    struct drop_set_recent_t *slot = &recent[recent_slot_of (address, prefix_length)];
+
+    if (slot->prefix_length == prefix_length && IN6_ARE_ADDR_EQUAL (&slot->address, address) &&
+            (element_timeout == 0 || now - slot->exported < element_timeout / 2)) {
+        return true;
+    }
+
+    slot->address = *address;
+    slot->prefix_length = prefix_length;
+    slot->exported = now;
+    return false;
+}
+
+static void block (const struct in6_addr *address, const int prefix_length) {
+    if (table_name == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock (&queue_mutex);
+
+    if (exported_lately (address, prefix_length, time (NULL))) {
+        counters.duplicates++;
+    } else if (queue_length == DROP_SET_QUEUE_SIZE) {
+        counters.dropped++;
+        // give it another chance on the next connection
+        recent[recent_slot_of (address, prefix_length)].prefix_length = -1;
+    } else {
+        struct drop_set_item_t *item = &queue[(queue_head + queue_length++) % DROP_SET_QUEUE_SIZE];
+
+        item->address = *address;
+        item->prefix_length = prefix_length;
+        counters.queued++;
+        pthread_cond_signal (&queue_cond);
+    }
+
+    pthread_mutex_unlock (&queue_mutex);
+}
+
+static void print_element (FILE *fp, const struct drop_set_item_t *item) {
+    const bool is_v4 = IN6_IS_ADDR_V4MAPPED (&item->address);
+    const bool is_host = item->prefix_length >= 128;
+    char buffer[INET6_ADDRSTRLEN];
+
+    if (is_v4) {
+        inet_ntop (AF_INET, &item->address.s6_addr[12], buffer, sizeof buffer);
+    } else {
+        inet_ntop (AF_INET6, &item->address, buffer, sizeof buffer);
+    }
+
+    fprintf (fp, "add element inet %s %s%c { %s", table_name, is_host ? "hosts" : "prefixes", is_v4 ? '4' : '6', buffer);
+
+    if (!is_host) {
+        fprintf (fp, "/%d", is_v4 ? item->prefix_length - 96 : item->prefix_length);
+    }
+    if (element_timeout > 0) {
+        fprintf (fp, " timeout %ds", element_timeout);
+    }
+    fprintf (fp, " }\n");
+}
+
+/**
+ * Feed a script to nft, one transaction: either all of it is applied or none. An nft that
+ * is missing or quits early leaves a broken pipe (EPIPE, SIGPIPE is blocked on this thread):
+ * the batch failed.
+ */
+static bool run_nft (void (*write_script) (FILE *fp, const void *args), const void *args) {
+    char command[512];
+    FILE *fp;
+    int status, error = 0;
+
+    snprintf (command, sizeof command, "%s -f -", nft_command);
+
+    if ((fp = popen (command, "w")) == NULL) {
+        logger->error (__FILE__, __LINE__, "[Drop Set] %s: cannot run", command);
+        return false;
+    }
+
+    write_script (fp, args);
+
+    if (fflush (fp) != 0 || ferror (fp)) {
+        error = errno;
+    }
+
+    if ((status = pclose (fp)) != 0) {
+        logger->error (__FILE__, __LINE__, "[Drop Set] %s: exit status %d", command,
+                       WIFEXITED (status) ? WEXITSTATUS (status) : -1);
+        return false;
+    }
+    if (error != 0) {
+        logger->error (__FILE__, __LINE__, "[Drop Set] %s: %s", command, strerror (error));
+        return false;
+    }
+    return true;
+}
+
+static void write_batch (FILE *fp, const void *args) {
+    const struct drop_set_batch_t *batch = args;
+    int i;
+
+    for (i = 0; i < batch->count; i++) {
+        print_element (fp, &batch->items[i]);
+    }
+}
+
+/**
+ * A table of our own, replaced as a whole at startup: the four sets, and a chain that drops
+ * their traffic to the proxy port at prerouting, ahead of conntrack.
+ */
+static void write_table (FILE *fp, const void *args) {
+    const int port = *(const int *) args;
+    const char *timeout = element_timeout > 0 ? ", timeout" : "";
+
+    fprintf (fp, "add table inet %s\n", table_name);
+    fprintf (fp, "delete table inet %s\n", table_name);
+    fprintf (fp, "table inet %s {\n", table_name);
+    fprintf (fp, "    set hosts4 { type ipv4_addr;%s }\n", element_timeout > 0 ? " flags timeout;" : "");
+    fprintf (fp, "    set hosts6 { type ipv6_addr;%s }\n", element_timeout > 0 ? " flags timeout;" : "");
+    fprintf (fp, "    set prefixes4 { type ipv4_addr; flags interval%s; }\n", timeout);
+    fprintf (fp, "    set prefixes6 { type ipv6_addr; flags interval%s; }\n", timeout);
+    fprintf (fp, "    chain prerouting {\n");
+    fprintf (fp, "        type filter hook prerouting priority -300; policy accept;\n");
+    fprintf (fp, "        tcp dport %d ip saddr @hosts4 drop\n", port);
+    fprintf (fp, "        tcp dport %d ip saddr @prefixes4 drop\n", port);
+    fprintf (fp, "        tcp dport %d ip6 saddr @hosts6 drop\n", port);
+    fprintf (fp, "        tcp dport %d ip6 saddr @prefixes6 drop\n", port);
+    fprintf (fp, "    }\n");
+    fprintf (fp, "}\n");
+}
+
+static void *exporter_main (void *args) {
+    static struct drop_set_batch_t batch;
+    sigset_t sigpipe;
+
+    // nft going away mid-script must not take the proxy down with it
+    sigemptyset (&sigpipe);
+    sigaddset (&sigpipe, SIGPIPE);
+    pthread_sigmask (SIG_BLOCK, &sigpipe, NULL);
+
+    if (setup_table) {
+        const int port = system_conf->int_or_default ("port", 80);
+
+        if (run_nft (write_table, &port)) {
+            logger->notice (__FILE__, __LINE__, "[Drop Set] table inet %s ready, port %d", table_name, port);
+        }
+    }
+
+    while (!system_conf->terminated()) {
+        struct timespec deadline;
+        int i;
+
+        pthread_mutex_lock (&queue_mutex);
+
+        if (queue_length == 0) {
+            clock_gettime (CLOCK_REALTIME, &deadline);
+            deadline.tv_sec++;
+            pthread_cond_timedwait (&queue_cond, &queue_mutex, &deadline);
+        }
+
+        for (batch.count = 0; batch.count < DROP_SET_BATCH && queue_length > 0; batch.count++, queue_length--) {
+            batch.items[batch.count] = queue[queue_head];
+            queue_head = (queue_head + 1) % DROP_SET_QUEUE_SIZE;
+        }
+
+        pthread_mutex_unlock (&queue_mutex);
+
+        if (batch.count == 0) {
+            continue;
+        }
+
+        const bool exported = run_nft (write_batch, &batch);
+
+        pthread_mutex_lock (&queue_mutex);
+
+        counters.batches++;
+        if (exported) {
+            counters.exported += batch.count;
+        } else {
+            counters.failed += batch.count;
+
+            for (i = 0; i < batch.count; i++) {
+                recent[recent_slot_of (&batch.items[i].address, batch.items[i].prefix_length)].prefix_length = -1;
+            }
+        }
+
+        pthread_mutex_unlock (&queue_mutex);
+    }
+    return NULL;
+}
+
+static void get_stats (struct drop_set_stats_t *stats) {
+    pthread_mutex_lock (&queue_mutex);
+    *stats = counters;
+    stats->enabled = table_name != NULL;
+    stats->table = table_name;
+    stats->timeout = element_timeout;
+    stats->pending = queue_length;
+    stats->capacity = DROP_SET_QUEUE_SIZE;
+    pthread_mutex_unlock (&queue_mutex);
+}
+
+static const char *const context_name (void) {
+    const static char *const name = DROP_SET_EXPORTER_DEFAULT_CONTEXT_NAME;
+    return name;
+}
+
+static const char **depends_on (int *number) {
+    static const char *dependencies[] = {
+        SYSTEM_CONFIG_DEFAULT_CONTEXT_NAME,
+    };
+
+    *number = sizeof dependencies / sizeof dependencies[0];
+    return dependencies;
+}
+
+static void post_construct (void) {
+    system_conf = (struct system_config_t *) get_application_context()->get_bean (SYSTEM_CONFIG_DEFAULT_CONTEXT_NAME);
+
+    if (table_name != NULL) {
+        pthread_create (&exporter_thread, NULL, exporter_main, NULL);
+        pthread_detach (exporter_thread);
+    }
+}
+
+static struct drop_set_exporter_t instance = {
+    .context = {
+        .header = {
+            .magic = CONTEXT_MAGIC_NUMBER,
+            .version_major = CONTEXT_MAJOR_VERSION,
+            .version_minor = CONTEXT_MINOR_VERSION,
+        },
+        .name = context_name,
+        .post_construct = post_construct,
+        .depends_on = depends_on,
+    },
+    .block = block,
+    .get_stats = get_stats,
+};
+
+static bool initialized = false;
+
+/**
+ * @param table nftables table (family inet) holding the drop sets, NULL: exporter off
+ * @param timeout seconds an element stays in the kernel, 0: until the table is replaced
+ * @param setup create (replace) the table, its sets and the drop chain at startup
+ * @param command nft binary
+ */
+struct drop_set_exporter_t *new_drop_set_exporter (const char *table, const int timeout, const bool setup, const char *command) {
+    logger = get_application_context()->get_logger();
+
+    if (!initialized) {
+        int i;
+
+        for (i = 0; i < DROP_SET_RECENT_SIZE; i++) {
+            recent[i].prefix_length = -1;
+        }
+
+        if (table != NULL && *table != '\0') {
+            table_name = strdup (table);
+            nft_command = strdup (command != NULL ? command : "nft");
+            element_timeout = timeout > 0 ? timeout : 0;
+            setup_table = setup;
+        }
+
+        initialized = true;
+    }
+    return &instance;
+}
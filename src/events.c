@@ -1,133 +1,307 @@
 #include <sys/epoll.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <errno.h>
 #include "events.h"
 #include "logger.h"
 
-#define MAX_EVENTS 1024
+#define EVENTS_PER_WAKEUP 1024
+#define REGISTRATION_CHUNK_BITS 10
+#define REGISTRATION_CHUNK_SIZE (1 << REGISTRATION_CHUNK_BITS)
+#define RELEASING_FD -2
+#define NO_REGISTRATION -1
 
 static struct logger_t *logger;
 
-static struct event_loop_data_t {
+struct event_registration_t {
+    int fd;
+    int index;
+    int next_free;
+    uint32_t events;
+    void *args;
+
+    void (*handler) (const int fd, const uint32_t events, void *args);
+};
+
+// owned by the thread running the loop: nothing here is locked, other threads must ask it
+struct event_loop_data_t {
     int epollfd;
-    struct epoll_event events[MAX_EVENTS];
-    int fds[MAX_EVENTS];
-    void *args[MAX_EVENTS];
-    int max_events;
+    struct epoll_event events[EVENTS_PER_WAKEUP];
+    struct event_registration_t **chunks;
+    int number_of_chunks;
+    int capacity;
+    int max_registrations;
+    int free_head;
+    int releasing_head;
+    bool dispatching;
     int num_of_events;
+    struct event_loop_stats_t stats;
+};
 
-    void (*handlers[MAX_EVENTS]) (const int fd, void *args);
-} singleton_data, *data;
 
-static struct event_loop_t singleton, *self;
+static struct event_registration_t *registration_of (struct event_loop_data_t *data, const int index) {
+    return &data->chunks[index >> REGISTRATION_CHUNK_BITS][index & (REGISTRATION_CHUNK_SIZE - 1)];
+}
 
+static bool grow_registrations (struct event_loop_data_t *data) {
+    if (data->capacity >= data->max_registrations) {
+        return false;
+    }
 
-static int find_first_free() {
-    int i = 0;
+    struct event_registration_t **chunks = realloc (data->chunks, (data->number_of_chunks + 1) * sizeof (struct event_registration_t *));
 
-    for (i = 0; i < data->max_events; i++) {
-        if (data->fds[i] == -1) {
-            data->num_of_events++;
-            return i;
-        }
+    if (chunks == NULL) {
+        return false;
+    }
+    data->chunks = chunks;
+
+    struct event_registration_t *chunk = malloc (REGISTRATION_CHUNK_SIZE * sizeof (struct event_registration_t));
+
+    if (chunk == NULL) {
+        return false;
+    }
+
+    int i;
+    const int base = data->number_of_chunks << REGISTRATION_CHUNK_BITS;
+
+    // chain the new slots in ascending order in front of the free list
+    for (i = 0; i < REGISTRATION_CHUNK_SIZE; i++) {
+        chunk[i].fd = -1;
+        chunk[i].index = base + i;
+        chunk[i].next_free = i + 1 < REGISTRATION_CHUNK_SIZE ? base + i + 1 : data->free_head;
+    }
+
+    data->chunks[data->number_of_chunks++] = chunk;
+    data->capacity += REGISTRATION_CHUNK_SIZE;
+    data->free_head = base;
+
+    logger->debug (__FILE__, __LINE__, "event registry enlarged to %d slots", data->capacity);
+
+    return true;
+}
+
+static struct event_registration_t *allocate_registration (struct event_loop_data_t *data) {
+    if (data->num_of_events >= data->max_registrations) {
+        return NULL;
     }
-    if (data->max_events < MAX_EVENTS) {
-        i = data->max_events;
-        data->max_events++;
-        data->num_of_events++;
-        return i;
+
+    if (data->free_head == NO_REGISTRATION && !grow_registrations (data)) {
+        return NULL;
     }
-    return -1;
+
+    struct event_registration_t *registration = registration_of (data, data->free_head);
+
+    data->free_head = registration->next_free;
+    data->num_of_events++;
+
+    return registration;
 }
 
-static bool ev_remove_event (int index) {
-    if (index >= 0 && index < data->max_events) {
-        data->fds[index] = -1;
-        data->num_of_events--;
+static void release_registration (struct event_loop_data_t *data, struct event_registration_t *registration) {
+    registration->fd = -1;
+    registration->next_free = data->free_head;
+    data->free_head = registration->index;
+}
 
-        while (data->max_events > 0 && data->fds[data->max_events - 1] < 0) {
-            data->max_events--;
+static bool ev_remove_event (struct event_loop_t *self, int index) {
+    struct event_loop_data_t *data = self->data;
+
+    if (index >= 0 && index < data->capacity) {
+        struct event_registration_t *registration = registration_of (data, index);
+
+        if (registration->fd >= 0) {
+            epoll_ctl (data->epollfd, EPOLL_CTL_DEL, registration->fd, NULL);
+            data->num_of_events--;
+
+            if (data->dispatching) {
+                // events of the current batch may still point to this entry
+                registration->fd = RELEASING_FD;
+                registration->next_free = data->releasing_head;
+                data->releasing_head = index;
+            } else {
+                release_registration (data, registration);
+            }
+            return true;
         }
-        return true;
     }
     return false;
 }
 
-static int ev_add_event (int fd, void (*handler) (const int, void *), void *args) {
-    int index = find_first_free();
+static int ev_add_event (struct event_loop_t *self, int fd, const uint32_t events,
+                         void (*handler) (const int, const uint32_t, void *), void *args) {
+    struct event_loop_data_t *data = self->data;
+    struct event_registration_t *registration = allocate_registration (data);
 
-    if (index >= 0) {
-//        fprintf (stderr, "register event fd=%d, index=%d\n", fd, index);
+    if (registration != NULL) {
         struct epoll_event ev = {
-            .events = EPOLLIN,
-            .data.fd = fd
+            .events = events,
+            .data.ptr = registration
         };
 
         if (epoll_ctl (data->epollfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
             perror ("epoll_ctl: listen_sock");
+            data->num_of_events--;
+            release_registration (data, registration);
             return -1;
         }
 
-        data->fds[index] = fd;
-        data->handlers[index] = handler;
-        data->args[index] = args;
+        registration->fd = fd;
+        registration->events = events;
+        registration->handler = handler;
+        registration->args = args;
 
-        return index;
+        return registration->index;
     } else {
-        fprintf (stderr, "reach max file descriptors\n");
+        logger->error (__FILE__, __LINE__, "reach max file descriptors (%d)", data->max_registrations);
         return -2;
     }
 }
 
-static int ev_looping() {
-//    fprintf (stderr, "Event loop (%d)\n", data->max_events);
-    int nfds = epoll_wait (data->epollfd, data->events, data->max_events, -1);
-    int i, n;
+static bool ev_modify_event (struct event_loop_t *self, int index, const uint32_t events) {
+    struct event_loop_data_t *data = self->data;
+
+    if (index >= 0 && index < data->capacity) {
+        struct event_registration_t *registration = registration_of (data, index);
+
+        if (registration->fd >= 0) {
+            if (registration->events != events) {
+                struct epoll_event ev = {
+                    .events = events,
+                    .data.ptr = registration
+                };
+
+                if (epoll_ctl (data->epollfd, EPOLL_CTL_MOD, registration->fd, &ev) == -1) {
+                    logger->error (__FILE__, __LINE__, "epoll_ctl (modify fd=%d): %s", registration->fd, strerror (errno));
+                    return false;
+                }
+                registration->events = events;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+static int ev_looping (struct event_loop_t *self) {
+    struct event_loop_data_t *data = self->data;
+    int nfds = epoll_wait (data->epollfd, data->events, EVENTS_PER_WAKEUP, -1);
+    int n;
 
     if (nfds == -1) {
-        logger->error (__FILE__, __LINE__, "epoll_wait: %s", strerror (errno));
+        if (errno != EINTR) {
+            logger->error (__FILE__, __LINE__, "epoll_wait: %s", strerror (errno));
+        }
 //        return -1;
         return 0;
     }
 
+    data->dispatching = true;
+
     for (n = 0; n < nfds; ++n) {
-//        fprintf (stderr, "%d/%d\n", n, nfds);
-        for (i = 0; i < data->max_events; i++) {
-            if (data->events[n].data.fd == data->fds[i]) {
-                data->handlers[i] (data->fds[i], data->args[i]);
-                return 0;
-            }
+        struct event_registration_t *registration = data->events[n].data.ptr;
+
+        if (registration->fd >= 0) {
+            registration->handler (registration->fd, data->events[n].events, registration->args);
         }
     }
-    return 0;
+
+    data->dispatching = false;
+
+    while (data->releasing_head != NO_REGISTRATION) {
+        struct event_registration_t *registration = registration_of (data, data->releasing_head);
+
+        data->releasing_head = registration->next_free;
+        release_registration (data, registration);
+    }
+
+    data->stats.wakeups++;
+    data->stats.events += nfds;
+    data->stats.recent_events = nfds;
+
+    if (nfds > data->stats.max_events_per_wakeup) {
+        data->stats.max_events_per_wakeup = nfds;
+    }
+
+    return nfds;
 }
 
-static int ev_count() {
+static int ev_count (struct event_loop_t *self) {
+    struct event_loop_data_t *data = self->data;
+
     return data->num_of_events;
 }
 
-struct event_loop_t *new_event_loop (struct logger_t *newLogger) {
-    logger = newLogger;
+static void ev_get_stats (struct event_loop_t *self, struct event_loop_stats_t *stats) {
+    struct event_loop_data_t *data = self->data;
 
-    if (self == NULL) {
-        self = &singleton;
-        data = &singleton_data;
+    memcpy (stats, &data->stats, sizeof (struct event_loop_stats_t));
+    stats->registered = data->num_of_events;
+    stats->capacity = data->capacity;
+    stats->max_registrations = data->max_registrations;
+}
 
-        data->epollfd = epoll_create1 (0);
-        data->max_events = 0;
-        data->num_of_events = 0;
+static void ev_dispose (struct event_loop_t *self) {
+    if (self != NULL) {
+        if (self->data != NULL) {
+            struct event_loop_data_t *data = self->data;
+            int i;
 
-        if (data->epollfd == -1) {
-            perror ("epoll_create1");
-            return NULL;
+            if (data->epollfd >= 0) {
+                close (data->epollfd);
+            }
+
+            for (i = 0; i < data->number_of_chunks; i++) {
+                free (data->chunks[i]);
+            }
+            free (data->chunks);
+            free (self->data);
         }
+        free (self);
+    }
+}
+
+static struct event_loop_t instance = {
+    .add_event = ev_add_event,
+    .remove_event = ev_remove_event,
+    .modify_event = ev_modify_event,
+    .looping = ev_looping,
+    .count = ev_count,
+    .get_stats = ev_get_stats,
+    .dispose = ev_dispose,
+};
+
+struct event_loop_t *new_event_loop (struct logger_t *newLogger, const int max_registrations) {
+    struct event_loop_t *self = malloc (sizeof (struct event_loop_t));
+
+    logger = newLogger;
+
+    if (self != NULL) {
+        memcpy (self, &instance, sizeof (struct event_loop_t));
+
+        if ((self->data = calloc (1, sizeof (struct event_loop_data_t))) == NULL) {
+            self->dispose (self);
+            return NULL;
+        } else {
+            struct event_loop_data_t *data = self->data;
 
-        self->add_event = ev_add_event;
-        self->remove_event = ev_remove_event;
-        self->looping = ev_looping;
-        self->count = ev_count;
+            data->epollfd = epoll_create1 (0);
+            data->chunks = NULL;
+            data->number_of_chunks = 0;
+            data->capacity = 0;
+            data->max_registrations = max_registrations > 0 ? max_registrations : REGISTRATION_CHUNK_SIZE;
+            data->free_head = NO_REGISTRATION;
+            data->releasing_head = NO_REGISTRATION;
+            data->num_of_events = 0;
+            data->dispatching = false;
+
+            if (data->epollfd == -1) {
+                perror ("epoll_create1");
+                self->dispose (self);
+                return NULL;
+            }
+        }
     }
     return self;
 }
-
@@ -6,30 +6,100 @@
 #include <setjmp.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 #include "exception.h"
 
-static jmp_buf jump_buffer_env;
-static volatile bool caught;
+#define FAULT_STACK_SIZE (64 * 1024)
 
-static void exception_handler (int signo) {
-    caught = true;
-    longjmp (jump_buffer_env, 1);
+static const int fault_signals[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL };
+
+static pthread_once_t install_once = PTHREAD_ONCE_INIT;
+static pthread_key_t fault_stack_key;
+
+// innermost try_catch of this thread, NULL outside of any
+static __thread sigjmp_buf *fault_jump = NULL;
+static __thread bool fault_stack_ready = false;
+
+static void fault_handler (int signo) {
+    if (fault_jump != NULL) {
+        siglongjmp (*fault_jump, 1);
+    }
+
+    // not guarded: back to the default action, the faulting instruction runs again and dumps core
+    signal (signo, SIG_DFL);
+}
+
+static void release_fault_stack (void *stack) {
+    stack_t ss;
+
+    memset (&ss, 0, sizeof ss);
+    ss.ss_flags = SS_DISABLE;
+    sigaltstack (&ss, NULL);
+    free (stack);
+}
+
+static void install_fault_handler (void) {
+    struct sigaction sa;
+    int i;
+
+    pthread_key_create (&fault_stack_key, release_fault_stack);
+
+    memset (&sa, 0, sizeof sa);
+    sa.sa_handler = fault_handler;
+    sigemptyset (&sa.sa_mask);
+    // SA_NODEFER: siglongjmp does not restore the mask, so the signal must not stay blocked
+    sa.sa_flags = SA_ONSTACK | SA_NODEFER;
+
+    for (i = 0; i < sizeof fault_signals / sizeof fault_signals[0]; i++) {
+        sigaction (fault_signals[i], &sa, NULL);
+    }
+}
+
+/**
+ * Once per process: the fault handler; once per thread: an alternate signal stack,
+ * so that a stack overflow inside the guarded call can be caught as well.
+ */
+static void prepare_thread (void) {
+    pthread_once (&install_once, install_fault_handler);
+
+    if (!fault_stack_ready) {
+        stack_t ss;
+
+        if ((ss.ss_sp = malloc (FAULT_STACK_SIZE)) != NULL) {
+            ss.ss_size = FAULT_STACK_SIZE;
+            ss.ss_flags = 0;
+
+            if (sigaltstack (&ss, NULL) == 0) {
+                pthread_setspecific (fault_stack_key, ss.ss_sp);
+            } else {
+                free (ss.ss_sp);
+            }
+        }
+        fault_stack_ready = true;
+    }
 }
 
 bool try_catch (void f (va_list ap), ...) {
+    sigjmp_buf env;
+    sigjmp_buf *const outer = fault_jump;
     va_list ap;
 
-    va_start (ap, f);
-
-    caught = false;
-    signal (SIGSEGV, &exception_handler);
+    prepare_thread ();
 
-    setjmp (jump_buffer_env);
+    va_start (ap, f);
 
-    if (! caught) {
+    // no signal mask saved: nothing but a couple of stores per call
+    if (sigsetjmp (env, 0) == 0) {
+        fault_jump = &env;
         f (ap);
+        fault_jump = outer;
+        va_end (ap);
+        return false;
     }
 
-    signal (SIGSEGV, SIG_DFL);
-    return caught;
-}
\ No newline at end of file
+    fault_jump = outer;
+    va_end (ap);
+    return true;
+}
@@ -0,0 +1,275 @@
+//
+// Binary trie over address bits, one root for IPv4 (32 bits, matched against IPv4-mapped
+// addresses) and one for IPv6 (128 bits). Nodes live in one array and refer to each other
+// by index, index 0 (the IPv4 root, never a child) standing for no child.
+//
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "ip_prefix_trie.h"
+
+#define IPV4_ROOT 0
+#define IPV6_ROOT 1
+#define IPV4_MAPPED_PREFIX_LENGTH 96
+
+struct ip_prefix_node_t {
+    uint32_t child[2];
+    bool terminal;
+};
+
+struct ip_prefix_trie_data_t {
+    struct ip_prefix_node_t *nodes;
+    uint32_t number_of_nodes;
+    uint32_t capacity;
+    int number_of_prefixes;
+};
+
+static const struct in6_addr ipv4_mapped_prefix = { .s6_addr = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff } };
+
+static inline int bit_of (const uint8_t *bytes, const int i) {
+    return (bytes[i >> 3] >> (7 - (i & 7))) & 1;
+}
+
+static bool same_prefix (const uint8_t *a, const uint8_t *b, const int length) {
+    int i;
+
+    for (i = 0; i < length; i++) {
+        if (bit_of (a, i) != bit_of (b, i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static uint32_t new_node (struct ip_prefix_trie_data_t *data) {
+    if (data->number_of_nodes == data->capacity) {
+        uint32_t capacity = data->capacity * 2;
+        struct ip_prefix_node_t *nodes = realloc (data->nodes, capacity * sizeof (struct ip_prefix_node_t));
+
+        if (nodes == NULL) {
+            return 0;
+        }
+        data->nodes = nodes;
+        data->capacity = capacity;
+    }
+
+    memset (&data->nodes[data->number_of_nodes], 0, sizeof (struct ip_prefix_node_t));
+    return data->number_of_nodes++;
+}
+
+static bool insert (struct ip_prefix_trie_data_t *data, const uint32_t root, const uint8_t *bytes, const int length) {
+    uint32_t node = root;
+    int i;
+
+    for (i = 0; i < length; i++) {
+        const int bit = bit_of (bytes, i);
+
+        if (data->nodes[node].child[bit] == 0) {
+            uint32_t child = new_node (data);
+
+            if (child == 0) {
+                return false;
+            }
+            data->nodes[node].child[bit] = child;
+        }
+        node = data->nodes[node].child[bit];
+    }
+
+    if (!data->nodes[node].terminal) {
+        data->nodes[node].terminal = true;
+        data->number_of_prefixes++;
+    }
+    return true;
+}
+
+/**
+ * Parse a prefix into an IPv6 (or IPv4-mapped) address and a prefix length over 128 bits.
+ * Without "/len": "a.b.c." and "x:y::" keep the whole octets / groups written down,
+ * anything else is a single host.
+ *
+ * @param groups set when "x:y::" was read as the groups written down rather than as an address
+ */
+static bool parse_prefix (const char *const prefix, struct in6_addr *address, int *prefix_length, bool *groups) {
+    char buffer[INET6_ADDRSTRLEN + 8];
+    char *slash;
+    size_t len = strlen (prefix);
+    int length = -1;
+    bool is_v6;
+
+    *groups = false;
+
+    if (len == 0 || len >= INET6_ADDRSTRLEN) {
+        return false;
+    }
+    strcpy (buffer, prefix);
+
+    if ((slash = strchr (buffer, '/')) != NULL) {
+        char *end;
+
+        *slash = '\0';
+        length = strtol (slash + 1, &end, 10);
+
+        if (slash[1] == '\0' || *end != '\0' || length < 0) {
+            return false;
+        }
+        len = slash - buffer;
+    }
+
+    is_v6 = strchr (buffer, ':') != NULL;
+
+    if (length < 0 && buffer[len - 1] == '.') {
+        const char *tail = is_v6 ? strrchr (buffer, ':') + 1 : buffer;
+        int octets = 0;
+
+        for (; *tail != '\0'; tail++) {
+            octets += *tail == '.';
+        }
+        if (octets > 3) {
+            return false;
+        }
+
+        length = (is_v6 ? IPV4_MAPPED_PREFIX_LENGTH : 0) + octets * 8;
+
+        for (; octets < 4; octets++) {
+            strcat (buffer, octets < 3 ? "0." : "0");
+        }
+    } else if (length < 0 && is_v6 && len > 2 && strcmp (buffer + len - 2, "::") == 0) {
+        const char *p;
+
+        for (length = 16, p = buffer; p < buffer + len - 2; p++) {
+            length += *p == ':' ? 16 : 0;
+        }
+        *groups = true;
+    }
+
+    if (is_v6) {
+        if (inet_pton (AF_INET6, buffer, address) != 1) {
+            return false;
+        }
+        if (length < 0) {
+            length = 128;
+        }
+    } else {
+        struct in_addr ipv4;
+
+        if (inet_pton (AF_INET, buffer, &ipv4) != 1) {
+            return false;
+        }
+        if (length < 0) {
+            length = 32;
+        }
+        if (length > 32) {
+            return false;
+        }
+
+        *address = ipv4_mapped_prefix;
+        memcpy (&address->s6_addr[12], &ipv4, 4);
+        length += IPV4_MAPPED_PREFIX_LENGTH;
+    }
+
+    if (length > 128) {
+        return false;
+    }
+
+    *prefix_length = length;
+    return true;
+}
+
+static bool add (struct ip_prefix_trie_t *self, const char *const prefix) {
+    struct ip_prefix_trie_data_t *data = self->data;
+    struct in6_addr address;
+    int length;
+    bool groups;
+
+    if (!parse_prefix (prefix, &address, &length, &groups)) {
+        return false;
+    }
+
+    if (length >= IPV4_MAPPED_PREFIX_LENGTH && IN6_IS_ADDR_V4MAPPED (&address)) {
+        return insert (data, IPV4_ROOT, &address.s6_addr[12], length - IPV4_MAPPED_PREFIX_LENGTH);
+    }
+
+    if (same_prefix (address.s6_addr, ipv4_mapped_prefix.s6_addr, length)) {
+        // e.g. ::/0, covers every IPv4 client as well
+        data->nodes[IPV4_ROOT].terminal = true;
+    }
+    return insert (data, IPV6_ROOT, address.s6_addr, length);
+}
+
+static bool legacy_cidr (struct ip_prefix_trie_t *self, const char *const prefix, char *cidr, const size_t size) {
+    char text[INET6_ADDRSTRLEN];
+    struct in6_addr address;
+    int length;
+    bool groups;
+
+    if (!parse_prefix (prefix, &address, &length, &groups) || !groups) {
+        return false;
+    }
+
+    inet_ntop (AF_INET6, &address, text, sizeof text);
+    snprintf (cidr, size, "%s/%d", text, length);
+    return true;
+}
+
+static bool contains (struct ip_prefix_trie_t *self, const struct in6_addr *address) {
+    const struct ip_prefix_trie_data_t *data = self->data;
+    const struct ip_prefix_node_t *nodes = data->nodes;
+    const uint8_t *bytes = address->s6_addr;
+    uint32_t node = IPV6_ROOT;
+    int i, bits = 128;
+
+    if (IN6_IS_ADDR_V4MAPPED (address)) {
+        node = IPV4_ROOT;
+        bytes += 12;
+        bits = 32;
+    }
+
+    for (i = 0; !nodes[node].terminal; i++) {
+        if (i == bits || (node = nodes[node].child[bit_of (bytes, i)]) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int size (struct ip_prefix_trie_t *self) {
+    const struct ip_prefix_trie_data_t *data = self->data;
+
+    return data->number_of_prefixes;
+}
+
+static void dispose (struct ip_prefix_trie_t *self) {
+    struct ip_prefix_trie_data_t *data = self->data;
+
+    free (data->nodes);
+    free (data);
+    free (self);
+}
+
+struct ip_prefix_trie_t *new_ip_prefix_trie (void) {
+    struct ip_prefix_trie_t *self = malloc (sizeof (struct ip_prefix_trie_t));
+    struct ip_prefix_trie_data_t *data = malloc (sizeof (struct ip_prefix_trie_data_t));
+
+    if (self == NULL || data == NULL || (data->nodes = calloc (64, sizeof (struct ip_prefix_node_t))) == NULL) {
+        free (self);
+        free (data);
+        return NULL;
+    }
+
+    data->capacity = 64;
+    data->number_of_nodes = 2;
+    data->number_of_prefixes = 0;
+
+    self->data = data;
+    self->add = add;
+    self->legacy_cidr = legacy_cidr;
+    self->contains = contains;
+    self->size = size;
+    self->dispose = dispose;
+
+    return self;
+}
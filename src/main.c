@@ -23,6 +23,8 @@
 #include "cmdlintf.h"
 #include "commands.h"
 #include "packet_analyzer.h"
+#include "admission_cache.h"
+#include "drop_set_exporter.h"
 
 static struct application_context_t *application_context = NULL;
 
@@ -65,18 +67,24 @@ static void run_timer (void) {
     minute_timer->start (cron);
 }
 
+/**
+ * Only flags and signals in here: main leaves the timer loop and shuts down from there.
+ */
 static void interrupt (int signal_no) {
+    static volatile sig_atomic_t stopping = 0;
+
     system_config->terminate();
 
     pthread_t thread = pthread_self();
 
     if (pthread_equal (thread, main_thread)) {
-        pthread_kill (proxy_thread, signal_no);
-        if (blacklistService != NULL) {
-            blacklistService->terminate();
+        if (!stopping) {
+            stopping = 1;
+            pthread_kill (proxy_thread, signal_no);
+            minute_timer->terminate();
         }
-        exit (0);
-    } else if (pthread_equal (thread, proxy_thread)) {
+    } else if (!pthread_equal (thread, proxy_thread) && !stopping) {
+        pthread_kill (main_thread, signal_no);
     }
 }
 
@@ -250,12 +258,30 @@ int main (int argc, char *argv[]) {
 
         expiring_timeout = (double) conf->int_or_default ("expiring-timeout", 180);
 
-        const int hash_size = conf->int_or_default ("hash-size", 521);
+        const int blacklist_capacity = conf->int_or_default ("blacklist-capacity", 262144);
+        const int blacklist_shards = conf->int_or_default ("blacklist-shards", 16);
         const int monitor_period = conf->int_or_default ("monitor-period", 86400);
+        const int ipv4_prefix = conf->int_or_default ("blacklist-ipv4-prefix", 32);
+        const int ipv6_prefix = conf->int_or_default ("blacklist-ipv6-prefix", 64);
+
+        if (conf->str ("hash-size") != NULL) {
+            // the chained table it sized held any number of entries, its bucket count is no capacity
+            fprintf (stderr, "Auto-Blacklist: \"hash-size\" is deprecated and ignored, %s\n",
+                     conf->str ("blacklist-capacity") != NULL ? "blacklist-capacity is used" :
+                     "set blacklist-capacity (addresses tracked at most) instead");
+        }
+
+        fprintf (stderr, "Auto-Blacklist: capacity: %d (%d shards), monitor: %d second(s), prefix: /%d, /%d\n",
+                 blacklist_capacity, blacklist_shards, monitor_period, ipv4_prefix, ipv6_prefix);
 
-        fprintf (stderr, "Auto-Blacklist: hash size: %d, monitor: %d second(s)\n", hash_size, monitor_period);
+        blacklistService = new_auto_blacklist_service (blacklist_capacity, blacklist_shards, monitor_period,
+                                                       ipv4_prefix, ipv6_prefix);
 
-        blacklistService = new_auto_blacklist_service (hash_size, monitor_period);
+        const char *blacklist_snapshot = conf->str_or_default ("blacklist-snapshot", NULL);
+
+        if (blacklist_snapshot != NULL && *blacklist_snapshot != '\0') {
+            blacklistService->restore (blacklist_snapshot, conf->int_or_default ("blacklist-snapshot-interval", 300));
+        }
         application_context->populate (blacklistService);
 
         const char *logfile_name = "log-file";
@@ -309,6 +335,14 @@ int main (int argc, char *argv[]) {
         proxyingService = init_proxying_service();
 
         application_context->populate (db_svc);
+        application_context->populate (new_admission_cache (conf->int_or_default ("admission-cache-ttl", 60),
+                                       conf->int_or_default ("admission-cache-negative-ttl", 5),
+                                       conf->int_or_default ("admission-cache-max-entries", 65536),
+                                       conf->int_or_default ("admission-cache-hash-size", 0)));
+        application_context->populate (new_drop_set_exporter (conf->str_or_default ("drop-set-table", NULL),
+                                       conf->int_or_default ("drop-set-timeout", 600),
+                                       conf->int_or_default ("drop-set-setup", 1) != 0,
+                                       conf->str_or_default ("drop-set-command", "nft")));
         application_context->populate (init_packet_analyzer ());
         application_context->populate (proxyingService);
 //        db_svc = new_database_service (system_conf);
@@ -339,9 +373,8 @@ int main (int argc, char *argv[]) {
             signal (SIGUSR2, log_level_change);
 
             run_timer();
-
-            pthread_join (proxy_thread, NULL);
         }
+        // the shutdown snapshot, written by the expiring thread, then joined
         blacklistService->terminate();
     }
 
@@ -33,7 +33,11 @@ static int get_prev_day_of_year (void) {
 
 static void terminate_minute_timer (void) {
     terminate = true;
-    pthread_kill (timer_thread, SIGINT);
+
+    // from a signal handler on the timer thread itself, the signal already cut the sleep short
+    if (!pthread_equal (pthread_self(), timer_thread)) {
+        pthread_kill (timer_thread, SIGINT);
+    }
 }
 
 static void start_minute_timer (void (*func) (const struct timeval *, const struct tm *)) {
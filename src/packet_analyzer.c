@@ -5,6 +5,9 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
 #include <dlfcn.h>
 #include "sysconf.h"
 #include "logger.h"
@@ -13,18 +16,105 @@
 
 static struct system_config_t *sysconf;
 static struct logger_t *logger = &excalibur_common_logger;
-static struct pluggable_packet_analyzer_t *pluggableAnalyzer = NULL;
-static void *library;
-static int reference_count = 0;
 static volatile bool plugin_enable = false;
-static bool auto_unload = false;
 static volatile bool safe_mode = false;
+static volatile bool async_mode = false;
+
+/**
+ * One loaded plugin library. Every session holds a reference, and so does current_module
+ * while the module is the one new connections bind to; the library is closed when the
+ * last reference goes away. The structs themselves are never freed (see module_acquire).
+ */
+struct analyzer_module_t {
+    struct pluggable_packet_analyzer_v2_t *plugin;
+    // version 1 plugins are driven through this
+    struct pluggable_packet_analyzer_v2_t v1_adapter;
+    void *library;
+    char *file;
+    int generation;
+    int refs;
+    int closed;
+    struct analyzer_module_t *next;
+};
+
+static struct analyzer_module_t *volatile current_module = NULL;
+static struct analyzer_module_t *modules = NULL;
+// serializes load / swap / unload, the data path never takes it
+static pthread_mutex_t modules_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int generation = 0;
+static uint64_t module_swaps = 0;
+static uint64_t modules_closed = 0;
+
+struct analyzer_counters_t {
+    int requestCount;
+    int responseCount;
+    ssize_t bytesSent;
+    ssize_t bytesReceived;
+    struct timeval recent;
+};
+
+/**
+ * What proxying holds in packet_analyzer_data. In async mode the analyzer thread keeps
+ * the session alive until the last queued chunk has been analyzed.
+ */
+struct analyzer_session_t {
+    struct analyzer_module_t *module;
+    void *plugin_data;
+    int refs;
+    bool async;
+    bool closing;
+    bool shadow_ready;
+    uint32_t directions;
+    uint64_t max_bytes;
+    uint64_t seen[2];
+    struct analyzer_counters_t final;
+    struct connection_info shadow;
+};
+
+struct analyzer_chunk_t {
+    struct analyzer_session_t *session;
+    bool fromClient;
+    struct analyzer_counters_t counters;
+    ssize_t len;
+    char data[];
+};
+
+/**
+ * Single producer (one proxy worker thread), single consumer (the analyzer thread).
+ */
+struct analyzer_ring_t {
+    struct analyzer_chunk_t **slots;
+    unsigned int mask;
+    volatile unsigned int head;
+    volatile unsigned int tail;
+    uint64_t enqueued;
+    uint64_t dropped;
+    uint64_t dropped_bytes;
+    struct analyzer_ring_t *next;
+};
+
+static __thread struct analyzer_ring_t *thread_ring = NULL;
+static struct analyzer_ring_t *rings = NULL;
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int ring_size = 1024;
+static int batch_size = 64;
+static bool analyzer_thread_started = false;
+static volatile bool analyzer_sleeping = false;
+static pthread_mutex_t analyzer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t analyzer_cond = PTHREAD_COND_INITIALIZER;
+static uint64_t analyzed_chunks = 0;
+static uint64_t analyzed_batches = 0;
 
 struct analyze_param_t {
+    struct analyzer_module_t *module;
+    const struct pluggable_packet_analyzer_v2_t *plugin;
     struct connection_info *info;
     bool fromClient;
     char *buffer;
-    const ssize_t len;
+    ssize_t len;
+    const struct iovec *iov;
+    int iovcnt;
     uint64_t *return_value;
 };
 
@@ -33,61 +123,220 @@ struct module_loader_t {
     void (*unload) (void);
 };
 
-static bool module_loader (const char *file, const char *symbol) {
-    if (pluggableAnalyzer == NULL) {
-        const char *err;
+static bool check_plugin_header (const struct pluggable_packet_analyzer_v2_t *plugin, const char *file) {
+    if (plugin->header.magic != PACKET_ANALYZER_MAGIC_NUMBER) {
+        logger->error (__FILE__, __LINE__, "loading %s: not a packet analyzer (%u vs %u)",
+                       file, plugin->header.magic, PACKET_ANALYZER_MAGIC_NUMBER);
+        return false;
+    } else if (plugin->header.version_major != PACKET_ANALYZER_MAJOR_VERSION) {
+        logger->error (__FILE__, __LINE__, "loading %s: ABI version %d.%d, expecting %d.x",
+                       file, plugin->header.version_major, plugin->header.version_minor,
+                       PACKET_ANALYZER_MAJOR_VERSION);
+        return false;
+    } else if (plugin->analyze == NULL && plugin->analyze_batch == NULL) {
+        logger->error (__FILE__, __LINE__, "loading %s: neither analyze nor analyze_batch", file);
+        return false;
+    }
+    return true;
+}
 
-        library = dlopen (file, RTLD_LAZY);
-        err = dlerror();    /* Clear any existing error */
+/**
+ * Look for the version 2 entry point first, then fall back to the version 1 one given by symbol.
+ */
+static struct pluggable_packet_analyzer_v2_t *find_plugin (struct analyzer_module_t *module, const char *symbol) {
+    struct pluggable_packet_analyzer_v2_t *plugin;
+    struct pluggable_packet_analyzer_t *v1;
+    const char *err;
 
-        if (library == NULL || err != NULL) {
-            logger->error (__FILE__, __LINE__, "loading %s: %s", file, err);
-            return false;
-        }
+    plugin = dlsym (module->library, PACKET_ANALYZER_V2_MODULE_NAME);
 
-        plugin_enable = false;
-        auto_unload = false;
+    if (dlerror() == NULL && plugin != NULL) {
+        return check_plugin_header (plugin, module->file) ? plugin : NULL;
+    }
 
-        pluggableAnalyzer = dlsym (library, symbol);
+    v1 = dlsym (module->library, symbol);
 
-        if ((err = dlerror()) != NULL)  {
-            logger->error (__FILE__, __LINE__, "loading %s: %s", file, err);
-            return false;
+    if ((err = dlerror()) != NULL || v1 == NULL)  {
+        logger->error (__FILE__, __LINE__, "loading %s: %s", module->file, err);
+        return NULL;
+    }
+
+    module->v1_adapter.header.magic = PACKET_ANALYZER_MAGIC_NUMBER;
+    module->v1_adapter.header.version_major = 1;
+    module->v1_adapter.header.version_minor = 0;
+    module->v1_adapter.init = v1->init;
+    module->v1_adapter.allocate = v1->allocate;
+    module->v1_adapter.release = v1->release;
+    module->v1_adapter.analyze = v1->analyze;
+    module->v1_adapter.directions = PACKET_ANALYZER_BOTH_DIRECTIONS;
+    module->v1_adapter.max_bytes = 0;
+
+    return &module->v1_adapter;
+}
+
+/**
+ * dlopen and initialize a plugin, without publishing it. Called with modules_mutex held.
+ */
+static struct analyzer_module_t *open_module (const char *file, const char *symbol) {
+    struct analyzer_module_t *module;
+    struct analyzer_module_t *loaded;
+    const char *err;
+
+    if ((module = calloc (1, sizeof (struct analyzer_module_t))) == NULL) {
+        return NULL;
+    }
+
+    module->library = dlopen (file, RTLD_LAZY);
+    err = dlerror();    /* Clear any existing error */
+
+    if (module->library == NULL || err != NULL) {
+        logger->error (__FILE__, __LINE__, "loading %s: %s", file, err);
+        free (module);
+        return NULL;
+    }
+
+    for (loaded = modules; loaded != NULL; loaded = loaded->next) {
+        if (! loaded->closed && loaded->library == module->library) {
+            // the dynamic loader hands out the library it already has, whatever is on disk now
+            logger->error (__FILE__, __LINE__, "loading %s: already loaded, install the new version under another name", file);
+            dlclose (module->library);
+            free (module);
+            return NULL;
         }
+    }
 
-        logger->notice (__FILE__, __LINE__, "plugin loaded: %s (%s)", file, symbol);
+    module->file = strdup (file);
 
-        pluggableAnalyzer->init (get_application_context());
-        return true;
-    } else {
-        return false;
+    if ((module->plugin = find_plugin (module, symbol)) == NULL) {
+        dlclose (module->library);
+        free (module->file);
+        free (module);
+        return NULL;
     }
+
+    module->plugin->init (get_application_context());
+
+    module->refs = 1;
+    module->generation = ++generation;
+    module->next = modules;
+    modules = module;
+
+    logger->notice (__FILE__, __LINE__, "plugin loaded: %s (ABI %d.%d, generation %d)", file,
+                    module->plugin->header.version_major, module->plugin->header.version_minor,
+                    module->generation);
+    return module;
 }
 
-static bool module_unload () {
-    if (pluggableAnalyzer != NULL) {
-        if (reference_count <= 0) {
-            pluggableAnalyzer = NULL;
-
-            if (library != NULL) {
-                if (dlclose (library) == 0) {
-                    library = NULL;
-                    logger->notice (__FILE__, __LINE__, "plugin unloaded");
-                } else {
-                    return false;
-                }
-            }
-            return true;
+static void module_unref (struct analyzer_module_t *module) {
+    if (__sync_sub_and_fetch (&module->refs, 1) == 0 && __sync_bool_compare_and_swap (&module->closed, 0, 1)) {
+        if (dlclose (module->library) == 0) {
+            logger->notice (__FILE__, __LINE__, "plugin unloaded: %s (generation %d)", module->file, module->generation);
         } else {
-            auto_unload = true;
-            logger->notice (__FILE__, __LINE__, "plugin busy");
+            logger->warning (__FILE__, __LINE__, "plugin %s: %s", module->file, dlerror());
+        }
+        __sync_add_and_fetch (&modules_closed, 1);
+    }
+}
+
+/**
+ * Take a reference on the module new connections bind to.
+ *
+ * Once the reference is taken, finding the module still published means its own reference
+ * was still there, so the library cannot have been closed. Otherwise a swap got in between:
+ * give the reference back and try the new one. The module struct itself stays valid either way.
+ */
+static struct analyzer_module_t *module_acquire (void) {
+    struct analyzer_module_t *module;
+
+    while ((module = current_module) != NULL) {
+        __sync_add_and_fetch (&module->refs, 1);
+
+        if (module == current_module) {
+            return module;
         }
+        module_unref (module);
+    }
+    return NULL;
+}
+
+/**
+ * Make module (possibly NULL) the one new connections bind to, the previous one is closed once
+ * its last connection is gone. Called with modules_mutex held.
+ */
+static void publish_module (struct analyzer_module_t *module) {
+    struct analyzer_module_t *old = current_module;
+
+    __sync_synchronize ();
+    current_module = module;
+    __sync_synchronize ();
+
+    if (old != NULL) {
+        if (old->refs > 1) {
+            logger->notice (__FILE__, __LINE__, "plugin retired: %s (generation %d), %d connection(s) still attached",
+                            old->file, old->generation, old->refs - 1);
+        }
+        module_unref (old);
+    }
+}
+
+static bool module_loader (const char *file, const char *symbol) {
+    struct analyzer_module_t *module = NULL;
+
+    pthread_mutex_lock (&modules_mutex);
+
+    if (current_module == NULL) {
+        plugin_enable = false;
+
+        if ((module = open_module (file, symbol)) != NULL) {
+            publish_module (module);
+        }
+    }
+
+    pthread_mutex_unlock (&modules_mutex);
+
+    return module != NULL;
+}
+
+/**
+ * New connections stop getting the plugin right away, the library is closed after the last
+ * connection still using it.
+ */
+static bool module_unload () {
+    bool unloaded = false;
+
+    pthread_mutex_lock (&modules_mutex);
+
+    if (current_module != NULL) {
+        publish_module (NULL);
+        unloaded = true;
+    }
+
+    pthread_mutex_unlock (&modules_mutex);
+
+    return unloaded;
+}
+
+/**
+ * Load file alongside the current plugin and switch new connections over to it;
+ * connections already open finish with the version they started with.
+ */
+static bool module_swap (const char *file) {
+    struct analyzer_module_t *module;
+
+    pthread_mutex_lock (&modules_mutex);
+
+    if ((module = open_module (file, PACKET_ANALYZER_MODULE_NAME)) != NULL) {
+        publish_module (module);
+        module_swaps++;
     }
-    return false;
+
+    pthread_mutex_unlock (&modules_mutex);
+
+    return module != NULL;
 }
 
 static bool set_enable (const bool on_off) {
-    plugin_enable = on_off && pluggableAnalyzer != NULL;
+    plugin_enable = on_off && current_module != NULL;
 
     return plugin_enable;
 }
@@ -100,64 +349,537 @@ static bool get_safe_mode (void) {
     return safe_mode;
 }
 
-static void* analyzer_allocate () {
-    if (pluggableAnalyzer != NULL && plugin_enable) {
-        void *ptr = pluggableAnalyzer->allocate();
-        if (ptr != NULL) {
-            reference_count++;
+/**
+ * Only the version that faulted is given up: a session still bound to a retired version
+ * must not take the current one down with it.
+ */
+static void plugin_crashed (struct analyzer_module_t *module) {
+    pthread_mutex_lock (&modules_mutex);
+
+    if (module == current_module) {
+        plugin_enable = false;
+        logger->warning (__FILE__, __LINE__, "exception caught, disable plugin %s (generation %d)",
+                         module->file, module->generation);
+        publish_module (NULL);
+    } else {
+        logger->warning (__FILE__, __LINE__, "exception caught in retired plugin %s (generation %d)",
+                         module->file, module->generation);
+    }
+
+    pthread_mutex_unlock (&modules_mutex);
+}
+
+static void safe_hook (va_list ap) {
+    void (*hook) (struct connection_info *) = va_arg (ap, void (*) (struct connection_info *));
+    struct connection_info *info = va_arg (ap, struct connection_info *);
+
+    hook (info);
+}
+
+static void call_hook (struct analyzer_module_t *module, void (*hook) (struct connection_info *), struct connection_info *info) {
+    if (hook != NULL) {
+        if (!safe_mode) {
+            hook (info);
+        } else if (try_catch (safe_hook, hook, info)) {
+            plugin_crashed (module);
         }
-        return ptr;
     }
-    return NULL;
 }
 
-static void analyzer_release (void *data) {
-    if (data != NULL && pluggableAnalyzer != NULL) {
-        pluggableAnalyzer->release (data);
-        reference_count--;
+static void take_counters (const struct connection_info *info, struct analyzer_counters_t *counters) {
+    counters->requestCount = info->requestCount;
+    counters->responseCount = info->responseCount;
+    counters->bytesSent = info->bytesSent;
+    counters->bytesReceived = info->bytesReceived;
+    counters->recent = info->recent;
+}
+
+static void apply_counters (struct connection_info *info, const struct analyzer_counters_t *counters) {
+    info->requestCount = counters->requestCount;
+    info->responseCount = counters->responseCount;
+    info->bytesSent = counters->bytesSent;
+    info->bytesReceived = counters->bytesReceived;
+    info->recent = counters->recent;
+}
+
+static void* analyzer_allocate (struct connection_info *info) {
+    struct analyzer_module_t *module;
+    struct analyzer_session_t *session;
 
-        if (reference_count == 0 && auto_unload) {
-            module_unload();
+    if (!plugin_enable || (module = module_acquire ()) == NULL) {
+        return NULL;
+    }
+
+    if ((session = calloc (1, sizeof (struct analyzer_session_t))) == NULL) {
+        module_unref (module);
+        return NULL;
+    }
+
+    if ((session->plugin_data = module->plugin->allocate()) == NULL) {
+        free (session);
+        module_unref (module);
+        return NULL;
+    }
+
+    session->module = module;
+    session->refs = 1;
+    session->async = async_mode;
+    session->directions = module->plugin->directions;
+    session->max_bytes = module->plugin->max_bytes;
+
+    info->packet_analyzer_data = session->plugin_data;
+    call_hook (module, module->plugin->on_open, info);
+    info->packet_analyzer_data = NULL;
+
+    return session;
+}
+
+static void session_unref (struct analyzer_session_t *session) {
+    if (__sync_sub_and_fetch (&session->refs, 1) == 0) {
+        struct analyzer_module_t *module = session->module;
+
+        // on_open ran for every session: on_close too, even if the plugin was disabled meanwhile
+        if (session->closing) {
+            apply_counters (&session->shadow, &session->final);
+            call_hook (module, module->plugin->on_close, &session->shadow);
+        }
+        module->plugin->release (session->plugin_data);
+
+        if (session->shadow_ready) {
+            free (session->shadow.remote_ip);
+
+            if (session->shadow.request_in_db != NULL) {
+                free (session->shadow.request_in_db->account);
+                free (session->shadow.request_in_db);
+            }
+        }
+        free (session);
+
+        module_unref (module);
+    }
+}
+
+/**
+ * The plugin sees a private copy of connection_info: the worker keeps changing (and finally
+ * recycles) the original while the chunk is still waiting in the ring.
+ */
+static bool prepare_shadow (struct analyzer_session_t *session, const struct connection_info *info) {
+    struct connection_info *shadow = &session->shadow;
+
+    memcpy (shadow, info, sizeof (struct connection_info));
+    shadow->packet_analyzer_data = session->plugin_data;
+    shadow->prev = shadow->next = NULL;
+    shadow->connect_prev = shadow->connect_next = NULL;
+    shadow->worker = NULL;
+    shadow->remote_ip = info->remote_ip != NULL ? strdup (info->remote_ip) : NULL;
+    shadow->request_in_db = NULL;
+
+    if (info->request_in_db != NULL) {
+        if ((shadow->request_in_db = malloc (sizeof (struct db_proxy_request_t))) == NULL) {
+            free (shadow->remote_ip);
+            return false;
+        }
+        memcpy (shadow->request_in_db, info->request_in_db, sizeof (struct db_proxy_request_t));
+
+        if (info->request_in_db->account != NULL) {
+            shadow->request_in_db->account = strdup (info->request_in_db->account);
         }
     }
+    session->shadow_ready = true;
+    return true;
+}
+
+static void analyzer_release (struct connection_info *info) {
+    struct analyzer_session_t *session = info->packet_analyzer_data;
+
+    if (session == NULL) {
+        return;
+    }
+
+    if (session->async) {
+        // on_close runs on the analyzer thread, after the chunks still queued
+        if (session->shadow_ready || prepare_shadow (session, info)) {
+            take_counters (info, &session->final);
+            session->closing = true;
+        }
+    } else {
+        info->packet_analyzer_data = session->plugin_data;
+        call_hook (session->module, session->module->plugin->on_close, info);
+    }
+
+    info->packet_analyzer_data = NULL;
+    session_unref (session);
+}
+
+/**
+ * @return how many more bytes of this direction the plugin asked for
+ */
+static uint64_t bytes_wanted (const struct analyzer_session_t *session, const bool fromClient) {
+    const uint32_t direction = fromClient ? PACKET_ANALYZER_CLIENT_TO_SERVER : PACKET_ANALYZER_SERVER_TO_CLIENT;
+
+    if ((session->directions & direction) == 0) {
+        return 0;
+    } else if (session->max_bytes == 0) {
+        return UINT64_MAX;
+    } else if (session->seen[fromClient] >= session->max_bytes) {
+        return 0;
+    }
+    return session->max_bytes - session->seen[fromClient];
+}
+
+static bool wants (const struct connection_info *info, const bool fromClient) {
+    const struct analyzer_session_t *session = info->packet_analyzer_data;
+
+    return session != NULL && plugin_enable && bytes_wanted (session, fromClient) > 0;
+}
+
+static uint64_t call_plugin (const struct analyze_param_t *param) {
+    if (param->plugin->analyze_batch != NULL) {
+        if (param->iov != NULL) {
+            return param->plugin->analyze_batch (param->info, param->fromClient, param->iov, param->iovcnt);
+        } else {
+            const struct iovec iov = { .iov_base = param->buffer, .iov_len = param->len };
+
+            return param->plugin->analyze_batch (param->info, param->fromClient, &iov, 1);
+        }
+    } else if (param->iov != NULL) {
+        uint64_t return_value = 0L;
+        int i;
+
+        for (i = 0; i < param->iovcnt; i++) {
+            return_value = param->plugin->analyze (param->info, param->fromClient,
+                                                       param->iov[i].iov_base, param->iov[i].iov_len);
+        }
+        return return_value;
+    } else {
+        return param->plugin->analyze (
+                   param->info,
+                   param->fromClient,
+                   param->buffer,
+                   param->len);
+    }
 }
 
 static void safe_analyze_packet (va_list ap) {
     struct analyze_param_t *param = va_arg (ap, struct analyze_param_t *);
 
-    *param->return_value = pluggableAnalyzer->analyze (
-                               param->info,
-                               param->fromClient,
-                               param->buffer,
-                               param->len);
+    *param->return_value = call_plugin (param);
+}
+
+static uint64_t analyze_in_place (struct analyze_param_t *param) {
+    uint64_t return_value = 0L;
+
+    if (safe_mode) {
+        param->return_value = &return_value;
+
+        if (try_catch (safe_analyze_packet, param)) {
+            plugin_crashed (param->module);
+        }
+    } else {
+        return_value = call_plugin (param);
+    }
+    return return_value;
+}
+
+static struct analyzer_ring_t *create_ring (void) {
+    struct analyzer_ring_t *ring = calloc (1, sizeof (struct analyzer_ring_t));
+
+    if (ring != NULL) {
+        if ((ring->slots = calloc (ring_size, sizeof (struct analyzer_chunk_t *))) == NULL) {
+            free (ring);
+            return NULL;
+        }
+        ring->mask = ring_size - 1;
+
+        // rings are only ever prepended, the analyzer thread walks the list without the lock
+        pthread_mutex_lock (&rings_mutex);
+        ring->next = rings;
+        rings = ring;
+        pthread_mutex_unlock (&rings_mutex);
+    }
+    return ring;
+}
+
+static void wakeup_analyzer (void) {
+    if (analyzer_sleeping) {
+        pthread_mutex_lock (&analyzer_mutex);
+        pthread_cond_signal (&analyzer_cond);
+        pthread_mutex_unlock (&analyzer_mutex);
+    }
+}
+
+/**
+ * Copy the chunk into this worker's ring; never waits for the analyzer.
+ */
+static void enqueue_packet (struct analyzer_session_t *session, const struct connection_info *info,
+                            bool fromClient, const char *buffer, const ssize_t len) {
+    struct analyzer_ring_t *ring = thread_ring;
+    struct analyzer_chunk_t *chunk;
+    unsigned int tail;
+
+    if (ring == NULL && (ring = thread_ring = create_ring ()) == NULL) {
+        return;
+    }
+
+    tail = ring->tail;
+
+    if (tail - ring->head > ring->mask) {
+        ring->dropped++;
+        ring->dropped_bytes += len;
+        return;
+    }
+
+    if (! session->shadow_ready && ! prepare_shadow (session, info)) {
+        ring->dropped++;
+        ring->dropped_bytes += len;
+        return;
+    }
+
+    if ((chunk = malloc (sizeof (struct analyzer_chunk_t) + len)) == NULL) {
+        ring->dropped++;
+        ring->dropped_bytes += len;
+        return;
+    }
+
+    chunk->session = session;
+    chunk->fromClient = fromClient;
+    take_counters (info, &chunk->counters);
+    chunk->len = len;
+    memcpy (chunk->data, buffer, len);
+
+    __sync_add_and_fetch (&session->refs, 1);
+
+    ring->slots[tail & ring->mask] = chunk;
+    __sync_synchronize ();
+    ring->tail = tail + 1;
+    ring->enqueued++;
+
+    wakeup_analyzer ();
+}
+
+/**
+ * Consecutive chunks of one session and direction go to the plugin in one analyze_batch call.
+ */
+static void analyze_chunks (struct analyzer_chunk_t **chunks, const int n, struct iovec *iov) {
+    struct analyzer_session_t *session = chunks[0]->session;
+    int i;
+
+    if (plugin_enable) {
+        struct analyze_param_t param = {
+            .module = session->module,
+            .plugin = session->module->plugin,
+            .info = &session->shadow,
+            .fromClient = chunks[0]->fromClient,
+        };
+
+        if (param.plugin->analyze_batch != NULL) {
+            for (i = 0; i < n; i++) {
+                iov[i].iov_base = chunks[i]->data;
+                iov[i].iov_len = chunks[i]->len;
+            }
+            param.iov = iov;
+            param.iovcnt = n;
+
+            apply_counters (&session->shadow, &chunks[n - 1]->counters);
+            analyze_in_place (&param);
+        } else {
+            for (i = 0; i < n && plugin_enable; i++) {
+                param.buffer = chunks[i]->data;
+                param.len = chunks[i]->len;
+
+                apply_counters (&session->shadow, &chunks[i]->counters);
+                analyze_in_place (&param);
+            }
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        free (chunks[i]);
+        session_unref (session);
+    }
+}
+
+/**
+ * Take up to batch_size chunks off one ring.
+ *
+ * @return number of chunks analyzed
+ */
+static int drain_ring (struct analyzer_ring_t *ring, struct analyzer_chunk_t **batch, struct iovec *iov) {
+    unsigned int head = ring->head;
+    unsigned int tail = ring->tail;
+    int i, j, n = 0;
+
+    __sync_synchronize ();
+
+    while (head != tail && n < batch_size) {
+        batch[n++] = ring->slots[head++ & ring->mask];
+    }
+
+    // give the slots back right away, the worker may be waiting for room
+    __sync_synchronize ();
+    ring->head = head;
+
+    for (i = 0; i < n; i = j) {
+        for (j = i + 1; j < n && batch[j]->session == batch[i]->session
+                && batch[j]->fromClient == batch[i]->fromClient; j++);
+
+        analyze_chunks (&batch[i], j - i, iov);
+    }
+    return n;
+}
+
+static void *analyzer_main (void *args) {
+    struct analyzer_chunk_t **batch = malloc (batch_size * sizeof (struct analyzer_chunk_t *));
+    struct iovec *iov = malloc (batch_size * sizeof (struct iovec));
+
+    while (true) {
+        struct analyzer_ring_t *ring;
+        int total = 0;
+
+        pthread_mutex_lock (&rings_mutex);
+        ring = rings;
+        pthread_mutex_unlock (&rings_mutex);
+
+        for (; ring != NULL; ring = ring->next) {
+            int n = drain_ring (ring, batch, iov);
+
+            if (n > 0) {
+                __sync_add_and_fetch (&analyzed_chunks, n);
+                __sync_add_and_fetch (&analyzed_batches, 1);
+                total += n;
+            }
+        }
+
+        if (total == 0) {
+            struct timeval now;
+            struct timespec ts;
+
+            gettimeofday (&now, NULL);
+            ts.tv_sec = now.tv_sec;
+            ts.tv_nsec = now.tv_usec * 1000L + 10 * 1000000L;
+
+            if (ts.tv_nsec >= 1000000000L) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
+            }
+
+            pthread_mutex_lock (&analyzer_mutex);
+            analyzer_sleeping = true;
+            pthread_cond_timedwait (&analyzer_cond, &analyzer_mutex, &ts);
+            analyzer_sleeping = false;
+            pthread_mutex_unlock (&analyzer_mutex);
+        }
+    }
+    return NULL;
+}
+
+static bool start_analyzer_thread (void) {
+    bool started;
+
+    pthread_mutex_lock (&analyzer_mutex);
+
+    if (! analyzer_thread_started) {
+        pthread_t thread;
+
+        if (pthread_create (&thread, NULL, analyzer_main, NULL) == 0) {
+            pthread_detach (thread);
+            analyzer_thread_started = true;
+            logger->notice (__FILE__, __LINE__, "packet analyzer thread started (ring: %u, batch: %d)",
+                            ring_size, batch_size);
+        } else {
+            logger->error (__FILE__, __LINE__, "failed to start packet analyzer thread");
+        }
+    }
+    started = analyzer_thread_started;
+
+    pthread_mutex_unlock (&analyzer_mutex);
+
+    return started;
+}
+
+/**
+ * Async mode applies to connections allocated from now on; the ones already open keep their mode.
+ */
+static bool set_async_mode (const bool on_off) {
+    async_mode = on_off && start_analyzer_thread ();
+    return async_mode == on_off;
+}
+
+static bool get_async_mode (void) {
+    return async_mode;
+}
+
+static void get_stats (struct packet_analyzer_stats_t *stats) {
+    struct analyzer_module_t *module;
+    struct analyzer_ring_t *ring;
+
+    memset (stats, 0, sizeof (struct packet_analyzer_stats_t));
+
+    pthread_mutex_lock (&rings_mutex);
+    ring = rings;
+    pthread_mutex_unlock (&rings_mutex);
+
+    for (; ring != NULL; ring = ring->next) {
+        stats->rings++;
+        stats->pending += ring->tail - ring->head;
+        stats->enqueued += ring->enqueued;
+        stats->dropped += ring->dropped;
+        stats->dropped_bytes += ring->dropped_bytes;
+    }
+
+    stats->async = async_mode;
+    stats->ring_size = ring_size;
+    stats->batch_size = batch_size;
+    stats->analyzed = analyzed_chunks;
+    stats->batches = analyzed_batches;
+    stats->swaps = module_swaps;
+    stats->closed = modules_closed;
+
+    pthread_mutex_lock (&modules_mutex);
+
+    for (module = modules; module != NULL; module = module->next) {
+        if (module == current_module) {
+            stats->sessions = module->refs - 1;
+            stats->generation = module->generation;
+            stats->abi_version = module->plugin->header.version_major;
+        } else if (! module->closed) {
+            stats->retired++;
+            stats->retired_sessions += module->refs;
+        }
+    }
+
+    pthread_mutex_unlock (&modules_mutex);
 }
 
 static uint64_t analyze_packet (struct connection_info *info, bool fromClient, char *buffer, const ssize_t len) {
+    struct analyzer_session_t *session = info->packet_analyzer_data;
     uint64_t return_value = 0L;
 
-    if (plugin_enable && info->packet_analyzer_data != NULL && pluggableAnalyzer != NULL) {
-        if (safe_mode) {
+    if (plugin_enable && session != NULL) {
+        const uint64_t wanted = bytes_wanted (session, fromClient);
+        const ssize_t n = wanted < len ? (ssize_t) wanted : len;
+
+        if (n <= 0) {
+            return return_value;
+        }
+        session->seen[fromClient] += n;
+
+        if (session->async) {
+            enqueue_packet (session, info, fromClient, buffer, n);
+        } else {
             struct analyze_param_t param = {
+                .module = session->module,
+                .plugin = session->module->plugin,
                 .info = info,
                 .fromClient = fromClient,
                 .buffer = buffer,
-                .len = len,
-                .return_value = &return_value,
+                .len = n,
             };
 
-            if (try_catch (safe_analyze_packet, &param)) {
-                plugin_enable = false;
-                auto_unload = true;
-                logger->warning (__FILE__, __LINE__, "exception caught, disable plugin");
-            } else {
-                return return_value;
-            }
-        } else {
-            return_value = pluggableAnalyzer->analyze (
-                               info,
-                               fromClient,
-                               buffer,
-                               len);
+            // the plugin finds its own data in packet_analyzer_data
+            info->packet_analyzer_data = session->plugin_data;
+            return_value = analyze_in_place (&param);
+            info->packet_analyzer_data = session;
         }
     }
     return return_value;
@@ -213,19 +935,36 @@ static struct packet_analyzer_t instance = {
     .load_packet_analyzer = load_packet_analyzer,
     .load = module_loader,
     .unload = module_unload,
+    .swap = module_swap,
     .allocate = analyzer_allocate,
     .release = analyzer_release,
+    .wants = wants,
     .analyze_packet = analyze_packet,
     .set_enable = set_enable,
     .set_safe_mode = set_safe_mode,
     .get_safe_mode = get_safe_mode,
+    .set_async_mode = set_async_mode,
+    .get_async_mode = get_async_mode,
+    .get_stats = get_stats,
 };
 
 struct packet_analyzer_t *init_packet_analyzer (void) {
     logger = get_application_context()->get_logger ();
     sysconf = (struct system_config_t *) get_application_context()->get_bean (SYSTEM_CONFIG_DEFAULT_CONTEXT_NAME);
 
+    int size = sysconf->int_or_default ("analyzer-ring-size", 1024);
+
+    for (ring_size = 2; ring_size < size && ring_size < (1u << 20); ring_size <<= 1);
+
+    if ((batch_size = sysconf->int_or_default ("analyzer-batch-size", 64)) < 1) {
+        batch_size = 1;
+    }
+
     load_packet_analyzer (true, NULL);
 
+    if (sysconf->int_or_default ("packet-analyzer-async", 0) != 0) {
+        set_async_mode (true);
+    }
+
     return &instance;
 }
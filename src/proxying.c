@@ -2,19 +2,30 @@
 // Created by Mac Liu on 11/30/21.
 //
 
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <ctype.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <strings.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
+#include <stddef.h>
 #include <pthread.h>
 #include "global_vars.h"
 #include "proxying.h"
@@ -25,22 +36,121 @@
 #include "utils.h"
 #include "auto_blacklist.h"
 #include "packet_analyzer.h"
+#include "admission_cache.h"
+#include "ip_prefix_trie.h"
+#include "drop_set_exporter.h"
 
 #define PCRE2_CODE_UNIT_WIDTH 8
+#define RELAY_CHUNK_SIZE 32768
+#define PROC_NET_NETSTAT "/proc/net/netstat"
+// milliseconds the listener rests when out of descriptors and none can be freed to shed a connection
+#define ACCEPT_PAUSE 100
 
 #include <pcre2.h>
 
+struct pooled_connection_t {
+    int fd;
+    time_t since;
+};
+
 struct remote_server_t {
     char *host;
     int port;
+    pthread_rwlock_t lock;
+    bool resolved;
+    socklen_t address_len;
+    struct sockaddr_storage address;
+    pthread_mutex_t pool_mutex;
+    struct pooled_connection_t *pool;
+    int pool_size;
+    int pool_target;
+    uint64_t pool_hits;
+    uint64_t pool_misses;
+};
+
+struct relay_pipe_t {
+    int fds[2];
+};
+
+enum admission_state_enum {
+    ADMISSION_PENDING,
+    ADMISSION_DECIDED,
+    ADMISSION_TIMED_OUT,
+};
+
+struct admission_t {
+    struct proxy_worker_t *worker;
+    int fd;
+    int64_t connection_id;
+    struct sockaddr_in6 rmaddr;
+    char remote_ip[INET6_ADDRSTRLEN];
+    int channel;
+    struct db_proxy_request_t *request_in_db;
+    int access_counter;
+    // connection row opened by the admission thread, 0: none
+    uint32_t insert_id;
+    int state;
+    int references;
+    struct timeval deadline;
+    struct admission_t *next;
+    bool waiting;
+    struct admission_t *admitting_prev;
+    struct admission_t *admitting_next;
+};
+
+struct proxy_worker_t {
+    int id;
+    pthread_t thread;
+    struct event_loop_t *ev;
+    int listen_fd;
+    int listen_index;
+    pthread_mutex_t worker_mutex;
+    pthread_mutex_t info_mux;
+    pthread_mutex_t pool_mux;
+    struct connection_info *infos;
+    struct connection_info *pool;
+    int number_of_entries;
+    int number_of_allocation;
+    struct connection_info **expiring_holder;
+    int size_of_expiring_holder;
+    struct relay_pipe_t *pipes;
+    int number_of_pipes;
+    int timer_fd;
+    int timer_index;
+    struct connection_info *connecting_head;
+    struct connection_info *connecting_tail;
+    int admission_event_fd;
+    int admission_event_index;
+    int idle_event_fd;
+    int idle_event_index;
+    double idle_timeout;
+    pthread_mutex_t completion_mux;
+    struct admission_t *completed;
+    struct admission_t *admitting_head;
+    struct admission_t *admitting_tail;
+    uint64_t accepted;
+    uint64_t accept_wakeups;
+    uint64_t accept_budget_exhausted;
+    uint64_t accept_errors;
+    uint64_t accept_shed;
+    uint64_t accept_pauses;
+    uint64_t accept_errors_reported;
+    time_t accept_error_reported;
+    int max_accepted_per_wakeup;
+    int reserve_fd;
+    bool listen_paused;
+    struct timeval listen_resume;
 };
 
 static struct system_config_t *system_conf;
 static struct logger_t *logger = &excalibur_common_logger;
 static struct packet_analyzer_t *packetAnalyzer = NULL;
 static struct auto_blacklist_service_t *blacklistService = NULL;
-static struct event_loop_t *ev;
 static struct database_service_t *db_svc;
+static struct admission_cache_t *admissionCache = NULL;
+static struct ip_prefix_trie_t *white_list = NULL;
+static struct drop_set_exporter_t *dropSet = NULL;
+static bool drop_set_prefixes = false;
 static int64_t connection_counter = 0L;
 static struct remote_server_t *remote_servers;
 static int number_of_remote_servers = 0;
@@ -50,17 +160,35 @@ static int persist_threshold = 100;
 static int max_allowed_requests = 6;
 static uint32_t user_counter = 0;
 
-static pthread_mutex_t worker_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t info_mux = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t pool_mux = PTHREAD_MUTEX_INITIALIZER;
-static struct connection_info *infos = NULL;
-static struct connection_info *pool = NULL;
-static int number_of_entries = 0;
-static int number_of_allocation = 0;
-static struct connection_info **expiring_holder = NULL;
-static int size_of_expiring_holder = 0;
+static struct proxy_worker_t *workers = NULL;
+static int number_of_workers = 0;
 static long max_persistent_time = 86400L;
 static int on_failed_channel = 0;
+static bool splice_relay = false;
+static int max_idle_pipes = 16;
+static long connect_timeout = 3000L;
+static int resolve_interval = 300;
+static const char *hosts_file = NULL;
+static int upstream_pool_min = 0;
+static int upstream_pool_max = 0;
+static int upstream_pool_max_idle = 30;
+static int listen_backlog = 4096;
+static int defer_accept = 0;
+static int fastopen_queue = 0;
+static int accept_batch = 64;
+static pthread_mutex_t refill_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t refill_cond = PTHREAD_COND_INITIALIZER;
+static long admission_timeout = 2000L;
+static bool admission_timeout_allow = true;
+static bool db_unavailable_allow = true;
+static pthread_mutex_t admission_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t admission_cond = PTHREAD_COND_INITIALIZER;
+static struct admission_t *admission_queue_head = NULL;
+static struct admission_t *admission_queue_tail = NULL;
+static int admission_queue_length = 0;
+static int admission_queue_size = 4096;
+static uint64_t admission_queue_overflows = 0;
+static time_t admission_overflow_reported = 0;
 
 
 static void free_proxy_request_data (struct db_proxy_request_t *request) {
@@ -73,54 +201,109 @@ static void free_proxy_request_data (struct db_proxy_request_t *request) {
     }
 }
 
-static struct connection_info *allocate_connection_info() {
-    pthread_mutex_lock (&pool_mux);
+static int acquire_relay_pipe (struct proxy_worker_t *worker, int fds[2]) {
+    if (worker->number_of_pipes > 0) {
+        struct relay_pipe_t *relay_pipe = &worker->pipes[--worker->number_of_pipes];
+
+        fds[0] = relay_pipe->fds[0];
+        fds[1] = relay_pipe->fds[1];
+        return 0;
+    }
+
+    if (pipe2 (fds, O_NONBLOCK | O_CLOEXEC) != 0) {
+        logger->warning (__FILE__, __LINE__, "pipe2 (%s): %s", __FUNCTION__, strerror (errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void release_relay_pipe (struct proxy_worker_t *worker, int fds[2], const bool drained) {
+    if (drained && worker->number_of_pipes < max_idle_pipes) {
+        struct relay_pipe_t *relay_pipe = &worker->pipes[worker->number_of_pipes++];
+
+        relay_pipe->fds[0] = fds[0];
+        relay_pipe->fds[1] = fds[1];
+    } else {
+        close (fds[0]);
+        close (fds[1]);
+    }
+}
+
+static void reset_relay_buffer (struct relay_buffer_t *buffer) {
+    buffer->data = NULL;
+    buffer->offset = 0;
+    buffer->length = 0;
+    buffer->pipe_fds[0] = -1;
+    buffer->pipe_fds[1] = -1;
+    buffer->in_pipe = false;
+}
+
+static void release_relay_buffer (struct proxy_worker_t *worker, struct relay_buffer_t *buffer) {
+    if (buffer->data != NULL) {
+        free (buffer->data);
+    }
+    if (buffer->in_pipe) {
+        release_relay_pipe (worker, buffer->pipe_fds, buffer->length == 0);
+    }
+    reset_relay_buffer (buffer);
+}
+
+static struct connection_info *allocate_connection_info (struct proxy_worker_t *worker) {
+    pthread_mutex_lock (&worker->pool_mux);
     struct connection_info *entry;
 
-    if (pool != NULL) {
+    if (worker->pool != NULL) {
         logger->trace (__FILE__, __LINE__, "reuse free entry");
-        entry = pool;
-        pool = pool->next;
+        entry = worker->pool;
+        worker->pool = worker->pool->next;
     } else {
         entry = malloc (sizeof (struct connection_info));
-        number_of_allocation++;
-        logger->debug (__FILE__, __LINE__, "allocate new entry (%d allocation entries)", number_of_allocation);
+        worker->number_of_allocation++;
+        logger->debug (__FILE__, __LINE__, "allocate new entry (worker %d: %d allocation entries)",
+                       worker->id, worker->number_of_allocation);
     }
+    entry->worker = worker;
 
-    pthread_mutex_unlock (&pool_mux);
+    pthread_mutex_unlock (&worker->pool_mux);
     return entry;
 }
 
 static void free_connection_info (struct connection_info *entry) {
-    pthread_mutex_lock (&pool_mux);
-    entry->next = pool;
-    pool = entry;
+    struct proxy_worker_t *worker = entry->worker;
+
+    pthread_mutex_lock (&worker->pool_mux);
+    entry->next = worker->pool;
+    worker->pool = entry;
     logger->trace (__FILE__, __LINE__, "free entry");
-    pthread_mutex_unlock (&pool_mux);
+    pthread_mutex_unlock (&worker->pool_mux);
 }
 
 static void attach_connection_info_entry (struct connection_info *entry) {
-    pthread_mutex_lock (&info_mux);
-    number_of_entries++;
-    entry->next = infos;
+    struct proxy_worker_t *worker = entry->worker;
+
+    pthread_mutex_lock (&worker->info_mux);
+    worker->number_of_entries++;
+    entry->next = worker->infos;
     entry->prev = NULL;
     entry->in_chain = true;
-    if (infos != NULL) {
-        infos->prev = entry;
+    if (worker->infos != NULL) {
+        worker->infos->prev = entry;
     }
-    infos = entry;
-    logger->trace (__FILE__, __LINE__, "attach entry (%d)", number_of_entries);
-    pthread_mutex_unlock (&info_mux);
+    worker->infos = entry;
+    logger->trace (__FILE__, __LINE__, "attach entry (worker %d: %d)", worker->id, worker->number_of_entries);
+    pthread_mutex_unlock (&worker->info_mux);
 }
 
 static void detach_connection_info_entry (struct connection_info *entry) {
     if (entry->in_chain) {
-        pthread_mutex_lock (&info_mux);
-        number_of_entries--;
-        if (entry == infos) {
-            infos = infos->next;
-            if (infos != NULL) {
-                infos->prev = NULL;
+        struct proxy_worker_t *worker = entry->worker;
+
+        pthread_mutex_lock (&worker->info_mux);
+        worker->number_of_entries--;
+        if (entry == worker->infos) {
+            worker->infos = worker->infos->next;
+            if (worker->infos != NULL) {
+                worker->infos->prev = NULL;
             }
         } else {
             entry->prev->next = entry->next;
@@ -128,29 +311,33 @@ static void detach_connection_info_entry (struct connection_info *entry) {
                 entry->next->prev = entry->prev;
             }
         }
-        pthread_mutex_unlock (&info_mux);
+        pthread_mutex_unlock (&worker->info_mux);
 
         entry->in_chain = false;
-        logger->trace (__FILE__, __LINE__, "detach entry (%d)", number_of_entries);
+        logger->trace (__FILE__, __LINE__, "detach entry (worker %d: %d)", worker->id, worker->number_of_entries);
     }
 }
 
 static void close_event (struct connection_info *info, bool idle) {
     if (!info->in_chain) {
-        ev->remove_event (info->server_handle);
-        ev->remove_event (info->client_handle);
+        struct event_loop_t *ev = info->worker->ev;
+
+        ev->remove_event (ev, info->server_handle);
+        ev->remove_event (ev, info->client_handle);
         shutdown (info->client_fd, SHUT_RDWR);
         shutdown (info->server_fd, SHUT_RDWR);
         close (info->client_fd);
         close (info->server_fd);
 
-        packetAnalyzer->release (info->packet_analyzer_data);
+        packetAnalyzer->release (info);
+        release_relay_buffer (info->worker, &info->upstream);
+        release_relay_buffer (info->worker, &info->downstream);
 
         struct timeval tv;
         gettimeofday (&tv, NULL);
         double elapsed = elapsed_time (&tv, &info->started);
 
-        int count = ev->count();
+        int count = ev->count (ev);
 
         if (info->request_in_db != NULL) {
             logger->notice (__FILE__, __LINE__,
@@ -191,8 +378,6 @@ static void close_event (struct connection_info *info, bool idle) {
         }
 
         free (info->remote_ip);
-
-        db_svc->done();
     }
 }
 
@@ -217,20 +402,51 @@ static void tell_time (time_t start_time) {
     double rps_recent = (double) (connection_counter - last_connection_counter) / duration2;
     double rps_total = (double) connection_counter / duration;
 
+    int i, events = 0, number_of_entries = 0, number_of_allocation = 0, max_events_per_wakeup = 0;
+    uint64_t wakeups = 0L, dispatched = 0L;
+
+    for (i = 0; i < number_of_workers; i++) {
+        struct event_loop_stats_t stats;
+
+        workers[i].ev->get_stats (workers[i].ev, &stats);
+        events += workers[i].ev->count (workers[i].ev);
+        number_of_entries += workers[i].number_of_entries;
+        number_of_allocation += workers[i].number_of_allocation;
+        wakeups += stats.wakeups;
+        dispatched += stats.events;
+        max_events_per_wakeup = stats.max_events_per_wakeup > max_events_per_wakeup ? stats.max_events_per_wakeup : max_events_per_wakeup;
+    }
+
+    const double events_per_wakeup = wakeups > 0 ? (double) dispatched / wakeups : 0.;
+
     if (day > 0) {
         logger->notice (__FILE__, __LINE__,
-                        "Uptime: %d day(s), %02d:%02d:%02d, events: %d, # of users: %u / %u (total), entries: %d / %d, RPS: %.2f / %.2f (total)",
+                        "Uptime: %d day(s), %02d:%02d:%02d, events: %d, # of users: %u / %u (total), entries: %d / %d, RPS: %.2f / %.2f (total), workers: %d, events/wakeup: %.2f (max: %d)",
                         day, hour, min, sec,
-                        ev->count(), (user_counter - last_user_counter), user_counter,
+                        events, (user_counter - last_user_counter), user_counter,
                         number_of_entries, number_of_allocation,
-                        rps_recent, rps_total);
+                        rps_recent, rps_total, number_of_workers, events_per_wakeup, max_events_per_wakeup);
     } else {
         logger->notice (__FILE__, __LINE__,
-                        "Uptime: %02d:%02d:%02d, events: %d, # of users: %u / %u (total), entries: %d / %d, RPS: %.2f / %.2f (total)",
+                        "Uptime: %02d:%02d:%02d, events: %d, # of users: %u / %u (total), entries: %d / %d, RPS: %.2f / %.2f (total), workers: %d, events/wakeup: %.2f (max: %d)",
                         hour, min, sec,
-                        ev->count(), (user_counter - last_user_counter), user_counter,
+                        events, (user_counter - last_user_counter), user_counter,
                         number_of_entries, number_of_allocation,
-                        rps_recent, rps_total);
+                        rps_recent, rps_total, number_of_workers, events_per_wakeup, max_events_per_wakeup);
+    }
+
+    if (upstream_pool_max > 0) {
+        uint64_t hits = 0L, misses = 0L;
+        int idle = 0;
+
+        for (i = 0; i < number_of_remote_servers; i++) {
+            hits += remote_servers[i].pool_hits;
+            misses += remote_servers[i].pool_misses;
+            idle += remote_servers[i].pool_size;
+        }
+
+        logger->notice (__FILE__, __LINE__, "Upstream pool: hit rate: %.2f%% (%lu / %lu), idle connections: %d",
+                        hits + misses > 0 ? 100. * hits / (hits + misses) : 0., hits, hits + misses, idle);
     }
 
     last_user_counter = user_counter;
@@ -238,30 +454,32 @@ static void tell_time (time_t start_time) {
     last_time = now;
 }
 
-void clean_idle_connections (const struct timeval *tv, double timeout) {
+static int clean_worker_connections (struct proxy_worker_t *worker, const struct timeval *tv, double timeout) {
+    struct connection_info **expiring_holder;
     int n = 0;
 
-    pthread_mutex_lock (&info_mux);
+    pthread_mutex_lock (&worker->info_mux);
 
-    if (number_of_entries > 0) {
-        if (expiring_holder != NULL && size_of_expiring_holder < number_of_entries) {
-            free (expiring_holder);
-            expiring_holder = NULL;
+    if (worker->number_of_entries > 0) {
+        if (worker->expiring_holder != NULL && worker->size_of_expiring_holder < worker->number_of_entries) {
+            free (worker->expiring_holder);
+            worker->expiring_holder = NULL;
         }
-        if (expiring_holder == NULL) {
-            expiring_holder = malloc (number_of_entries * sizeof (struct connection_info *));
-            logger->debug (__FILE__, __LINE__, "Enlarge expiring holder from %d to %d", size_of_expiring_holder,
-                           number_of_entries);
-            size_of_expiring_holder = number_of_entries;
+        if (worker->expiring_holder == NULL) {
+            worker->expiring_holder = malloc (worker->number_of_entries * sizeof (struct connection_info *));
+            logger->debug (__FILE__, __LINE__, "Enlarge expiring holder from %d to %d (worker %d)",
+                           worker->size_of_expiring_holder, worker->number_of_entries, worker->id);
+            worker->size_of_expiring_holder = worker->number_of_entries;
         }
 
         struct connection_info *ptr;
 
-        for (ptr = infos, n = 0; ptr != NULL && n < number_of_entries; ptr = ptr->next, n++) {
-            expiring_holder[n] = ptr;
+        for (ptr = worker->infos, n = 0; ptr != NULL && n < worker->number_of_entries; ptr = ptr->next, n++) {
+            worker->expiring_holder[n] = ptr;
         }
     }
-    pthread_mutex_unlock (&info_mux);
+    expiring_holder = worker->expiring_holder;
+    pthread_mutex_unlock (&worker->info_mux);
 
     int i, counter = 0;
 
@@ -269,10 +487,12 @@ void clean_idle_connections (const struct timeval *tv, double timeout) {
         struct connection_info *ptr = expiring_holder[i];
         double duration = elapsed_time (tv, &ptr->recent);
 
-        if (duration > timeout) {
-            if (pthread_mutex_trylock (&worker_mutex) != 0) {
-                logger->info (__FILE__, __LINE__, "Expiring thread: wait a moment");
-                pthread_mutex_lock (&worker_mutex);
+        if (ptr->connecting) {
+            // owned by the connect timer
+        } else if (duration > timeout) {
+            if (pthread_mutex_trylock (&worker->worker_mutex) != 0) {
+                logger->info (__FILE__, __LINE__, "Expiring (worker %d): wait a moment", worker->id);
+                pthread_mutex_lock (&worker->worker_mutex);
             }
 
             pthread_mutex_lock (&expiring_holder[i]->mutex);
@@ -285,7 +505,7 @@ void clean_idle_connections (const struct timeval *tv, double timeout) {
             free_connection_info (expiring_holder[i]);
             counter++;
 
-            pthread_mutex_unlock (&worker_mutex);
+            pthread_mutex_unlock (&worker->worker_mutex);
         } else {
             logger->debug (__FILE__, __LINE__, "NO Expiring %s, duration: %.2f, timeout: %.2f",
                            expiring_holder[i]->remote_ip, duration, timeout);
@@ -293,9 +513,46 @@ void clean_idle_connections (const struct timeval *tv, double timeout) {
     }
 
     if (counter > 0) {
-        logger->notice (__FILE__, __LINE__, "Expire %d entries (entries = %d)", counter, number_of_entries);
+        logger->notice (__FILE__, __LINE__, "Expire %d entries (worker %d: entries = %d)", counter, worker->id, worker->number_of_entries);
     } else {
-        logger->trace (__FILE__, __LINE__, "NO entry to be expired (entries = %d)", number_of_entries);
+        logger->trace (__FILE__, __LINE__, "NO entry to be expired (worker %d: entries = %d)", worker->id, worker->number_of_entries);
+    }
+    return counter;
+}
+
+/**
+ * Runs on the worker: its event registry is only ever changed by the thread looping on it.
+ */
+static void idle_sweep_requested (const int fd, const uint32_t events, void *args) {
+    struct proxy_worker_t *worker = args;
+    uint64_t counter;
+    struct timeval now;
+    double timeout;
+
+    if (read (fd, &counter, sizeof counter) < 0 && errno != EAGAIN) {
+        logger->warning (__FILE__, __LINE__, "read (%s): %s", __FUNCTION__, strerror (errno));
+    }
+
+    pthread_mutex_lock (&worker->worker_mutex);
+    timeout = worker->idle_timeout;
+    pthread_mutex_unlock (&worker->worker_mutex);
+
+    gettimeofday (&now, NULL);
+    clean_worker_connections (worker, &now, timeout);
+}
+
+void clean_idle_connections (const struct timeval *tv, double timeout) {
+    const uint64_t one = 1;
+    int i;
+
+    for (i = 0; i < number_of_workers; i++) {
+        pthread_mutex_lock (&workers[i].worker_mutex);
+        workers[i].idle_timeout = timeout;
+        pthread_mutex_unlock (&workers[i].worker_mutex);
+
+        if (write (workers[i].idle_event_fd, &one, sizeof one) < 0) {
+            logger->warning (__FILE__, __LINE__, "write (%s): %s", __FUNCTION__, strerror (errno));
+        }
     }
 
     if (tv->tv_sec / 60 % 15 == 0) {
@@ -303,20 +560,38 @@ void clean_idle_connections (const struct timeval *tv, double timeout) {
     }
 }
 
-static int init_socket (int port) {
+static int init_socket (int port, bool reuse_port) {
     int fd;
     struct sockaddr_in6 myaddr;
     socklen_t myaddrLen = sizeof myaddr;
-    char on = 1;
+    int on = 1;
     struct in6_addr in6addr_any = IN6ADDR_ANY_INIT;
 
-    if ((fd = socket (PF_INET6, SOCK_STREAM, 0)) < 0) {
+    if ((fd = socket (PF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
         perror ("socket");
         return -1;
     }
 
-    setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, (char *) &on, sizeof on);
-    setsockopt (fd, SOL_SOCKET, SO_KEEPALIVE, (char *) &on, sizeof on);
+    setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+    setsockopt (fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof on);
+
+    // no accept() until the client has sent something, or the timeout (seconds) is over
+    if (defer_accept > 0 && setsockopt (fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_accept, sizeof defer_accept) < 0) {
+        perror ("setsockopt (TCP_DEFER_ACCEPT)");
+    }
+    if (fastopen_queue > 0 && setsockopt (fd, IPPROTO_TCP, TCP_FASTOPEN, &fastopen_queue, sizeof fastopen_queue) < 0) {
+        perror ("setsockopt (TCP_FASTOPEN)");
+    }
+
+    if (reuse_port) {
+        int enable = 1;
+
+        if (setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof enable) < 0) {
+            perror ("setsockopt (SO_REUSEPORT)");
+            close (fd);
+            return -1;
+        }
+    }
 
     bzero (&myaddr, sizeof myaddr);
     myaddr.sin6_family = AF_INET6;
@@ -338,418 +613,1639 @@ static int init_socket (int port) {
     return fd;
 }
 
-static int init_socket_v4 (int port) {
-    int fd;
-    struct sockaddr_in myAddress;
-    socklen_t myAddressLen = sizeof myAddress;
-    char on = 1;
-
-    if ((fd = socket (PF_INET, SOCK_STREAM, 0)) < 0) {
-        perror ("socket");
-        return -1;
+/**
+ * Look the host up in the configured hosts-file (same layout as /etc/hosts), if any.
+ *
+ * @return true if the host is listed there
+ */
+static bool lookup_hosts_file (const char *host, const int port, struct sockaddr_storage *address, socklen_t *address_len) {
+    FILE *fp;
+    char line[512];
+    bool found = false;
+
+    if (hosts_file == NULL || (fp = fopen (hosts_file, "r")) == NULL) {
+        return false;
     }
 
-    setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, (char *) &on, sizeof on);
-    setsockopt (fd, SOL_SOCKET, SO_KEEPALIVE, (char *) &on, sizeof on);
+    while (!found && fgets (line, sizeof line, fp) != NULL) {
+        char *saveptr = NULL;
+        char *comment = strchr (line, '#');
 
-    bzero (&myAddress, sizeof myAddress);
-    myAddress.sin_family = AF_INET;
-    myAddress.sin_addr.s_addr = INADDR_ANY;
-    myAddress.sin_port = htons (port);
+        if (comment != NULL) {
+            *comment = '\0';
+        }
 
-    if (bind (fd, (struct sockaddr *) &myAddress, myAddressLen) < 0) {
-        logger->error (__FILE__, __LINE__, "bind (%s): %s", __FUNCTION__, strerror (errno));
-        close (fd);
-        fd = -1;
-    } else {
-        if (getsockname (fd, (struct sockaddr *) &myAddress, &myAddressLen) < 0) {
-            logger->error (__FILE__, __LINE__, "getsockname (%s): %s", __FUNCTION__, strerror (errno));
-            close (fd);
-            fd = -1;
+        const char *ip = strtok_r (line, " \t\r\n", &saveptr);
+        const char *name;
+
+        while (ip != NULL && !found && (name = strtok_r (NULL, " \t\r\n", &saveptr)) != NULL) {
+            if (strcasecmp (name, host) != 0) {
+                continue;
+            }
+
+            struct sockaddr_in *v4 = (struct sockaddr_in *) address;
+            struct sockaddr_in6 *v6 = (struct sockaddr_in6 *) address;
+
+            memset (address, 0, sizeof (struct sockaddr_storage));
+
+            if (inet_pton (AF_INET, ip, &v4->sin_addr) == 1) {
+                v4->sin_family = AF_INET;
+                v4->sin_port = htons (port);
+                *address_len = sizeof (struct sockaddr_in);
+                found = true;
+            } else if (inet_pton (AF_INET6, ip, &v6->sin6_addr) == 1) {
+                v6->sin6_family = AF_INET6;
+                v6->sin6_port = htons (port);
+                *address_len = sizeof (struct sockaddr_in6);
+                found = true;
+            } else {
+                logger->warning (__FILE__, __LINE__, "%s: invalid address \"%s\" for %s", hosts_file, ip, name);
+                break;
+            }
         }
     }
 
-    return fd;
+    fclose (fp);
+    return found;
 }
 
-static int connect_host (const char *ip, const int port) {
-    int fd;
-    struct sockaddr_in remoteAddress;
-    struct hostent *hp;
-    int len;
+static bool resolve_remote_server (struct remote_server_t *server) {
+    struct sockaddr_storage address;
+    socklen_t address_len = 0;
+    char host[256];
+    size_t len = strlen (server->host);
 
-    if ((fd = init_socket_v4 (0)) < 0) return -1;
+    // "[::1]:80" style literals
+    if (len >= 2 && server->host[0] == '[' && server->host[len - 1] == ']') {
+        snprintf (host, sizeof host, "%.*s", (int) len - 2, server->host + 1);
+    } else {
+        snprintf (host, sizeof host, "%s", server->host);
+    }
 
-    memset (&remoteAddress, 0, sizeof (remoteAddress));
+    if (!lookup_hosts_file (host, server->port, &address, &address_len)) {
+        struct addrinfo hints, *result;
+        char service[16];
+        int rc;
 
-    if (inet_pton (AF_INET, ip, &remoteAddress.sin_addr) != 0) {
-        remoteAddress.sin_family = AF_INET;
-    } else if ((hp = gethostbyname (ip)) != NULL) {
-        remoteAddress.sin_family = hp->h_addrtype;
-        len = hp->h_length;
+        memset (&hints, 0, sizeof hints);
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_NUMERICSERV;
+        snprintf (service, sizeof service, "%d", server->port);
 
-        if (len > sizeof remoteAddress.sin_addr) {
-            len = sizeof remoteAddress.sin_addr;
+        if ((rc = getaddrinfo (host, service, &hints, &result)) != 0) {
+            logger->warning (__FILE__, __LINE__, "resolve %s:%d: %s", server->host, server->port, gai_strerror (rc));
+            return false;
         }
 
-        memcpy (&remoteAddress.sin_addr, hp->h_addr_list[0], len);
-    } else {
-        perror (ip);
-        return -1;
+        address_len = result->ai_addrlen;
+        memcpy (&address, result->ai_addr, result->ai_addrlen);
+        freeaddrinfo (result);
     }
 
-    remoteAddress.sin_port = htons (port);
+    pthread_rwlock_wrlock (&server->lock);
+    const bool changed = !server->resolved || server->address_len != address_len ||
+                         memcmp (&server->address, &address, address_len) != 0;
 
-    if (connect (fd, (struct sockaddr *) &remoteAddress, sizeof remoteAddress) < 0) {
-        logger->error (__FILE__, __LINE__, "connect to [%s:%d]: %s", ip, port, strerror (errno));
-        close (fd);
-        return -1;
-    }
+    server->address = address;
+    server->address_len = address_len;
+    server->resolved = true;
+    pthread_rwlock_unlock (&server->lock);
 
-    return fd;
+    if (changed) {
+        char str[INET6_ADDRSTRLEN];
+        const void *addr = address.ss_family == AF_INET6
+                           ? (const void *) & ((struct sockaddr_in6 *) &address)->sin6_addr
+                           : (const void *) & ((struct sockaddr_in *) &address)->sin_addr;
+
+        logger->notice (__FILE__, __LINE__, "resolve %s:%d -> %s", server->host, server->port,
+                        inet_ntop (address.ss_family, addr, str, sizeof str));
+    }
+    return true;
 }
 
-static bool check_remote_ip_in_whitelist (const char *remote_ip) {
-    static int list_size = -1;
-    static char **white_list = NULL;
-    int i;
+static void *resolver_main (void *args) {
+    int elapsed = 0;
 
-    if (list_size == -1) {
-        list_size = 0;
-        white_list = system_conf->string_list ("white-list-ip-prefix", &list_size);
-    }
+    while (!system_conf->terminated()) {
+        sleep (1);
 
-    for (i = 0; i < list_size; i++) {
-        if (strncasecmp (remote_ip, white_list[i], strlen (white_list[i])) == 0) {
-            return true;
+        if (++elapsed >= resolve_interval) {
+            int i;
+
+            for (i = 0; i < number_of_remote_servers && !system_conf->terminated(); i++) {
+                resolve_remote_server (&remote_servers[i]);
+            }
+            elapsed = 0;
         }
     }
-    return false;
+    return NULL;
 }
 
+static int connect_host (struct remote_server_t *server) {
+    int fd;
+    int on = 1;
+    struct sockaddr_storage remoteAddress;
+    socklen_t remoteAddressLen;
 
-static void do_proxying (const int source, const int destination, struct connection_info *info) {
-    char buffer[32768];
-//    static pthread_mutex_t proxying_mutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_rwlock_rdlock (&server->lock);
+    const bool resolved = server->resolved;
 
-    pthread_mutex_lock (&info->mutex);
-    if (info->in_chain) {
-        gettimeofday (&info->recent, NULL);
-        const ssize_t len = read (source, buffer, sizeof buffer);
-        const bool fromClient = info->client_fd == source;
-        bool close_connection = false;
+    remoteAddress = server->address;
+    remoteAddressLen = server->address_len;
+    pthread_rwlock_unlock (&server->lock);
 
-        if (len > 0) {
-            ssize_t writeTotal = 0;
-            size_t leftLen = len;
+    if (!resolved) {
+        logger->error (__FILE__, __LINE__, "connect to [%s:%d]: address not resolved", server->host, server->port);
+        return -1;
+    }
 
-            if (logger->getPriority() >= log_trace) {
-                if (fromClient) {
-                    logger->trace (__FILE__, __LINE__, "proxying %d -> %d, size: %ld, [ from: %s ]",
-                                   source, destination, len, info->remote_ip);
-                } else {
-                    logger->trace (__FILE__, __LINE__, "proxying %d -> %d, size: %ld, [ to: %s ]",
-                                   source, destination, len, info->remote_ip);
-                }
-            }
+    if ((fd = socket (remoteAddress.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        logger->error (__FILE__, __LINE__, "socket (%s): %s", __FUNCTION__, strerror (errno));
+        return -1;
+    }
 
-            packetAnalyzer->analyze_packet (info, fromClient, buffer, len);
+    setsockopt (fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof on);
 
-            if (fromClient && info->requestCount > max_allowed_requests) {
-                close_connection = true;
-                logger->warning (__FILE__, __LINE__, "close connection for [ %s ]: sending too many requests (%d times)",
-                                 info->remote_ip, info->requestCount + 1);
-            } else {
-                while (leftLen > 0) {
-                    ssize_t writeLen = write (destination, &buffer[writeTotal], leftLen);
-
-                    if (writeLen > 0) {
-                        leftLen -= writeLen;
-                        writeTotal += writeLen;
-                    } else {
-                        close_connection = true;
-                        logger->warning (__FILE__, __LINE__, "Failed to write to destination: %s, len = %d [ %s %s ]",
-                                         strerror (errno),
-                                         writeLen,
-                                         info->client_fd == source ? "from" : "to",
-                                         info->remote_ip);
-                        break;
-                    }
-                }
+    if (connect (fd, (struct sockaddr *) &remoteAddress, remoteAddressLen) < 0 && errno != EINPROGRESS) {
+        logger->error (__FILE__, __LINE__, "connect to [%s:%d]: %s", server->host, server->port, strerror (errno));
+        close (fd);
+        return -1;
+    }
 
-                if (fromClient) {
-                    info->bytesSent += writeTotal;
-                    info->requestCount++;
-                } else {
-                    info->bytesReceived += writeTotal;
-                    info->responseCount++;
-                }
-            }
-        } else {
-            close_connection = true;
-        }
+    return fd;
+}
 
-        if (close_connection) {
-            detach_connection_info_entry (info);
-            close_event (info, false);
-            if (!info->in_chain) {
-                free_connection_info (info);
-            }
-        }
+/**
+ * An idle upstream connection is still usable if it has no pending error and the server
+ * has not closed it (a peek that would block, or early data from the server, both qualify).
+ */
+static bool validate_pooled_connection (const int fd) {
+    int error = 0;
+    socklen_t len = sizeof error;
+    char c;
+
+    if (getsockopt (fd, SOL_SOCKET, SO_ERROR, &error, &len) != 0 || error != 0) {
+        return false;
     }
-    pthread_mutex_unlock (&info->mutex);
-}
 
-static void proxy_from_server_to_client (const int fd, void *args) {
-    struct connection_info *info = args;
+    const ssize_t n = recv (fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
 
-    pthread_mutex_lock (&worker_mutex);
-    do_proxying (info->server_fd, info->client_fd, info);
-    pthread_mutex_unlock (&worker_mutex);
+    return n > 0 || (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
 }
 
-static void proxy_from_client_to_server (const int fd, void *args) {
-    struct connection_info *info = args;
+static int take_pooled_connection (struct remote_server_t *server) {
+    int fd = -1;
 
-    pthread_mutex_lock (&worker_mutex);
-    do_proxying (info->client_fd, info->server_fd, info);
-    pthread_mutex_unlock (&worker_mutex);
-}
+    if (upstream_pool_max <= 0) {
+        return -1;
+    }
 
-static void accepting_request (const int fdc, const int64_t connection_id) { // {{{
-    struct sockaddr_in6 rmaddr;
-    socklen_t rmaddrLen = sizeof rmaddr;
-    char str[INET6_ADDRSTRLEN];
-    struct in_addr remote_ipv4_address;
-    bool is_v4 = false;
+    const time_t now = time (NULL);
 
+    pthread_mutex_lock (&server->pool_mutex);
 
-    if (getpeername (fdc, (struct sockaddr *) &rmaddr, &rmaddrLen) != 0) {
-        logger->debug (__FILE__, __LINE__, "getpeername (%s): %s", __FUNCTION__, strerror (errno));
-        close (fdc);
-        return;
+    while (fd < 0 && server->pool_size > 0) {
+        struct pooled_connection_t *pooled = &server->pool[--server->pool_size];
+
+        if (now - pooled->since <= upstream_pool_max_idle && validate_pooled_connection (pooled->fd)) {
+            fd = pooled->fd;
+        } else {
+            close (pooled->fd);
+        }
+    }
+
+    if (fd >= 0) {
+        server->pool_hits++;
+    } else {
+        server->pool_misses++;
+
+        if (server->pool_target < upstream_pool_max) {
+            server->pool_target++;
+        }
     }
+    pthread_mutex_unlock (&server->pool_mutex);
+
+    pthread_mutex_lock (&refill_mutex);
+    pthread_cond_signal (&refill_cond);
+    pthread_mutex_unlock (&refill_mutex);
+
+    return fd;
+}
 
+static int open_pooled_connection (struct remote_server_t *server) {
+    int fd;
 
-    pthread_mutex_lock (&worker_mutex);
-    uint32_t *ptr = (uint32_t *) &rmaddr.sin6_addr;
+    if ((fd = connect_host (server)) < 0) {
+        return -1;
+    }
 
-    if (rmaddr.sin6_family == PF_INET6 && *ptr == 0 && * (ptr + 1) == 0 && * (ptr + 2) == 0xffff0000) {
-        remote_ipv4_address.s_addr = * (ptr + 3);
-        is_v4 = true;
+    struct pollfd pfd = {
+        .fd = fd,
+        .events = POLLOUT
+    };
+    int error = 0;
+    socklen_t len = sizeof error;
+
+    if (poll (&pfd, 1, (int) connect_timeout) <= 0 ||
+            getsockopt (fd, SOL_SOCKET, SO_ERROR, &error, &len) != 0 || error != 0) {
+        logger->debug (__FILE__, __LINE__, "pre-connect to [%s:%d]: %s", server->host, server->port,
+                       error != 0 ? strerror (error) : "timed out");
+        close (fd);
+        return -1;
     }
 
-    const char *remote_ip = inet_ntop (AF_INET6, & (rmaddr.sin6_addr), str, INET6_ADDRSTRLEN);
+    return fd;
+}
 
-    struct db_proxy_request_t *request_in_db = db_svc->check_available (remote_ip);
-    int channel = -1;
-    bool blacklisted = false;
-    bool auto_blacklisted = false;
-    int access_counter = 0;
-    struct ip_access_entry_t *entry = NULL;
+static void refill_upstream_pool (struct remote_server_t *server) {
+    const time_t now = time (NULL);
+    int i, n;
 
-    if (request_in_db != NULL) {
-        channel = request_in_db->channel;
-    } else if (check_remote_ip_in_whitelist (remote_ip)) {
-        channel = default_server;
+    pthread_mutex_lock (&server->pool_mutex);
 
-        if (db_svc->connection_blacklisted (remote_ip) > 0) {
-            blacklisted = true;
-            channel = -1;
+    for (i = n = 0; i < server->pool_size; i++) {
+        if (now - server->pool[i].since <= upstream_pool_max_idle && validate_pooled_connection (server->pool[i].fd)) {
+            server->pool[n++] = server->pool[i];
+        } else {
+            close (server->pool[i].fd);
         }
+    }
 
-        if (is_v4) {
-            entry = blacklistService->find_and_increase (&remote_ipv4_address);
+    // connections aged out unused: demand dropped, shrink back towards the minimum
+    if (n < server->pool_size && server->pool_target > upstream_pool_min) {
+        server->pool_target--;
+    }
+    server->pool_size = n;
+    pthread_mutex_unlock (&server->pool_mutex);
 
-            if (entry != NULL) {
-                access_counter = entry->counter;
-            }
+    while (!system_conf->terminated()) {
+        pthread_mutex_lock (&server->pool_mutex);
+        const bool full = server->pool_size >= server->pool_target;
+        pthread_mutex_unlock (&server->pool_mutex);
 
-            if (!blacklisted) {
-                if (on_failed_channel != default_server &&
-                        access_counter > connection_threshold - 7 &&
-                        access_counter <= connection_threshold &&
-                        access_counter % 2 == 0 &&
-                        db_svc->fail_guessing (remote_ip)) {
-                    channel = on_failed_channel;
-                    logger->notice (__FILE__, __LINE__,
-                                    "%s: failure detected on %s, try channel: %d", inet_ntoa (remote_ipv4_address), remote_ip, channel);
-                }
+        if (full) {
+            break;
+        }
 
-                if (access_counter > connection_threshold) {
-                    if (db_svc->check_vip (remote_ip) == 0) {
-                        if (access_counter > persist_threshold) {
-                            if (db_svc->add_ip_to_auto_blacklist (remote_ip) > 0) {
-                                logger->notice (__FILE__, __LINE__,
-                                                "%s: threshold reached, add to blacklist database",
-                                                inet_ntoa (remote_ipv4_address));
-                            }
-                        }
-                        auto_blacklisted = true;
-                        channel = -1;
-                    }
-                }
+        const int fd = open_pooled_connection (server);
 
-                if (entry != NULL && !auto_blacklisted && channel >= 0) {
-                    struct timeval now;
-                    gettimeofday (&now, NULL);
-                    long elapsed = (long) elapsed_time (&now, &entry->log_time);
+        if (fd < 0) {
+            break;
+        }
 
-                    if (elapsed > 86400L * 2) {
-                        logger->notice (__FILE__, __LINE__,
-                                        "%s: elapsed time: %.2f day, connection: %d, success: %d",
-                                        inet_ntoa (remote_ipv4_address), elapsed / 86400.,
-                                        entry->counter, entry->success_counter);
-                    }
+        pthread_mutex_lock (&server->pool_mutex);
 
-                    if (elapsed > max_persistent_time) {
-                        if (db_svc->check_vip (remote_ip) == 0) {
-                            if (db_svc->add_ip_to_auto_blacklist (remote_ip) > 0) {
-                                logger->notice (__FILE__, __LINE__,
-                                                "%s: persistent connection threshold reached, add to blacklist database",
-                                                inet_ntoa (remote_ipv4_address));
-                            }
-                        }
-                    }
-                }
-            }
+        if (server->pool_size < upstream_pool_max) {
+            server->pool[server->pool_size].fd = fd;
+            server->pool[server->pool_size].since = time (NULL);
+            server->pool_size++;
+        } else {
+            close (fd);
         }
+        pthread_mutex_unlock (&server->pool_mutex);
     }
+}
 
-    if (channel >= 0) {
-        channel = channel < number_of_remote_servers ? channel : 0;
+static void *upstream_pool_main (void *args) {
+    while (!system_conf->terminated()) {
+        int i;
+        struct timespec deadline;
 
-        if (request_in_db != NULL) {
-            logger->notice (__FILE__, __LINE__,
-                            "Connect from [%ld]: %s (%d) [account: %s, channel: %d]",
-                            connection_id,
-                            remote_ip,
-                            ntohs (rmaddr.sin6_port),
-                            request_in_db->account != NULL ? request_in_db->account : "(null)",
-                            channel);
-        } else {
-            logger->debug (__FILE__, __LINE__,
-                           "Connect from [%ld]: %s (%d) [channel: %d]",
-                           connection_id,
-                           remote_ip,
-                           ntohs (rmaddr.sin6_port),
-                           channel);
-            if (entry != NULL) {
-                entry->success_counter++;
-            }
+        for (i = 0; i < number_of_remote_servers; i++) {
+            refill_upstream_pool (&remote_servers[i]);
         }
-        int proxy_fd = connect_host (remote_servers[channel].host, remote_servers[channel].port);
-
-        if (proxy_fd >= 0) {
-            struct connection_info *info = allocate_connection_info();
-
-            info->client_fd = fdc;
-            info->server_fd = proxy_fd;
-            info->requestCount = 0;
-            info->responseCount = 0;
-            info->bytesSent = 0L;
-            info->bytesReceived = 0L;
-            info->connection_id = connection_id;
-            info->request_in_db = request_in_db;
-            info->in_chain = false;
-            info->insert_id = 0;
-            info->remote_ip = strdup (remote_ip);
-            info->attempts = access_counter;
-            info->packet_analyzer_data = packetAnalyzer->allocate();
-            gettimeofday (&info->started, NULL);
-            gettimeofday (&info->recent, NULL);
-            pthread_mutex_init (&info->mutex, NULL);
-
-            info->client_handle = ev->add_event (info->client_fd, proxy_from_client_to_server, info);
-            info->server_handle = ev->add_event (info->server_fd, proxy_from_server_to_client, info);
-
-            if (request_in_db != NULL) {
-                info->insert_id = db_svc->connection_established (request_in_db->sn, request_in_db->account, remote_ip);
-                info->nth_user = ++user_counter;
-            }
 
-            attach_connection_info_entry (info);
-        } else {
-            shutdown (fdc, SHUT_RDWR);
-            close (fdc);
-            logger->info (__FILE__, __LINE__,
-                          "Connect from [%ld]: %s (%d) [ %s:%d - remote server not responding ]",
-                          connection_id,
-                          remote_ip,
-                          ntohs (rmaddr.sin6_port),
-                          remote_servers[channel].host, remote_servers[channel].port);
+        clock_gettime (CLOCK_REALTIME, &deadline);
+        deadline.tv_sec++;
 
-            free_proxy_request_data (request_in_db);
-        }
-    } else {
+        pthread_mutex_lock (&refill_mutex);
+        pthread_cond_timedwait (&refill_cond, &refill_mutex, &deadline);
+        pthread_mutex_unlock (&refill_mutex);
+    }
+    return NULL;
+}
 
-        if (auto_blacklisted) {
-            shutdown (fdc, SHUT_RDWR);
-            close (fdc);
+/**
+ * white-list-ip-prefix-file: one prefix per line, blank lines and "#" comments skipped
+ */
+static void load_whitelist_file (const char *filename) {
+    FILE *fp;
+    char *line = NULL;
+    size_t line_size = 0;
+    int lineno = 0;
+    char cidr[INET6_ADDRSTRLEN + 8];
+
+    if ((fp = fopen (filename, "r")) == NULL) {
+        logger->error (__FILE__, __LINE__, "white-list-ip-prefix-file: %s: %s", filename, strerror (errno));
+        return;
+    }
 
-            logger->notice (__FILE__, __LINE__,
-                            "Block connection from: %s [ %d attempts, Auto blacklist ]",
-                            remote_ip, access_counter);
-        } else if (blacklisted) {
-            shutdown (fdc, SHUT_RDWR);
-            close (fdc);
+    while (getline (&line, &line_size, fp) > 0) {
+        char *prefix = line;
+        char *end;
 
-            bool notice = false;
+        lineno++;
 
-            if (entry != NULL) {
-                struct timeval tv;
-                gettimeofday (&tv, NULL);
-                if (elapsed_time (&tv, &entry->log_time) > 1800.) {
-                    notice = true;
-                    gettimeofday (&entry->log_time, NULL);
-                }
-            }
+        if ((end = strchr (prefix, '#')) != NULL) {
+            *end = '\0';
+        }
+        for (; isspace ((unsigned char) *prefix); prefix++);
+        for (end = prefix + strlen (prefix); end > prefix && isspace ((unsigned char) end[-1]); end--);
+        *end = '\0';
+
+        if (*prefix == '\0') {
+            continue;
+        } else if (!white_list->add (white_list, prefix)) {
+            logger->warning (__FILE__, __LINE__, "white-list-ip-prefix-file: %s:%d: \"%s\" ignored, not an address prefix",
+                             filename, lineno, prefix);
+        } else if (white_list->legacy_cidr (white_list, prefix, cidr, sizeof cidr)) {
+            logger->warning (__FILE__, __LINE__, "white-list-ip-prefix-file: %s:%d: \"%s\" read as %s (legacy form without /len)",
+                             filename, lineno, prefix, cidr);
+        }
+    }
 
-            logger->log (__FILE__, __LINE__, notice ? log_notice : log_debug,
-                         "Block connection from: %s [ %d attempts, blacklisted ]",
-                         remote_ip, access_counter);
-        } else {
-            int port = ntohs (rmaddr.sin6_port);
+    free (line);
+    fclose (fp);
+}
 
-            logger->trace (__FILE__, __LINE__,
-                           "Connect from [%ld]: %s (%d) [ drop ]",
-                           connection_id,
-                           remote_ip,
-                           port);
+/**
+ * Compile white-list-ip-prefix once, before any admission thread runs; lookups are lock free.
+ */
+static void load_whitelist (void) {
+    char cidr[INET6_ADDRSTRLEN + 8];
+    int i, list_size = 0;
+    char **prefixes = system_conf->string_list ("white-list-ip-prefix", &list_size);
+    const char *prefix_file = system_conf->str ("white-list-ip-prefix-file");
+
+    if ((white_list = new_ip_prefix_trie ()) == NULL) {
+        logger->error (__FILE__, __LINE__, "white-list-ip-prefix: out of memory");
+        return;
+    }
 
-            shutdown (fdc, SHUT_RDWR);
-            close (fdc);
+    for (i = 0; i < list_size; i++) {
+        if (!white_list->add (white_list, prefixes[i])) {
+            logger->warning (__FILE__, __LINE__, "white-list-ip-prefix: \"%s\" ignored, not an address prefix", prefixes[i]);
+        } else if (white_list->legacy_cidr (white_list, prefixes[i], cidr, sizeof cidr)) {
+            logger->warning (__FILE__, __LINE__, "white-list-ip-prefix: \"%s\" read as %s (legacy form without /len)", prefixes[i], cidr);
         }
-        db_svc->connection_not_allowed (remote_ip);
     }
-    pthread_mutex_unlock (&worker_mutex);
+
+    if (prefix_file != NULL) {
+        load_whitelist_file (prefix_file);
+    }
+
+    logger->info (__FILE__, __LINE__, "white-list-ip-prefix: %d prefixes", white_list->size (white_list));
 }
 
-static void main_listener (const int fd, void *args) {
-    struct sockaddr_in6 client_addr;
-    socklen_t client_len = sizeof client_addr;
+static bool check_remote_ip_in_whitelist (const struct in6_addr *address) {
+    return white_list != NULL && white_list->contains (white_list, address);
+}
 
-    int conn_sock = accept (fd, (struct sockaddr *) &client_addr, &client_len);
 
-    if (conn_sock == -1) {
-        perror ("accept");
+static void count_chunk (struct connection_info *info, const bool fromClient) {
+    if (fromClient) {
+        info->requestCount++;
     } else {
-        logger->trace (__FILE__, __LINE__, "accept (%d) [fd=%d]", conn_sock, fd);
+        info->responseCount++;
+    }
+}
 
-        accepting_request (conn_sock, ++connection_counter);
+static void account_transfer (struct connection_info *info, const bool fromClient, const ssize_t writeTotal) {
+    if (fromClient) {
+        info->bytesSent += writeTotal;
+    } else {
+        info->bytesReceived += writeTotal;
     }
 }
 
-static void *proxy_main (void *args) {
-    struct application_context_t *application_context = get_application_context();
+static void trace_proxying (const int source, const int destination, struct connection_info *info, const bool fromClient, const ssize_t len) {
+    if (logger->getPriority() >= log_trace) {
+        if (fromClient) {
+            logger->trace (__FILE__, __LINE__, "proxying %d -> %d, size: %ld, [ from: %s ]",
+                           source, destination, len, info->remote_ip);
+        } else {
+            logger->trace (__FILE__, __LINE__, "proxying %d -> %d, size: %ld, [ to: %s ]",
+                           source, destination, len, info->remote_ip);
+        }
+    }
+}
 
-    system_conf = (struct system_config_t *) application_context->get_bean (SYSTEM_CONFIG_DEFAULT_CONTEXT_NAME);
-    blacklistService = (struct auto_blacklist_service_t *) application_context->get_bean (AUTO_BLACKLIST_DEFAULT_CONTEXT_NAME);
-    packetAnalyzer = (struct packet_analyzer_t *) application_context->get_bean (PACKET_ANALYZER_DEFAULT_CONTEXT_NAME);
-    db_svc = (struct database_service_t *) application_context->get_bean (DATABASE_SERVICE_DEFAULT_CONTEXT_NAME);
+static bool too_many_requests (struct connection_info *info, const bool fromClient) {
+    if (fromClient && info->requestCount > max_allowed_requests) {
+        logger->warning (__FILE__, __LINE__, "close connection for [ %s ]: sending too many requests (%d times)",
+                         info->remote_ip, info->requestCount + 1);
+        return true;
+    }
+    return false;
+}
 
+/**
+ * Write as much of the pending chunk as the destination takes without blocking.
+ *
+ * @return true if the connection should be closed
+ */
+static bool flush_relay_buffer (const int destination, struct connection_info *info, struct relay_buffer_t *buffer, const bool fromClient) {
+    while (buffer->length > 0) {
+        ssize_t writeLen;
+
+        if (buffer->in_pipe) {
+            writeLen = splice (buffer->pipe_fds[0], NULL, destination, NULL, buffer->length, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        } else {
+            writeLen = write (destination, &buffer->data[buffer->offset], buffer->length);
+        }
+
+        if (writeLen > 0) {
+            buffer->offset += writeLen;
+            buffer->length -= writeLen;
+            account_transfer (info, fromClient, writeLen);
+        } else if (writeLen < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return false;
+        } else {
+            logger->warning (__FILE__, __LINE__, "Failed to write to destination: %s, len = %d [ %s %s ]",
+                             strerror (errno),
+                             writeLen,
+                             fromClient ? "from" : "to",
+                             info->remote_ip);
+            return true;
+        }
+    }
+
+    if (buffer->in_pipe) {
+        release_relay_pipe (info->worker, buffer->pipe_fds, true);
+        buffer->in_pipe = false;
+    }
+    if (buffer->data != NULL) {
+        free (buffer->data);
+        buffer->data = NULL;
+    }
+    buffer->offset = 0;
+
+    return false;
+}
+
+/**
+ * Move one chunk from source to destination through a pipe, the payload never enters user space.
+ * Whatever the destination does not take stays in the pipe until it becomes writable.
+ *
+ * @return true if the connection should be closed
+ */
+static bool relay_by_splice (const int source, const int destination, struct connection_info *info,
+                             const bool fromClient, struct relay_buffer_t *buffer) {
+    struct proxy_worker_t *worker = info->worker;
+
+    if (acquire_relay_pipe (worker, buffer->pipe_fds) != 0) {
+        return true;
+    }
+
+    const ssize_t len = splice (source, NULL, buffer->pipe_fds[1], NULL, RELAY_CHUNK_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+    if (len <= 0) {
+        const bool would_block = len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+
+        release_relay_pipe (worker, buffer->pipe_fds, len == 0 || would_block);
+        return !would_block;
+    }
+
+    buffer->in_pipe = true;
+    buffer->length = len;
+
+    trace_proxying (source, destination, info, fromClient, len);
+
+    if (too_many_requests (info, fromClient)) {
+        return true;
+    }
+    count_chunk (info, fromClient);
+
+    return flush_relay_buffer (destination, info, buffer, fromClient);
+}
+
+/**
+ * Read one chunk into user space (so the packet analyzer can see it) and write it to destination.
+ * Whatever the destination does not take is kept until it becomes writable.
+ *
+ * @return true if the connection should be closed
+ */
+static bool relay_by_copy (const int source, const int destination, struct connection_info *info,
+                           const bool fromClient, struct relay_buffer_t *buffer) {
+    char chunk[RELAY_CHUNK_SIZE];
+    const ssize_t len = read (source, chunk, sizeof chunk);
+
+    if (len <= 0) {
+        return ! (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+    }
+
+    trace_proxying (source, destination, info, fromClient, len);
+
+    packetAnalyzer->analyze_packet (info, fromClient, chunk, len);
+
+    if (too_many_requests (info, fromClient)) {
+        return true;
+    }
+    count_chunk (info, fromClient);
+
+    ssize_t writeLen = write (destination, chunk, len);
+
+    if (writeLen < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            logger->warning (__FILE__, __LINE__, "Failed to write to destination: %s, len = %d [ %s %s ]",
+                             strerror (errno),
+                             writeLen,
+                             fromClient ? "from" : "to",
+                             info->remote_ip);
+            return true;
+        }
+        writeLen = 0;
+    }
+
+    account_transfer (info, fromClient, writeLen);
+
+    if (writeLen < len) {
+        if ((buffer->data = malloc (RELAY_CHUNK_SIZE)) == NULL) {
+            logger->error (__FILE__, __LINE__, "malloc (%s): %s", __FUNCTION__, strerror (errno));
+            return true;
+        }
+        memcpy (buffer->data, &chunk[writeLen], len - writeLen);
+        buffer->offset = 0;
+        buffer->length = len - writeLen;
+    }
+
+    return false;
+}
+
+/**
+ * A side is only read while nothing it sent is still pending for its peer, and is only watched
+ * for writability while something is pending for it, so each direction holds at most one chunk.
+ */
+static void update_interests (struct connection_info *info) {
+    struct event_loop_t *ev = info->worker->ev;
+
+    ev->modify_event (ev, info->client_handle,
+                      (info->upstream.length == 0 ? EVENT_READ : 0) | (info->downstream.length > 0 ? EVENT_WRITE : 0));
+    ev->modify_event (ev, info->server_handle,
+                      (info->downstream.length == 0 ? EVENT_READ : 0) | (info->upstream.length > 0 ? EVENT_WRITE : 0));
+}
+
+static void arm_worker_timer (struct proxy_worker_t *worker) {
+    struct itimerspec spec;
+
+    const struct timeval *deadline = NULL;
+
+    memset (&spec, 0, sizeof spec);
+
+    if (worker->connecting_head != NULL) {
+        deadline = &worker->connecting_head->connect_deadline;
+    }
+    if (worker->admitting_head != NULL && (deadline == NULL || timercmp (&worker->admitting_head->deadline, deadline, <))) {
+        deadline = &worker->admitting_head->deadline;
+    }
+    if (worker->listen_paused && (deadline == NULL || timercmp (&worker->listen_resume, deadline, <))) {
+        deadline = &worker->listen_resume;
+    }
+
+    if (deadline != NULL) {
+        struct timeval now, remaining;
+
+        gettimeofday (&now, NULL);
+
+        if (timercmp (deadline, &now, >)) {
+            timersub (deadline, &now, &remaining);
+            spec.it_value.tv_sec = remaining.tv_sec;
+            spec.it_value.tv_nsec = remaining.tv_usec * 1000L;
+        }
+
+        if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) {
+            spec.it_value.tv_nsec = 1;
+        }
+    }
+
+    if (timerfd_settime (worker->timer_fd, 0, &spec, NULL) != 0) {
+        logger->error (__FILE__, __LINE__, "timerfd_settime (%s): %s", __FUNCTION__, strerror (errno));
+    }
+}
+
+/**
+ * The connect timeout is the same for every connection, so appending keeps the list sorted by deadline.
+ */
+static void push_connecting (struct proxy_worker_t *worker, struct connection_info *info) {
+    struct timeval timeout = {
+        .tv_sec = connect_timeout / 1000L,
+        .tv_usec = (connect_timeout % 1000L) * 1000L
+    };
+
+    gettimeofday (&info->connect_deadline, NULL);
+    timeradd (&info->connect_deadline, &timeout, &info->connect_deadline);
+
+    info->connecting = true;
+    info->connect_next = NULL;
+    info->connect_prev = worker->connecting_tail;
+
+    if (worker->connecting_tail != NULL) {
+        worker->connecting_tail->connect_next = info;
+        worker->connecting_tail = info;
+    } else {
+        worker->connecting_head = worker->connecting_tail = info;
+        arm_worker_timer (worker);
+    }
+}
+
+static void unlink_connecting (struct connection_info *info) {
+    struct proxy_worker_t *worker = info->worker;
+    const bool was_head = info == worker->connecting_head;
+
+    if (info->connect_prev != NULL) {
+        info->connect_prev->connect_next = info->connect_next;
+    } else {
+        worker->connecting_head = info->connect_next;
+    }
+
+    if (info->connect_next != NULL) {
+        info->connect_next->connect_prev = info->connect_prev;
+    } else {
+        worker->connecting_tail = info->connect_prev;
+    }
+
+    info->connecting = false;
+    info->connect_prev = info->connect_next = NULL;
+
+    if (was_head) {
+        arm_worker_timer (worker);
+    }
+}
+
+/**
+ * Tear down a connection whose upstream never became ready; nothing was relayed or recorded yet.
+ */
+static void abort_connecting (struct connection_info *info, const bool upstream_failed) {
+    struct event_loop_t *ev = info->worker->ev;
+
+    unlink_connecting (info);
+    detach_connection_info_entry (info);
+
+    ev->remove_event (ev, info->server_handle);
+    ev->remove_event (ev, info->client_handle);
+    shutdown (info->client_fd, SHUT_RDWR);
+    close (info->client_fd);
+    close (info->server_fd);
+
+    if (upstream_failed) {
+        logger->info (__FILE__, __LINE__,
+                      "Connect from [%ld]: %s (%d) [ %s:%d - remote server not responding ]",
+                      info->connection_id,
+                      info->remote_ip,
+                      info->client_port,
+                      remote_servers[info->channel].host, remote_servers[info->channel].port);
+    } else {
+        logger->debug (__FILE__, __LINE__,
+                       "Connect from [%ld]: %s (%d) [ client left before %s:%d responded ]",
+                       info->connection_id,
+                       info->remote_ip,
+                       info->client_port,
+                       remote_servers[info->channel].host, remote_servers[info->channel].port);
+    }
+
+    packetAnalyzer->release (info);
+    release_relay_buffer (info->worker, &info->upstream);
+    release_relay_buffer (info->worker, &info->downstream);
+    free_proxy_request_data (info->request_in_db);
+    info->request_in_db = NULL;
+    free (info->remote_ip);
+    free_connection_info (info);
+}
+
+/**
+ * The upstream socket turned writable (or failed), SO_ERROR tells which.
+ *
+ * @return true if the upstream is ready for relaying
+ */
+static bool complete_connect (struct connection_info *info) {
+    int error = 0;
+    socklen_t len = sizeof error;
+
+    if (getsockopt (info->server_fd, SOL_SOCKET, SO_ERROR, &error, &len) != 0) {
+        error = errno;
+    }
+
+    if (error != 0) {
+        logger->error (__FILE__, __LINE__, "connect to [%s:%d]: %s",
+                       remote_servers[info->channel].host, remote_servers[info->channel].port, strerror (error));
+        return false;
+    }
+
+    unlink_connecting (info);
+
+    if (info->request_in_db != NULL) {
+        info->nth_user = __sync_add_and_fetch (&user_counter, 1);
+    }
+
+    gettimeofday (&info->recent, NULL);
+    update_interests (info);
+
+    return true;
+}
+
+static void do_proxying (const int source, const int destination, const uint32_t events, struct connection_info *info) {
+//    static pthread_mutex_t proxying_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+    pthread_mutex_lock (&info->mutex);
+    if (info->in_chain && info->connecting) {
+        if (source != info->server_fd) {
+            abort_connecting (info, false);
+        } else if (!complete_connect (info)) {
+            abort_connecting (info, true);
+        }
+    } else if (info->in_chain) {
+        gettimeofday (&info->recent, NULL);
+        const bool fromClient = info->client_fd == source;
+        struct relay_buffer_t *inbound = fromClient ? &info->upstream : &info->downstream;
+        struct relay_buffer_t *outbound = fromClient ? &info->downstream : &info->upstream;
+        bool close_connection = false;
+
+        if (events & EVENT_WRITE) {
+            close_connection = flush_relay_buffer (source, info, outbound, !fromClient);
+        }
+
+        if (!close_connection) {
+            if ((events & EVENT_READ) && inbound->length == 0) {
+                if (splice_relay && !packetAnalyzer->wants (info, fromClient)) {
+                    close_connection = relay_by_splice (source, destination, info, fromClient, inbound);
+                } else {
+                    close_connection = relay_by_copy (source, destination, info, fromClient, inbound);
+                }
+            } else if (events & EVENT_FAILURE) {
+                close_connection = true;
+            }
+        }
+
+        if (close_connection) {
+            detach_connection_info_entry (info);
+            close_event (info, false);
+            if (!info->in_chain) {
+                free_connection_info (info);
+            }
+        } else {
+            update_interests (info);
+        }
+    }
+    pthread_mutex_unlock (&info->mutex);
+}
+
+static void proxy_from_server_to_client (const int fd, const uint32_t events, void *args) {
+    struct connection_info *info = args;
+    struct proxy_worker_t *worker = info->worker;
+
+    pthread_mutex_lock (&worker->worker_mutex);
+    do_proxying (info->server_fd, info->client_fd, events, info);
+    pthread_mutex_unlock (&worker->worker_mutex);
+}
 
-    ev = new_event_loop (logger);
+static void proxy_from_client_to_server (const int fd, const uint32_t events, void *args) {
+    struct connection_info *info = args;
+    struct proxy_worker_t *worker = info->worker;
+
+    pthread_mutex_lock (&worker->worker_mutex);
+    do_proxying (info->client_fd, info->server_fd, events, info);
+    pthread_mutex_unlock (&worker->worker_mutex);
+}
+
+/**
+ * The database circuit breaker is open: skip every lookup and let db-unavailable-policy decide,
+ * "allow-whitelist-only" sends white-listed clients to default-server, "deny" drops everyone.
+ */
+static void decide_without_database (struct admission_t *admission) {
+    const bool allow = db_unavailable_allow && check_remote_ip_in_whitelist (&admission->rmaddr.sin6_addr);
+
+    logger->debug (__FILE__, __LINE__, "Connect from [%ld]: %s [ database unavailable, %s ]",
+                   admission->connection_id, admission->remote_ip, allow ? "white-listed" : "drop");
+
+    if (!allow) {
+        db_svc->connection_not_allowed (admission->remote_ip);
+    }
+
+    admission->channel = allow ? default_server : -1;
+    admission->request_in_db = NULL;
+    admission->access_counter = 0;
+}
+
+/**
+ * Runs on an admission thread: every database and blacklist lookup for one accepted client.
+ * Only channel and request_in_db are handed back, refusals are logged and recorded here.
+ */
+static void decide_admission (struct admission_t *admission) { // {{{
+    const char *remote_ip = admission->remote_ip;
+    const struct in6_addr *address = &admission->rmaddr.sin6_addr;
+
+    if (!db_svc->is_available ()) {
+        decide_without_database (admission);
+        return;
+    }
+
+    struct db_proxy_request_t *request_in_db = admissionCache->check_available (address, remote_ip);
+    int channel = -1;
+    bool blacklisted = false;
+    bool auto_blacklisted = false;
+    int access_counter = 0;
+    struct ip_access_entry_t entry;
+    bool tracked = false;
+
+    if (request_in_db != NULL) {
+        channel = request_in_db->channel;
+    } else if (check_remote_ip_in_whitelist (address)) {
+        channel = default_server;
+
+        if (admissionCache->connection_blacklisted (address, remote_ip) > 0) {
+            blacklisted = true;
+            channel = -1;
+        }
+
+        if ((tracked = blacklistService->find_and_increase (address, &entry))) {
+            access_counter = entry.counter;
+        }
+
+        if (!blacklisted) {
+            if (on_failed_channel != default_server &&
+                    access_counter > connection_threshold - 7 &&
+                    access_counter <= connection_threshold &&
+                    access_counter % 2 == 0 &&
+                    db_svc->fail_guessing (remote_ip)) {
+                channel = on_failed_channel;
+                logger->notice (__FILE__, __LINE__,
+                                "%s: failure detected, try channel: %d", remote_ip, channel);
+            }
+
+            if (access_counter > connection_threshold) {
+                if (admissionCache->check_vip (address, remote_ip) == 0) {
+                    if (access_counter > persist_threshold) {
+                        if (db_svc->add_ip_to_auto_blacklist (remote_ip) > 0) {
+                            logger->notice (__FILE__, __LINE__,
+                                            "%s: threshold reached, add to blacklist database",
+                                            remote_ip);
+                        }
+                    }
+                    auto_blacklisted = true;
+                    channel = -1;
+                }
+            }
+
+            if (tracked && !auto_blacklisted && channel >= 0) {
+                struct timeval now;
+                gettimeofday (&now, NULL);
+                long elapsed = (long) elapsed_time (&now, &entry.log_time);
+
+                if (elapsed > 86400L * 2) {
+                    logger->notice (__FILE__, __LINE__,
+                                    "%s: elapsed time: %.2f day, connection: %d, success: %d",
+                                    remote_ip, elapsed / 86400.,
+                                    entry.counter, entry.success_counter);
+                }
+
+                if (elapsed > max_persistent_time) {
+                    if (admissionCache->check_vip (address, remote_ip) == 0) {
+                        if (db_svc->add_ip_to_auto_blacklist (remote_ip) > 0) {
+                            logger->notice (__FILE__, __LINE__,
+                                            "%s: persistent connection threshold reached, add to blacklist database",
+                                            remote_ip);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    if (channel >= 0) {
+        if (request_in_db == NULL && tracked) {
+            blacklistService->increase_success (address);
+        }
+    } else {
+        if (auto_blacklisted) {
+            logger->notice (__FILE__, __LINE__,
+                            "Block connection from: %s [ %d attempts, Auto blacklist ]",
+                            remote_ip, access_counter);
+            // the counted prefix only on request: other hosts in it may well be admitted
+            if (drop_set_prefixes && tracked) {
+                dropSet->block (&entry.address, entry.prefix_length);
+            } else {
+                dropSet->block (address, 128);
+            }
+        } else if (blacklisted) {
+            bool notice = false;
+
+            dropSet->block (address, 128);
+
+            if (tracked) {
+                notice = blacklistService->log_due (address, 1800.);
+            }
+
+            logger->log (__FILE__, __LINE__, notice ? log_notice : log_debug,
+                         "Block connection from: %s [ %d attempts, blacklisted ]",
+                         remote_ip, access_counter);
+        } else {
+            logger->trace (__FILE__, __LINE__,
+                           "Connect from [%ld]: %s (%d) [ drop ]",
+                           admission->connection_id,
+                           remote_ip,
+                           ntohs (admission->rmaddr.sin6_port));
+        }
+        db_svc->connection_not_allowed (remote_ip);
+    }
+
+    if (channel >= 0 && request_in_db != NULL) {
+        // still off the event loop: the worker only carries the id over to connection_info
+        admission->insert_id = db_svc->connection_established (request_in_db->sn, request_in_db->account, remote_ip);
+    }
+
+    admission->channel = channel;
+    admission->request_in_db = request_in_db;
+    admission->access_counter = access_counter;
+} // }}}
+
+/**
+ * Back on the worker thread: connect the admitted client to its channel, or drop it.
+ */
+static void admit_connection (struct proxy_worker_t *worker, const struct admission_t *admission,
+                              int channel, struct db_proxy_request_t *request_in_db, const int access_counter) {
+    const int fdc = admission->fd;
+    const int64_t connection_id = admission->connection_id;
+    const char *remote_ip = admission->remote_ip;
+
+    if (channel < 0) {
+        shutdown (fdc, SHUT_RDWR);
+        close (fdc);
+        return;
+    }
+
+    channel = channel < number_of_remote_servers ? channel : 0;
+
+    if (request_in_db != NULL) {
+        logger->notice (__FILE__, __LINE__,
+                        "Connect from [%ld]: %s (%d) [account: %s, channel: %d]",
+                        connection_id,
+                        remote_ip,
+                        ntohs (admission->rmaddr.sin6_port),
+                        request_in_db->account != NULL ? request_in_db->account : "(null)",
+                        channel);
+    } else {
+        logger->debug (__FILE__, __LINE__,
+                       "Connect from [%ld]: %s (%d) [channel: %d]",
+                       connection_id,
+                       remote_ip,
+                       ntohs (admission->rmaddr.sin6_port),
+                       channel);
+    }
+    int proxy_fd = take_pooled_connection (&remote_servers[channel]);
+
+    if (proxy_fd < 0) {
+        proxy_fd = connect_host (&remote_servers[channel]);
+    }
+
+    if (proxy_fd >= 0) {
+        struct connection_info *info = allocate_connection_info (worker);
+
+        info->client_fd = fdc;
+        info->server_fd = proxy_fd;
+        info->requestCount = 0;
+        info->responseCount = 0;
+        info->bytesSent = 0L;
+        info->bytesReceived = 0L;
+        info->connection_id = connection_id;
+        info->request_in_db = request_in_db;
+        info->in_chain = false;
+        info->insert_id = request_in_db != NULL ? admission->insert_id : 0;
+        info->remote_ip = strdup (remote_ip);
+        info->attempts = access_counter;
+        info->packet_analyzer_data = NULL;
+        gettimeofday (&info->started, NULL);
+        gettimeofday (&info->recent, NULL);
+        info->channel = channel;
+        info->client_port = ntohs (admission->rmaddr.sin6_port);
+        info->packet_analyzer_data = packetAnalyzer->allocate (info);
+        reset_relay_buffer (&info->upstream);
+        reset_relay_buffer (&info->downstream);
+        pthread_mutex_init (&info->mutex, NULL);
+
+        // the client stays parked (no interest) until the upstream connect completes
+        info->client_handle = worker->ev->add_event (worker->ev, info->client_fd, 0, proxy_from_client_to_server, info);
+        info->server_handle = worker->ev->add_event (worker->ev, info->server_fd, EVENT_WRITE, proxy_from_server_to_client, info);
+
+        push_connecting (worker, info);
+        attach_connection_info_entry (info);
+    } else {
+        shutdown (fdc, SHUT_RDWR);
+        close (fdc);
+        logger->info (__FILE__, __LINE__,
+                      "Connect from [%ld]: %s (%d) [ %s:%d - remote server not responding ]",
+                      connection_id,
+                      remote_ip,
+                      ntohs (admission->rmaddr.sin6_port),
+                      remote_servers[channel].host, remote_servers[channel].port);
+
+        if (request_in_db != NULL && admission->insert_id > 0) {
+            db_svc->connection_close (admission->insert_id, 0, 0, false);
+        }
+        free_proxy_request_data (request_in_db);
+    }
+}
+
+static void release_admission (struct admission_t *admission) {
+    if (__sync_sub_and_fetch (&admission->references, 1) == 0) {
+        free (admission);
+    }
+}
+
+static void unlink_admitting (struct admission_t *admission) {
+    struct proxy_worker_t *worker = admission->worker;
+
+    if (!admission->waiting) {
+        return;
+    }
+
+    const bool was_head = admission == worker->admitting_head;
+
+    if (admission->admitting_prev != NULL) {
+        admission->admitting_prev->admitting_next = admission->admitting_next;
+    } else {
+        worker->admitting_head = admission->admitting_next;
+    }
+
+    if (admission->admitting_next != NULL) {
+        admission->admitting_next->admitting_prev = admission->admitting_prev;
+    } else {
+        worker->admitting_tail = admission->admitting_prev;
+    }
+
+    admission->waiting = false;
+    admission->admitting_prev = admission->admitting_next = NULL;
+
+    if (was_head) {
+        arm_worker_timer (worker);
+    }
+}
+
+static void *admission_main (void *args) {
+    while (true) {
+        pthread_mutex_lock (&admission_mutex);
+
+        while (admission_queue_head == NULL) {
+            pthread_cond_wait (&admission_cond, &admission_mutex);
+        }
+
+        struct admission_t *admission = admission_queue_head;
+
+        if ((admission_queue_head = admission->next) == NULL) {
+            admission_queue_tail = NULL;
+        }
+        admission_queue_length--;
+        pthread_mutex_unlock (&admission_mutex);
+
+        if (admission->state != ADMISSION_PENDING) {
+            // timed out while queued, the client is gone already
+            release_admission (admission);
+            continue;
+        }
+
+        decide_admission (admission);
+
+        if (__sync_bool_compare_and_swap (&admission->state, ADMISSION_PENDING, ADMISSION_DECIDED)) {
+            struct proxy_worker_t *worker = admission->worker;
+            const uint64_t one = 1;
+
+            pthread_mutex_lock (&worker->completion_mux);
+            admission->next = worker->completed;
+            worker->completed = admission;
+            pthread_mutex_unlock (&worker->completion_mux);
+
+            if (write (worker->admission_event_fd, &one, sizeof one) < 0) {
+                logger->warning (__FILE__, __LINE__, "write (%s): %s", __FUNCTION__, strerror (errno));
+            }
+        } else {
+            // the worker gave up waiting and already applied the timeout policy
+            if (admission->insert_id > 0) {
+                db_svc->connection_close (admission->insert_id, 0, 0, false);
+            }
+            free_proxy_request_data (admission->request_in_db);
+            release_admission (admission);
+        }
+    }
+    return NULL;
+}
+
+static void admission_completed (const int fd, const uint32_t events, void *args) {
+    struct proxy_worker_t *worker = args;
+    struct admission_t *admission;
+    uint64_t counter;
+
+    if (read (fd, &counter, sizeof counter) < 0 && errno != EAGAIN) {
+        logger->warning (__FILE__, __LINE__, "read (%s): %s", __FUNCTION__, strerror (errno));
+    }
+
+    pthread_mutex_lock (&worker->completion_mux);
+    admission = worker->completed;
+    worker->completed = NULL;
+    pthread_mutex_unlock (&worker->completion_mux);
+
+    pthread_mutex_lock (&worker->worker_mutex);
+
+    while (admission != NULL) {
+        struct admission_t *next = admission->next;
+
+        unlink_admitting (admission);
+        admit_connection (worker, admission, admission->channel, admission->request_in_db, admission->access_counter);
+        free (admission);
+        admission = next;
+    }
+
+    pthread_mutex_unlock (&worker->worker_mutex);
+}
+
+static void admission_timed_out (struct admission_t *admission) {
+    unlink_admitting (admission);
+
+    if (__sync_bool_compare_and_swap (&admission->state, ADMISSION_PENDING, ADMISSION_TIMED_OUT)) {
+        const bool allow = admission_timeout_allow && check_remote_ip_in_whitelist (&admission->rmaddr.sin6_addr);
+
+        logger->warning (__FILE__, __LINE__, "Connect from [%ld]: %s [ admission timed out after %ld ms, %s ]",
+                         admission->connection_id, admission->remote_ip, admission_timeout,
+                         allow ? "allow" : "deny");
+
+        admit_connection (admission->worker, admission, allow ? default_server : -1, NULL, 0);
+        release_admission (admission);
+    }
+}
+
+/**
+ * The admission threads are that far behind: no point in queueing, apply the timeout policy now.
+ */
+static void admission_overflow (const struct admission_t *admission) {
+    struct proxy_worker_t *worker = admission->worker;
+    const bool allow = admission_timeout_allow && check_remote_ip_in_whitelist (&admission->rmaddr.sin6_addr);
+    const uint64_t overflows = __sync_add_and_fetch (&admission_queue_overflows, 1);
+    const time_t now = time (NULL);
+    const time_t reported = admission_overflow_reported;
+
+    if (now != reported && __sync_bool_compare_and_swap (&admission_overflow_reported, reported, now)) {
+        logger->warning (__FILE__, __LINE__, "Connect from [%ld]: %s [ admission queue full (%d), %s; %lu so far ]",
+                         admission->connection_id, admission->remote_ip, admission_queue_size,
+                         allow ? "allow" : "deny", overflows);
+    }
+
+    pthread_mutex_lock (&worker->worker_mutex);
+    admit_connection (worker, admission, allow ? default_server : -1, NULL, 0);
+    pthread_mutex_unlock (&worker->worker_mutex);
+}
+
+static void accepting_request (struct proxy_worker_t *worker, const int fdc, const struct sockaddr_in6 *client_addr,
+                               const int64_t connection_id) {
+    struct admission_t *admission = malloc (sizeof (struct admission_t));
+
+    if (admission == NULL) {
+        logger->error (__FILE__, __LINE__, "malloc (%s): %s", __FUNCTION__, strerror (errno));
+        close (fdc);
+        return;
+    }
+
+    admission->rmaddr = *client_addr;
+    inet_ntop (AF_INET6, & (admission->rmaddr.sin6_addr), admission->remote_ip, INET6_ADDRSTRLEN);
+    admission->worker = worker;
+    admission->fd = fdc;
+    admission->connection_id = connection_id;
+
+    pthread_mutex_lock (&admission_mutex);
+    const bool queue_full = admission_queue_size > 0 && admission_queue_length >= admission_queue_size;
+
+    if (!queue_full) {
+        // a slot is taken now; the admission goes in once it waits on the worker
+        admission_queue_length++;
+    }
+    pthread_mutex_unlock (&admission_mutex);
+
+    if (queue_full) {
+        admission_overflow (admission);
+        free (admission);
+        return;
+    }
+
+    struct timeval timeout = {
+        .tv_sec = admission_timeout / 1000L,
+        .tv_usec = (admission_timeout % 1000L) * 1000L
+    };
+
+    admission->channel = -1;
+    admission->request_in_db = NULL;
+    admission->access_counter = 0;
+    admission->insert_id = 0;
+    admission->state = ADMISSION_PENDING;
+    admission->references = 2;
+    admission->next = NULL;
+    gettimeofday (&admission->deadline, NULL);
+    timeradd (&admission->deadline, &timeout, &admission->deadline);
+
+    pthread_mutex_lock (&worker->worker_mutex);
+    admission->waiting = true;
+    admission->admitting_next = NULL;
+    admission->admitting_prev = worker->admitting_tail;
+
+    if (worker->admitting_tail != NULL) {
+        worker->admitting_tail->admitting_next = admission;
+        worker->admitting_tail = admission;
+    } else {
+        worker->admitting_head = worker->admitting_tail = admission;
+        arm_worker_timer (worker);
+    }
+    pthread_mutex_unlock (&worker->worker_mutex);
+
+    pthread_mutex_lock (&admission_mutex);
+
+    if (admission_queue_tail != NULL) {
+        admission_queue_tail->next = admission;
+    } else {
+        admission_queue_head = admission;
+    }
+    admission_queue_tail = admission;
+
+    pthread_cond_signal (&admission_cond);
+    pthread_mutex_unlock (&admission_mutex);
+}
+
+static void worker_timer_expired (const int fd, const uint32_t events, void *args) {
+    struct proxy_worker_t *worker = args;
+    uint64_t expirations;
+    struct timeval now;
+
+    if (read (fd, &expirations, sizeof expirations) < 0 && errno != EAGAIN) {
+        logger->warning (__FILE__, __LINE__, "read (%s): %s", __FUNCTION__, strerror (errno));
+    }
+
+    pthread_mutex_lock (&worker->worker_mutex);
+    gettimeofday (&now, NULL);
+
+    while (worker->connecting_head != NULL && !timercmp (&worker->connecting_head->connect_deadline, &now, >)) {
+        struct connection_info *info = worker->connecting_head;
+
+        pthread_mutex_lock (&info->mutex);
+        logger->error (__FILE__, __LINE__, "connect to [%s:%d]: timed out after %ld ms",
+                       remote_servers[info->channel].host, remote_servers[info->channel].port, connect_timeout);
+        abort_connecting (info, true);
+        pthread_mutex_unlock (&info->mutex);
+    }
+
+    while (worker->admitting_head != NULL && !timercmp (&worker->admitting_head->deadline, &now, >)) {
+        admission_timed_out (worker->admitting_head);
+    }
+
+    if (worker->listen_paused && !timercmp (&worker->listen_resume, &now, >)) {
+        worker->listen_paused = false;
+        worker->ev->modify_event (worker->ev, worker->listen_index, EVENT_READ);
+        arm_worker_timer (worker);
+    }
+
+    pthread_mutex_unlock (&worker->worker_mutex);
+}
+
+/**
+ * At most one warning per second and worker, with the errors since the previous one.
+ */
+static void report_accept_error (struct proxy_worker_t *worker, const int fd, const int error) {
+    const time_t now = time (NULL);
+
+    worker->accept_errors++;
+
+    if (now != worker->accept_error_reported) {
+        logger->warning (__FILE__, __LINE__, "accept4 (fd=%d, worker=%d): %s [ %lu errors, %lu shed, %lu pauses ]",
+                         fd, worker->id, strerror (error), worker->accept_errors - worker->accept_errors_reported,
+                         worker->accept_shed, worker->accept_pauses);
+        worker->accept_error_reported = now;
+        worker->accept_errors_reported = worker->accept_errors;
+    }
+}
+
+/**
+ * Out of descriptors, while the pending connection keeps the level-triggered listener
+ * readable. Hand back the reserve descriptor for a moment to take that connection off the
+ * queue and close it; if even that fails, stop listening for ACCEPT_PAUSE ms.
+ *
+ * @return true if a connection was shed and accepting may go on
+ */
+static bool shed_connection (struct proxy_worker_t *worker, const int fd) {
+    int conn_sock = -1;
+
+    if (worker->reserve_fd >= 0) {
+        close (worker->reserve_fd);
+
+        if ((conn_sock = accept4 (fd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+            close (conn_sock);
+            worker->accept_shed++;
+        }
+        worker->reserve_fd = open ("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+
+    if (conn_sock < 0) {
+        struct timeval pause = { .tv_sec = 0, .tv_usec = ACCEPT_PAUSE * 1000L };
+
+        pthread_mutex_lock (&worker->worker_mutex);
+        worker->accept_pauses++;
+        worker->listen_paused = true;
+        gettimeofday (&worker->listen_resume, NULL);
+        timeradd (&worker->listen_resume, &pause, &worker->listen_resume);
+        worker->ev->modify_event (worker->ev, worker->listen_index, 0);
+        arm_worker_timer (worker);
+        pthread_mutex_unlock (&worker->worker_mutex);
+    }
+    return conn_sock >= 0;
+}
+
+/**
+ * Drain the accept queue, at most accept-batch connections per wakeup so that a burst does
+ * not starve the relays of this worker; what is left keeps the listener readable.
+ */
+static void main_listener (const int fd, const uint32_t events, void *args) {
+    struct proxy_worker_t *worker = args;
+    int n, accepted = 0;
+
+    for (n = 0; n < accept_batch; n++) {
+        struct sockaddr_in6 client_addr;
+        socklen_t client_len = sizeof client_addr;
+
+        int conn_sock = accept4 (fd, (struct sockaddr *) &client_addr, &client_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (conn_sock == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                const int error = errno;
+
+                report_accept_error (worker, fd, error);
+
+                if ((error == EMFILE || error == ENFILE) && shed_connection (worker, fd)) {
+                    continue;
+                }
+            }
+            break;
+        }
+
+        logger->trace (__FILE__, __LINE__, "accept (%d) [fd=%d, worker=%d]", conn_sock, fd, worker->id);
+
+        accepting_request (worker, conn_sock, &client_addr, __sync_add_and_fetch (&connection_counter, 1));
+        accepted++;
+    }
+
+    worker->accept_wakeups++;
+    worker->accepted += accepted;
+
+    if (n == accept_batch) {
+        worker->accept_budget_exhausted++;
+    }
+    if (accepted > worker->max_accepted_per_wakeup) {
+        worker->max_accepted_per_wakeup = accepted;
+    }
+}
+
+static void *worker_main (void *args) {
+    struct proxy_worker_t *worker = args;
+    struct event_loop_t *ev = worker->ev;
+
+    logger->notice (__FILE__, __LINE__, "worker %d started (fd=%d)", worker->id, worker->listen_fd);
+
+    while (!system_conf->terminated() && ev->looping (ev) >= 0) {
+    }
+
+    logger->warning (__FILE__, __LINE__, "worker %d terminated", worker->id);
+
+    system_conf->terminate();
+
+    struct timeval tv;
+    gettimeofday (&tv, NULL);
+
+    clean_worker_connections (worker, &tv, -1.0);
+
+    while (worker->connecting_head != NULL) {
+        abort_connecting (worker->connecting_head, false);
+    }
+
+    // clients still waiting for an admission decision
+    while (worker->admitting_head != NULL) {
+        struct admission_t *admission = worker->admitting_head;
+
+        unlink_admitting (admission);
+
+        if (__sync_bool_compare_and_swap (&admission->state, ADMISSION_PENDING, ADMISSION_TIMED_OUT)) {
+            admit_connection (worker, admission, -1, NULL, 0);
+            release_admission (admission);
+        }
+    }
+
+    pthread_mutex_lock (&worker->completion_mux);
+    struct admission_t *decided = worker->completed;
+    worker->completed = NULL;
+    pthread_mutex_unlock (&worker->completion_mux);
+
+    while (decided != NULL) {
+        struct admission_t *next = decided->next;
+
+        if (decided->insert_id > 0) {
+            db_svc->connection_close (decided->insert_id, 0, 0, false);
+        }
+        admit_connection (worker, decided, -1, NULL, 0);
+        free_proxy_request_data (decided->request_in_db);
+        free (decided);
+        decided = next;
+    }
+
+    ev->remove_event (ev, worker->timer_index);
+    close (worker->timer_fd);
+    ev->remove_event (ev, worker->admission_event_index);
+    ev->remove_event (ev, worker->idle_event_index);
+
+    ev->remove_event (ev, worker->listen_index);
+    shutdown (worker->listen_fd, SHUT_RDWR);
+    close (worker->listen_fd);
+
+    if (worker->reserve_fd >= 0) {
+        close (worker->reserve_fd);
+    }
+
+    while (worker->number_of_pipes > 0) {
+        struct relay_pipe_t *relay_pipe = &worker->pipes[--worker->number_of_pipes];
+
+        close (relay_pipe->fds[0]);
+        close (relay_pipe->fds[1]);
+    }
+
+    return NULL;
+}
+
+static int somaxconn (void) {
+    FILE *fp = fopen ("/proc/sys/net/core/somaxconn", "r");
+    int value = -1;
+
+    if (fp != NULL) {
+        if (fscanf (fp, "%d", &value) != 1) {
+            value = -1;
+        }
+        fclose (fp);
+    }
+    return value;
+}
+
+/**
+ * Host wide TcpExt counters of /proc/net/netstat, a line of names followed by a line of values.
+ *
+ * @return false if the file cannot be read
+ */
+static bool read_tcp_ext_counters (struct listen_stats_t *stats) {
+    static const struct {
+        const char *name;
+        size_t offset;
+    } fields[] = {
+        { "ListenOverflows", offsetof (struct listen_stats_t, listen_overflows) },
+        { "ListenDrops", offsetof (struct listen_stats_t, listen_drops) },
+        { "TCPReqQFullDrop", offsetof (struct listen_stats_t, request_queue_full_drops) },
+        { "SyncookiesSent", offsetof (struct listen_stats_t, syncookies_sent) },
+        { "TCPDeferAcceptDrop", offsetof (struct listen_stats_t, defer_accept_drops) },
+        { "TCPFastOpenPassive", offsetof (struct listen_stats_t, fastopen_passive) },
+        { "TCPFastOpenListenOverflow", offsetof (struct listen_stats_t, fastopen_overflows) },
+    };
+    FILE *fp = fopen (PROC_NET_NETSTAT, "r");
+    char *names = NULL, *values = NULL;
+    size_t names_size = 0, values_size = 0;
+    bool found = false;
+
+    if (fp == NULL) {
+        return false;
+    }
+
+    while (!found && getline (&names, &names_size, fp) > 0 && getline (&values, &values_size, fp) > 0) {
+        char *name_save, *value_save;
+        char *name = strtok_r (names, " \n", &name_save);
+        char *value = strtok_r (values, " \n", &value_save);
+        int i;
+
+        if (name == NULL || strcmp (name, "TcpExt:") != 0) {
+            continue;
+        }
+
+        while ((name = strtok_r (NULL, " \n", &name_save)) != NULL &&
+                (value = strtok_r (NULL, " \n", &value_save)) != NULL) {
+            for (i = 0; i < sizeof fields / sizeof fields[0]; i++) {
+                if (strcmp (name, fields[i].name) == 0) {
+                    * (uint64_t *) ((char *) stats + fields[i].offset) = strtoull (value, NULL, 10);
+                }
+            }
+        }
+        found = true;
+    }
+
+    free (names);
+    free (values);
+    fclose (fp);
+
+    return found;
+}
+
+static int max_file_descriptors (void) {
+    int configured = system_conf->int_or_default ("max-file-descriptors", 0);
+    struct rlimit limit;
+
+    if (getrlimit (RLIMIT_NOFILE, &limit) != 0) {
+        logger->error (__FILE__, __LINE__, "getrlimit (%s): %s", __FUNCTION__, strerror (errno));
+        return configured;
+    }
+
+    if (configured > 0 && (rlim_t) configured > limit.rlim_cur && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = (rlim_t) configured < limit.rlim_max ? (rlim_t) configured : limit.rlim_max;
+
+        if (setrlimit (RLIMIT_NOFILE, &limit) != 0) {
+            logger->warning (__FILE__, __LINE__, "setrlimit (RLIMIT_NOFILE, %d): %s", configured, strerror (errno));
+            getrlimit (RLIMIT_NOFILE, &limit);
+        }
+    }
+
+    if (limit.rlim_cur != RLIM_INFINITY && (configured <= 0 || (rlim_t) configured > limit.rlim_cur)) {
+        configured = limit.rlim_cur > INT_MAX ? INT_MAX : (int) limit.rlim_cur;
+    }
+
+    return configured;
+}
+
+static bool init_worker (struct proxy_worker_t *worker, const int id, const int port, const bool reuse_port, const int max_fds) {
+    memset (worker, 0, sizeof (struct proxy_worker_t));
+
+    worker->id = id;
+    worker->listen_index = -1;
+    worker->timer_index = -1;
+    worker->admission_event_index = -1;
+    // kept free for shed_connection
+    worker->reserve_fd = open ("/dev/null", O_RDONLY | O_CLOEXEC);
+    pthread_mutex_init (&worker->completion_mux, NULL);
+    pthread_mutex_init (&worker->worker_mutex, NULL);
+    pthread_mutex_init (&worker->info_mux, NULL);
+    pthread_mutex_init (&worker->pool_mux, NULL);
+
+    if (splice_relay && (worker->pipes = calloc (max_idle_pipes, sizeof (struct relay_pipe_t))) == NULL) {
+        return false;
+    }
+
+    if ((worker->ev = new_event_loop (logger, max_fds)) == NULL) {
+        return false;
+    }
+
+    if ((worker->timer_fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+        logger->error (__FILE__, __LINE__, "timerfd_create (%s): %s", __FUNCTION__, strerror (errno));
+        return false;
+    }
+
+    worker->timer_index = worker->ev->add_event (worker->ev, worker->timer_fd, EVENT_READ, worker_timer_expired, worker);
+
+    if (worker->timer_index < 0) {
+        return false;
+    }
+
+    if ((worker->admission_event_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        logger->error (__FILE__, __LINE__, "eventfd (%s): %s", __FUNCTION__, strerror (errno));
+        return false;
+    }
+
+    worker->admission_event_index = worker->ev->add_event (worker->ev, worker->admission_event_fd, EVENT_READ, admission_completed, worker);
+
+    if (worker->admission_event_index < 0) {
+        return false;
+    }
+
+    if ((worker->idle_event_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        logger->error (__FILE__, __LINE__, "eventfd (%s): %s", __FUNCTION__, strerror (errno));
+        return false;
+    }
+
+    worker->idle_event_index = worker->ev->add_event (worker->ev, worker->idle_event_fd, EVENT_READ, idle_sweep_requested, worker);
+
+    if (worker->idle_event_index < 0) {
+        return false;
+    }
+
+    if ((worker->listen_fd = init_socket (port, reuse_port)) < 0) {
+        return false;
+    }
+
+    if (listen (worker->listen_fd, listen_backlog) < 0) {
+        logger->error (__FILE__, __LINE__, "listen (backlog=%d): %s", listen_backlog, strerror (errno));
+        return false;
+    }
+
+    worker->listen_index = worker->ev->add_event (worker->ev, worker->listen_fd, EVENT_READ, main_listener, worker);
+
+    return worker->listen_index >= 0;
+}
+
+static void *proxy_main (void *args) {
+    struct application_context_t *application_context = get_application_context();
+
+    system_conf = (struct system_config_t *) application_context->get_bean (SYSTEM_CONFIG_DEFAULT_CONTEXT_NAME);
+    blacklistService = (struct auto_blacklist_service_t *) application_context->get_bean (AUTO_BLACKLIST_DEFAULT_CONTEXT_NAME);
+    packetAnalyzer = (struct packet_analyzer_t *) application_context->get_bean (PACKET_ANALYZER_DEFAULT_CONTEXT_NAME);
+    db_svc = (struct database_service_t *) application_context->get_bean (DATABASE_SERVICE_DEFAULT_CONTEXT_NAME);
+    admissionCache = (struct admission_cache_t *) application_context->get_bean (ADMISSION_CACHE_DEFAULT_CONTEXT_NAME);
+    dropSet = (struct drop_set_exporter_t *) application_context->get_bean (DROP_SET_EXPORTER_DEFAULT_CONTEXT_NAME);
+    drop_set_prefixes = system_conf->int_or_default ("drop-set-prefixes", 0) != 0;
 
     const int port = system_conf->int_or_default ("port", 80);
     default_server = system_conf->int_or_default ("default-server", 0);
@@ -762,6 +2258,75 @@ static void *proxy_main (void *args) {
     max_allowed_requests = system_conf->int_or_default ("max-allowed-requests", 6);
 
     on_failed_channel = system_conf->int_or_default ("on-failed-channel", 0);
+
+    splice_relay = system_conf->int_or_default ("splice-relay", 0) != 0;
+    max_idle_pipes = system_conf->int_or_default ("splice-idle-pipes", 16);
+
+    if (max_idle_pipes < 1) {
+        max_idle_pipes = 1;
+    }
+
+    listen_backlog = system_conf->int_or_default ("listen-backlog", 4096);
+    defer_accept = system_conf->int_or_default ("tcp-defer-accept", 0);
+    fastopen_queue = system_conf->int_or_default ("tcp-fastopen", 0);
+    accept_batch = system_conf->int_or_default ("accept-batch", 64);
+
+    if (listen_backlog < 1) {
+        listen_backlog = 1;
+    }
+    if (accept_batch < 1) {
+        accept_batch = 1;
+    }
+    if (somaxconn () > 0 && listen_backlog > somaxconn ()) {
+        // the kernel silently caps it
+        logger->warning (__FILE__, __LINE__, "listen-backlog %d exceeds net.core.somaxconn (%d)", listen_backlog, somaxconn ());
+    }
+
+    connect_timeout = system_conf->int_or_default ("connect-timeout", 3000);
+    resolve_interval = system_conf->int_or_default ("resolve-interval", 300);
+
+    if ((hosts_file = system_conf->str_or_default ("hosts-file", NULL)) != NULL && hosts_file[0] == '\0') {
+        hosts_file = NULL;
+    }
+
+    upstream_pool_min = system_conf->int_or_default ("upstream-pool-min", 0);
+    upstream_pool_max = system_conf->int_or_default ("upstream-pool-max", upstream_pool_min);
+    upstream_pool_max_idle = system_conf->int_or_default ("upstream-pool-max-idle", 30);
+
+    if (upstream_pool_min < 0) {
+        upstream_pool_min = 0;
+    }
+    if (upstream_pool_max < upstream_pool_min) {
+        upstream_pool_max = upstream_pool_min;
+    }
+
+    int admission_threads = system_conf->int_or_default ("admission-threads", 4);
+    const char *admission_policy = system_conf->str_or_default ("admission-timeout-policy", "allow");
+
+    admission_timeout = system_conf->int_or_default ("admission-timeout", 2000);
+    admission_queue_size = system_conf->int_or_default ("admission-queue-size", 4096);
+    admission_timeout_allow = strcasecmp (admission_policy, "deny") != 0;
+    db_unavailable_allow = strcasecmp (system_conf->str_or_default ("db-unavailable-policy", "allow-whitelist-only"), "deny") != 0;
+
+    load_whitelist ();
+
+    if (admission_timeout < 1) {
+        admission_timeout = 1;
+    }
+    if (admission_threads < 1) {
+        admission_threads = 1;
+    }
+
+    if (connect_timeout < 1) {
+        connect_timeout = 1;
+    }
+
+    int i, worker_threads = system_conf->int_or_default ("worker-threads", 1);
+
+    if (worker_threads < 1) {
+        worker_threads = 1;
+    }
+
     db_svc->reload_product_names ();
 
     if (number_of_remote_servers > 0) {
@@ -825,6 +2390,15 @@ static void *proxy_main (void *args) {
                     switch (j) {
                     case 1:
                         remote_servers[i].host = strndup ((char *) substring_start, substring_length);
+                        pthread_rwlock_init (&remote_servers[i].lock, NULL);
+                        remote_servers[i].resolved = false;
+                        pthread_mutex_init (&remote_servers[i].pool_mutex, NULL);
+                        remote_servers[i].pool = upstream_pool_max > 0
+                                                 ? calloc (upstream_pool_max, sizeof (struct pooled_connection_t)) : NULL;
+                        remote_servers[i].pool_size = 0;
+                        remote_servers[i].pool_target = upstream_pool_min;
+                        remote_servers[i].pool_hits = 0L;
+                        remote_servers[i].pool_misses = 0L;
                         break;
                     case 2:
                         remote_servers[i].port = atoi ((char *) substring_start);
@@ -837,36 +2411,74 @@ static void *proxy_main (void *args) {
             pcre2_match_data_free (match_data);
         }
         pcre2_code_free (re);
+
+        // resolve once here, the accept path only reads the cached addresses
+        for (i = 0; i < number_of_remote_servers; i++) {
+            resolve_remote_server (&remote_servers[i]);
+        }
+
+        if (resolve_interval > 0) {
+            pthread_t resolver_thread;
+
+            if (pthread_create (&resolver_thread, NULL, resolver_main, NULL) == 0) {
+                pthread_detach (resolver_thread);
+            } else {
+                logger->error (__FILE__, __LINE__, "pthread_create (%s): %s", __FUNCTION__, strerror (errno));
+            }
+        }
+
+        if (upstream_pool_max > 0) {
+            pthread_t pool_thread;
+
+            if (pthread_create (&pool_thread, NULL, upstream_pool_main, NULL) == 0) {
+                pthread_detach (pool_thread);
+            } else {
+                logger->error (__FILE__, __LINE__, "pthread_create (%s): %s", __FUNCTION__, strerror (errno));
+            }
+        }
     }
 
-    fprintf (stderr, "Listen on: %d\n", port);
+    for (i = 0; i < admission_threads; i++) {
+        pthread_t admission_thread;
+
+        if (pthread_create (&admission_thread, NULL, admission_main, NULL) != 0) {
+            logger->error (__FILE__, __LINE__, "pthread_create (%s): %s", __FUNCTION__, strerror (errno));
+            system_conf->terminate();
+            exit (EXIT_FAILURE);
+        }
+        pthread_detach (admission_thread);
+    }
 
-    int sockfd = init_socket (port);
+    const int max_fds = max_file_descriptors();
 
-    if (sockfd >= 0) {
-        listen (sockfd, 5);
+    fprintf (stderr, "Listen on: %d (%d worker thread(s), max file descriptors: %d)\n", port, worker_threads, max_fds);
 
-        int index = ev->add_event (sockfd, main_listener, NULL);
+    struct proxy_worker_t *worker_list = calloc (worker_threads, sizeof (struct proxy_worker_t));
 
-        while (!system_conf->terminated() && ev->looping() >= 0) {
+    for (i = 0; i < worker_threads; i++) {
+        if (!init_worker (&worker_list[i], i, port, worker_threads > 1, max_fds)) {
+            system_conf->terminate();
+            exit (EXIT_FAILURE);
         }
+    }
 
-        logger->warning (__FILE__, __LINE__, "proxying terminated");
+    workers = worker_list;
+    __sync_synchronize();
+    number_of_workers = worker_threads;
 
-        system_conf->terminate();
+    for (i = 1; i < number_of_workers; i++) {
+        pthread_create (&workers[i].thread, NULL, worker_main, &workers[i]);
+    }
 
-        struct timeval tv;
-        gettimeofday (&tv, NULL);
+    workers[0].thread = pthread_self();
+    worker_main (&workers[0]);
 
-        clean_idle_connections (&tv, -1.0);
-        ev->remove_event (index);
-        shutdown (sockfd, SHUT_RDWR);
-        close (sockfd);
-    } else {
-        system_conf->terminate();
-        exit (EXIT_FAILURE);
+    for (i = 1; i < number_of_workers; i++) {
+        pthread_join (workers[i].thread, NULL);
     }
 
+    logger->warning (__FILE__, __LINE__, "proxying terminated");
+
     return NULL;
 }
 
@@ -898,6 +2510,45 @@ static int set_fallback_channel (const int channel) {
     return on_failed_channel;
 }
 
+static int get_number_of_workers (void) {
+    return number_of_workers;
+}
+
+static bool get_event_stats (const int worker, struct event_loop_stats_t *stats) {
+    if (worker >= 0 && worker < number_of_workers) {
+        workers[worker].ev->get_stats (workers[worker].ev, stats);
+        return true;
+    }
+    return false;
+}
+
+static void get_listen_stats (struct listen_stats_t *stats) {
+    int i;
+
+    memset (stats, 0, sizeof (struct listen_stats_t));
+
+    stats->backlog = listen_backlog;
+    stats->somaxconn = somaxconn ();
+    stats->defer_accept = defer_accept;
+    stats->fastopen = fastopen_queue;
+    stats->accept_batch = accept_batch;
+
+    for (i = 0; i < number_of_workers; i++) {
+        stats->accepted += workers[i].accepted;
+        stats->wakeups += workers[i].accept_wakeups;
+        stats->budget_exhausted += workers[i].accept_budget_exhausted;
+        stats->errors += workers[i].accept_errors;
+        stats->shed += workers[i].accept_shed;
+        stats->pauses += workers[i].accept_pauses;
+
+        if (workers[i].max_accepted_per_wakeup > stats->max_per_wakeup) {
+            stats->max_per_wakeup = workers[i].max_accepted_per_wakeup;
+        }
+    }
+
+    stats->netstat_available = read_tcp_ext_counters (stats);
+}
+
 static int start_proxying (pthread_t *thread) {
     return pthread_create (thread, NULL, proxy_main, NULL);
 }
@@ -927,6 +2578,9 @@ static struct proxying_service_t instance = {
     .set_fallback_channel = set_fallback_channel,
     .get_default_channel = get_default_channel,
     .get_fallback_channel = get_fallback_channel,
+    .get_number_of_workers = get_number_of_workers,
+    .get_event_stats = get_event_stats,
+    .get_listen_stats = get_listen_stats,
 };
 
 struct proxying_service_t * init_proxying_service () {
@@ -9,7 +9,7 @@
 #include "context.h"
 #include "logger.h"
 
-#define MAX_INT_STK_LEN        64
+#define INITIAL_STK_LEN        64
 
 enum stack_type_enum {
     IntegerStack,
@@ -43,8 +43,10 @@ static struct sysconf_entry_t *sysconf_cursor = NULL;
 static volatile bool terminate_flag = false;
 
 static enum stack_type_enum stack_type = UninitializedStack;
-static struct generic_stack stk[MAX_INT_STK_LEN];
+static struct generic_stack *stk = NULL;
+static int stk_len = 0;
 static int sp = 0;
+static int truncated = 0;
 
 //static struct system_config_data_t singleton_data, *data;
 
@@ -191,7 +193,11 @@ static void add_prepared_list (const char *entry) {
     default:
         break;
     }
+    if (truncated > 0) {
+        logger->error (__FILE__, __LINE__, "%s: out of memory, %d list entries dropped", entry, truncated);
+    }
     sp = 0;
+    truncated = 0;
     stack_type = UninitializedStack;
 }
 
@@ -203,9 +209,27 @@ static void set_list_as_string (void) {
     stack_type = StringStack;
 }
 
+/**
+ * make room for one more list entry, the stack grows as long as the list does
+ */
+static bool stack_reserve (void) {
+    if (sp == stk_len) {
+        int len = stk_len == 0 ? INITIAL_STK_LEN : stk_len * 2;
+        struct generic_stack *ptr = realloc (stk, len * sizeof (struct generic_stack));
+
+        if (ptr == NULL) {
+            truncated++;
+            return false;
+        }
+        stk = ptr;
+        stk_len = len;
+    }
+    return true;
+}
+
 static void list_append_int (char *entry) {
     if (entry != NULL) {
-        if (sp < MAX_INT_STK_LEN) {
+        if (stack_reserve ()) {
             stk[sp++].intval = atoi (entry);
         }
         free (entry);
@@ -214,7 +238,7 @@ static void list_append_int (char *entry) {
 
 static void list_append_str (char *entry) {
     if (entry != NULL) {
-        if (sp < MAX_INT_STK_LEN) {
+        if (stack_reserve ()) {
             stk[sp++].str = dup_quoted_string (entry);
         }
         free (entry);